@@ -0,0 +1,154 @@
+/*
+ * audiobuf.c
+ *
+ * Single producer, single consumer ring of speech blocks. The speech
+ * thread only moves the write count and the writer thread only the read
+ * count, so a block is handed over with a barrier and no lock. At 50
+ * blocks a second nothing here shows up next to the video.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <xdc/std.h>
+
+#include <ti/sdo/dmai/Dmai.h>
+
+#include "audiobuf.h"
+#include "barrier.h"
+
+#define MODULE_NAME     "AudioBuf"
+
+/* In front of every block in the ring */
+typedef struct AudioBlock {
+    UInt64  time;
+} AudioBlock;
+
+struct AudioBuf {
+    Int8           *ring;
+    Int             numBlocks;
+    Int32           blockSize;
+    Int32           stride;     /* header and block */
+    volatile UInt32 wr;         /* blocks put, only the speech thread */
+    volatile UInt32 rd;         /* blocks released, only the writer */
+    AudioBufStats   stats;
+};
+
+/******************************************************************************
+ * blockAt
+ ******************************************************************************/
+static AudioBlock *blockAt(AudioBuf *ab, UInt32 n)
+{
+    return (AudioBlock *) (ab->ring + (n % ab->numBlocks) * ab->stride);
+}
+
+/******************************************************************************
+ * audioBufCreate
+ ******************************************************************************/
+AudioBuf *audioBufCreate(Int numBlocks, Int32 blockSize)
+{
+    AudioBuf *ab;
+
+    ab = calloc(1, sizeof(AudioBuf));
+
+    if (ab == NULL) {
+        Dmai_err0("Failed to allocate audio buffer object\n");
+        return NULL;
+    }
+
+    ab->numBlocks = numBlocks;
+    ab->blockSize = blockSize;
+    ab->stride = sizeof(AudioBlock) + (blockSize + 7) / 8 * 8;
+    ab->ring = malloc(numBlocks * ab->stride);
+
+    if (ab->ring == NULL) {
+        Dmai_err1("Failed to allocate %d block audio buffer\n", numBlocks);
+        free(ab);
+        return NULL;
+    }
+
+    return ab;
+}
+
+/******************************************************************************
+ * audioBufPut
+ ******************************************************************************/
+Int audioBufPut(AudioBuf *ab, Int8 *buf, UInt64 time)
+{
+    AudioBlock *block;
+
+    ab->stats.blocks++;
+
+    if (ab->wr - ab->rd == (UInt32) ab->numBlocks) {
+        ab->stats.dropped++;
+        return Dmai_EFAIL;
+    }
+
+    block = blockAt(ab, ab->wr);
+    block->time = time;
+    memcpy(block + 1, buf, ab->blockSize);
+
+    /* The block has to be complete before the writer can see it */
+    memoryBarrier();
+    ab->wr++;
+
+    return Dmai_EOK;
+}
+
+/******************************************************************************
+ * audioBufPeek
+ ******************************************************************************/
+Int8 *audioBufPeek(AudioBuf *ab, UInt64 *time)
+{
+    AudioBlock *block;
+
+    if (ab->rd == ab->wr) {
+        return NULL;
+    }
+
+    memoryBarrier();
+    block = blockAt(ab, ab->rd);
+    *time = block->time;
+
+    return (Int8 *) (block + 1);
+}
+
+/******************************************************************************
+ * audioBufRelease
+ ******************************************************************************/
+Void audioBufRelease(AudioBuf *ab)
+{
+    if (ab->rd != ab->wr) {
+        /* Done reading the block before the speech thread may reuse it */
+        memoryBarrier();
+        ab->rd++;
+    }
+}
+
+/******************************************************************************
+ * audioBufGetBlockSize
+ ******************************************************************************/
+Int32 audioBufGetBlockSize(AudioBuf *ab)
+{
+    return ab->blockSize;
+}
+
+/******************************************************************************
+ * audioBufGetStats
+ ******************************************************************************/
+Void audioBufGetStats(AudioBuf *ab, AudioBufStats *stats)
+{
+    /* Only counted by the speech thread, good enough once it is done */
+    *stats = ab->stats;
+}
+
+/******************************************************************************
+ * audioBufDelete
+ ******************************************************************************/
+Void audioBufDelete(AudioBuf *ab)
+{
+    if (ab) {
+        free(ab->ring);
+        free(ab);
+    }
+}
@@ -0,0 +1,45 @@
+/*
+ * audiobuf.h
+ *
+ * Hands the encoded speech blocks from the speech thread to the writer
+ * thread, each with the time it was captured, so the recording can carry
+ * audio next to the video. Neither side ever waits for the other.
+ */
+
+#ifndef _AUDIOBUF_H
+#define _AUDIOBUF_H
+
+#include <xdc/std.h>
+
+typedef struct AudioBuf AudioBuf;
+
+/* What the ring did so far */
+typedef struct AudioBufStats {
+    UInt32  blocks;             /* blocks put */
+    UInt32  dropped;            /* blocks lost because the ring was full */
+} AudioBufStats;
+
+/* Create a ring of numBlocks blocks of blockSize bytes */
+extern AudioBuf *audioBufCreate(Int numBlocks, Int32 blockSize);
+
+/*
+ * Copy in a block captured at time (microseconds), only from the speech
+ * thread. Dropped if the writer has fallen that far behind.
+ */
+extern Int audioBufPut(AudioBuf *ab, Int8 *buf, UInt64 time);
+
+/* Oldest block not released yet, NULL if there is none */
+extern Int8 *audioBufPeek(AudioBuf *ab, UInt64 *time);
+
+/* Done with the block returned by audioBufPeek() */
+extern Void audioBufRelease(AudioBuf *ab);
+
+/* Bytes of every block */
+extern Int32 audioBufGetBlockSize(AudioBuf *ab);
+
+/* Copy of the statistics */
+extern Void audioBufGetStats(AudioBuf *ab, AudioBufStats *stats);
+
+extern Void audioBufDelete(AudioBuf *ab);
+
+#endif /* _AUDIOBUF_H */
@@ -0,0 +1,23 @@
+/*
+ * barrier.h
+ *
+ * Memory barrier for the lock free hand-overs between threads and
+ * processes: the shm ring, the speech ring and the latency histograms.
+ * Host builds of the benchmarks use it too, it needs nothing but C.
+ */
+
+#ifndef _BARRIER_H
+#define _BARRIER_H
+
+/*
+ * Orders the data accesses against the counter updates that publish them.
+ * The ARM926 on the DM365 is uniprocessor, so keeping the compiler from
+ * reordering is enough there.
+ */
+#if defined(__arm__)
+#define memoryBarrier()  __asm__ __volatile__ ("" : : : "memory")
+#else
+#define memoryBarrier()  __sync_synchronize()
+#endif
+
+#endif /* _BARRIER_H */
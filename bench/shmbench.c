@@ -0,0 +1,160 @@
+/*
+ * shmbench.c
+ *
+ * Host benchmark for the shm transport. Publishes frames through writeShm()
+ * (encoder output copied into the ring) and through leaseShm()/commitShm()
+ * (encoder output written in place) and reports how many bytes the publish
+ * step copies per second in each case, and how long it takes a frame from
+ * the encoder being done to readers seeing it, as the publish latency the
+ * demo reports.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "../shm.h"
+
+#define SHM_PATH        "/tmp"
+
+/* Defaults, a generous CIF frame */
+#define DEFAULT_FRAMES  20000
+#define DEFAULT_SIZE    16384
+
+/* Frames of history the ring holds */
+#define RING_FRAMES     8
+
+/******************************************************************************
+ * nowUs
+ ******************************************************************************/
+static double nowUs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/******************************************************************************
+ * compareUs
+ ******************************************************************************/
+static int compareUs(const void *a, const void *b)
+{
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+/******************************************************************************
+ * encodeFrame
+ ******************************************************************************/
+static void encodeFrame(char *dst, unsigned int size, unsigned int seq)
+{
+    /* Stand-in for the codec writing its output */
+    memset(dst, seq & 0xff, size);
+}
+
+/******************************************************************************
+ * runBench
+ ******************************************************************************/
+static void runBench(const char *name, int zeroCopy, int frames,
+                     unsigned int size)
+{
+    SHM_ST *shm, *rd;
+    SHM_FRAME frame;
+    char *encBuf, *rdBuf, *slot;
+    double start, elapsed, encoded;
+    double copied = 0;
+    double *publishUs;
+    int i;
+
+    shm = createShm(SHM_PATH, size * RING_FRAMES, 0);
+    rd = attachShm(SHM_PATH);
+    encBuf = malloc(size);
+    rdBuf = malloc(size);
+    publishUs = malloc(frames * sizeof(double));
+
+    if (shm == NULL || rd == NULL || registerShmReader(rd) < 0 ||
+        encBuf == NULL || rdBuf == NULL || publishUs == NULL) {
+        fprintf(stderr, "Failed to set up %s run\n", name);
+        exit(EXIT_FAILURE);
+    }
+
+    memset(&frame, 0, sizeof(frame));
+    frame.size = size;
+
+    start = nowUs();
+
+    for (i = 0; i < frames; i++) {
+        /* Publish latency runs from the encoder being done to the commit */
+        if (zeroCopy) {
+            slot = leaseShm(shm, size);
+            encodeFrame(slot, size, i);
+            encoded = nowUs();
+            commitShm(shm, &frame);
+        } else {
+            encodeFrame(encBuf, size, i);
+            encoded = nowUs();
+            writeShm(shm, encBuf, &frame);
+            copied += size;
+        }
+
+        publishUs[i] = nowUs() - encoded;
+
+        /* Keep the ring drained so the writer never drops */
+        readShm(rd, rdBuf, size, NULL);
+    }
+
+    elapsed = (nowUs() - start) / 1e6;
+
+    printf("%-10s %8.0f frames/s %10.1f MB/s published %10.1f MB/s copied "
+           "%6u overruns\n", name, frames / elapsed,
+           (double) frames * size / elapsed / 1e6, copied / elapsed / 1e6,
+           shm->hdr->overruns);
+
+    qsort(publishUs, frames, sizeof(double), compareUs);
+    printf("%-10s publish latency %6.2f us p50 %6.2f us p99 %8.2f us max\n",
+           name, publishUs[frames / 2], publishUs[frames * 99 / 100],
+           publishUs[frames - 1]);
+
+    deleteShm(rd);
+    deleteShm(shm);
+    free(encBuf);
+    free(rdBuf);
+    free(publishUs);
+}
+
+/******************************************************************************
+ * main
+ ******************************************************************************/
+int main(int argc, char *argv[])
+{
+    int frames = DEFAULT_FRAMES;
+    unsigned int size = DEFAULT_SIZE;
+    int c;
+
+    while ((c = getopt(argc, argv, "n:s:h")) != -1) {
+        switch (c) {
+            case 'n':
+                frames = atoi(optarg);
+                break;
+            case 's':
+                size = atoi(optarg);
+                break;
+            default:
+                fprintf(stderr, "Usage: shmbench [-n frames] [-s bytes]\n");
+                exit(c == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+    }
+
+    printf("%d frames of %u bytes\n", frames, size);
+
+    runBench("copy", 0, frames, size);
+    runBench("zerocopy", 1, frames, size);
+
+    return 0;
+}
@@ -0,0 +1,599 @@
+/*
+ * shmstress.c
+ *
+ * Host stress harness for the shm transport. One producer publishes CIF
+ * sized H.264 frames at the capture rate and N consumer processes read them
+ * through waitShm(), the way the uplink does on the board. Reports frames/s,
+ * publish to consume latency, drops and the futex syscalls both sides made.
+ *
+ * Frame sizes come from a real elementary stream (-f) when one is given,
+ * otherwise from a simple I/P model of the 384 kbit/s CIF sub stream.
+ *
+ * The producer can keep several slots leased ahead (-W) like the publish
+ * thread does, and the run checks that the ring still holds the history
+ * it is sized for rather than one worst case slot per frame.
+ *
+ * Exits with failure if a consumer saw a corrupted frame, a frame went
+ * missing without being counted as a drop or the ring held too little, so
+ * it can gate shm.c changes.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#include "../shm.h"
+
+#define SHM_PATH        "/tmp"
+
+/* Stream id of the frame telling consumers the run is over */
+#define STREAM_END      0xffffffff
+
+/* Defaults, 100 seconds of CIF at 30 fps read by 3 consumers */
+#define DEFAULT_FRAMES      3000
+#define DEFAULT_READERS     3
+#define DEFAULT_FPS         30
+#define DEFAULT_GOP_CACHE   (256 * 1024)
+#define DEFAULT_SLOTS       1
+
+/* Ring bytes besides the slots leased, as the publish thread sizes it */
+#define DEFAULT_HISTORY     (256 * 1024)
+
+/* Size model when no stream is given */
+#define MODEL_GOP           30
+#define MODEL_I_BYTES       14000
+#define MODEL_P_BYTES       1300
+
+#define MAX_AUS             100000
+
+enum {
+    READ_COPY,
+    READ_BATCH,
+    READ_PEEK
+};
+
+typedef struct {
+    unsigned int    size;
+    unsigned int    flags;
+} AccessUnit;
+
+typedef struct {
+    unsigned int    frames;
+    unsigned int    drops;
+    unsigned int    corrupt;
+    unsigned int    waits;
+    long            csw;
+    double          p50;
+    double          p99;
+    double          max;
+} Result;
+
+static AccessUnit aus[MAX_AUS];
+static int numAus;
+
+/******************************************************************************
+ * nowUs
+ ******************************************************************************/
+static unsigned long long nowUs(void)
+{
+    struct timespec ts;
+
+    /* Same clock shm.c stamps publishTime with */
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (unsigned long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/******************************************************************************
+ * addAu
+ ******************************************************************************/
+static void addAu(unsigned int size, unsigned int flags)
+{
+    if (numAus < MAX_AUS && size > 0) {
+        aus[numAus].size = size;
+        aus[numAus].flags = flags;
+        numAus++;
+    }
+}
+
+/******************************************************************************
+ * loadStream
+ ******************************************************************************/
+static int loadStream(const char *fileName)
+{
+    unsigned char *buf;
+    long len, i, auStart = -1;
+    unsigned int flags = 0;
+    int haveSlice = 0;
+    int type, newAu;
+    FILE *f;
+
+    f = fopen(fileName, "rb");
+    if (f == NULL) {
+        fprintf(stderr, "Failed to open %s\n", fileName);
+        return -1;
+    }
+
+    fseek(f, 0, SEEK_END);
+    len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    buf = malloc(len);
+    if (buf == NULL || fread(buf, 1, len, f) != (size_t) len) {
+        fprintf(stderr, "Failed to read %s\n", fileName);
+        fclose(f);
+        free(buf);
+        return -1;
+    }
+    fclose(f);
+
+    /* Split at start codes into access units the way the encoder emits them */
+    for (i = 0; i + 3 < len; i++) {
+        if (buf[i] != 0 || buf[i + 1] != 0 || buf[i + 2] != 1) {
+            continue;
+        }
+
+        type = buf[i + 3] & 0x1f;
+
+        /* A slice with first_mb_in_slice 0 starts a new picture */
+        newAu = haveSlice &&
+                (type == 6 || type == 7 || type == 8 || type == 9 ||
+                 ((type == 1 || type == 5) && (buf[i + 4] & 0x80)));
+
+        if (newAu) {
+            addAu(i - auStart, flags);
+            auStart = -1;
+            flags = 0;
+            haveSlice = 0;
+        }
+
+        if (auStart < 0) {
+            auStart = i > 0 && buf[i - 1] == 0 ? i - 1 : i;
+        }
+
+        if (type == 1 || type == 5) {
+            haveSlice = 1;
+        }
+        if (type == 5) {
+            flags |= SHM_FLAG_KEY;
+        }
+        if (type == 7) {
+            flags |= SHM_FLAG_CONFIG;
+        }
+    }
+
+    if (auStart >= 0) {
+        addAu(len - auStart, flags);
+    }
+
+    free(buf);
+
+    if (numAus == 0) {
+        fprintf(stderr, "No access units found in %s\n", fileName);
+        return -1;
+    }
+
+    return 0;
+}
+
+/******************************************************************************
+ * modelStream
+ ******************************************************************************/
+static void modelStream(void)
+{
+    unsigned int seed = 1;
+    unsigned int mean;
+    int i;
+
+    /* One second GOPs, frame sizes within +-50% of the mean */
+    for (i = 0; i < MODEL_GOP * 10; i++) {
+        mean = i % MODEL_GOP ? MODEL_P_BYTES : MODEL_I_BYTES;
+        addAu(mean / 2 + rand_r(&seed) % mean,
+              i % MODEL_GOP ? 0 : SHM_FLAG_KEY | SHM_FLAG_CONFIG);
+    }
+}
+
+/******************************************************************************
+ * fillFrame
+ ******************************************************************************/
+static void fillFrame(char *dst, unsigned int size, unsigned int seq)
+{
+    /* Stand-in for the codec, stamped so consumers can check the payload */
+    memset(dst, seq & 0xff, size);
+    if (size >= sizeof(seq)) {
+        memcpy(dst, &seq, sizeof(seq));
+    }
+}
+
+/******************************************************************************
+ * checkFrame
+ ******************************************************************************/
+static int checkFrame(const char *src, const SHM_FRAME *frame)
+{
+    unsigned int seq;
+
+    if (frame->size < sizeof(seq)) {
+        return 0;
+    }
+
+    memcpy(&seq, src, sizeof(seq));
+
+    return seq != frame->seq ||
+           (unsigned char) src[frame->size - 1] != (frame->seq & 0xff);
+}
+
+/******************************************************************************
+ * cmpDouble
+ ******************************************************************************/
+static int cmpDouble(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+/******************************************************************************
+ * consume
+ ******************************************************************************/
+static void consume(int mode, unsigned int bufSize, int frames, int fd)
+{
+    SHM_ST *rd;
+    SHM_FRAME frame, *rec;
+    struct rusage usage;
+    double *lat;
+    char *buf, *src;
+    unsigned long long now;
+    Result res;
+    int done = 0;
+    int n, i, bad;
+    char ready = 1;
+
+    memset(&res, 0, sizeof(res));
+
+    rd = attachShm(SHM_PATH);
+    buf = malloc(bufSize);
+    lat = malloc((frames + 1) * sizeof(*lat));
+
+    if (rd == NULL || registerShmReader(rd) < 0 || buf == NULL ||
+        lat == NULL) {
+        fprintf(stderr, "Consumer %d failed to attach\n", getpid());
+        _exit(EXIT_FAILURE);
+    }
+
+    /* Tell the producer we are registered */
+    if (write(fd, &ready, 1) != 1) {
+        _exit(EXIT_FAILURE);
+    }
+
+    while (!done) {
+        if (waitShm(rd, 5000) <= 0) {
+            fprintf(stderr, "Consumer %d timed out\n", getpid());
+            break;
+        }
+
+        switch (mode) {
+            case READ_COPY:
+                while (!done && readShm(rd, buf, bufSize, &frame) > 0) {
+                    if (frame.streamId == STREAM_END) {
+                        done = 1;
+                        break;
+                    }
+                    res.corrupt += checkFrame(buf, &frame);
+                    lat[res.frames++] = nowUs() - frame.publishTime;
+                }
+                break;
+
+            case READ_BATCH:
+                n = readShmBatch(rd, buf, bufSize);
+                now = nowUs();
+                rec = (SHM_FRAME *) buf;
+                for (i = 0; i < n; i++, rec = SHM_BATCH_NEXT(rec)) {
+                    if (rec->streamId == STREAM_END) {
+                        done = 1;
+                        break;
+                    }
+                    res.corrupt += checkFrame((char *) (rec + 1), rec);
+                    lat[res.frames++] = now - rec->publishTime;
+                }
+                break;
+
+            case READ_PEEK:
+                while (!done && (src = peekShm(rd, &frame)) != NULL) {
+                    bad = checkFrame(src, &frame);
+
+                    /* Reused by the writer while we looked, peek again */
+                    if (releaseShm(rd) < 0) {
+                        continue;
+                    }
+
+                    if (frame.streamId == STREAM_END) {
+                        done = 1;
+                        break;
+                    }
+                    res.corrupt += bad;
+                    lat[res.frames++] = nowUs() - frame.publishTime;
+                }
+                break;
+        }
+    }
+
+    getrusage(RUSAGE_SELF, &usage);
+
+    res.drops = rd->hdr->readers[rd->readerId].drops;
+    res.waits = rd->hdr->readers[rd->readerId].waits;
+    res.csw = usage.ru_nvcsw + usage.ru_nivcsw;
+
+    if (res.frames > 0) {
+        qsort(lat, res.frames, sizeof(*lat), cmpDouble);
+        res.p50 = lat[res.frames / 2];
+        res.p99 = lat[res.frames * 99 / 100];
+        res.max = lat[res.frames - 1];
+    }
+
+    if (write(fd, &res, sizeof(res)) != sizeof(res)) {
+        _exit(EXIT_FAILURE);
+    }
+
+    deleteShm(rd);
+    _exit(EXIT_SUCCESS);
+}
+
+/******************************************************************************
+ * printUsage
+ ******************************************************************************/
+static void printUsage(void)
+{
+    fprintf(stderr,
+        "Usage: shmstress [options]\n\n"
+        "Options:\n"
+        "-n   Frames to publish [%d]\n"
+        "-c   Consumer processes [%d]\n"
+        "-r   Frames per second, 0 for flat out [%d]\n"
+        "-f   H.264 elementary stream to take frame sizes from\n"
+        "-m   Consumer read call: copy, batch or peek [peek]\n"
+        "-g   GOP cache bytes [%d]\n"
+        "-W   Slots leased ahead of the frame being published [%d]\n"
+        "-s   Data ring bytes [(2 * slots - 1) * largest frame + %d]\n",
+        DEFAULT_FRAMES, DEFAULT_READERS, DEFAULT_FPS, DEFAULT_GOP_CACHE,
+        DEFAULT_SLOTS, DEFAULT_HISTORY);
+}
+
+/******************************************************************************
+ * main
+ ******************************************************************************/
+int main(int argc, char *argv[])
+{
+    int frames = DEFAULT_FRAMES;
+    int readers = DEFAULT_READERS;
+    int fps = DEFAULT_FPS;
+    int gopCache = DEFAULT_GOP_CACHE;
+    int slots = DEFAULT_SLOTS;
+    int mode = READ_PEEK;
+    const char *fileName = NULL;
+    unsigned int maxSize = 0, ringSize = 0, bytes = 0;
+    unsigned int reserve, held, heldBytes, seq;
+    unsigned long long start, next, elapsed;
+    struct timespec ts;
+    struct rusage usage;
+    SHM_FRAME frame;
+    SHM_ST *shm;
+    Result res, total;
+    int fds[2];
+    int failed = 0;
+    char *slot[SHM_MAX_LEASES];
+    char ready;
+    int c, i;
+
+    while ((c = getopt(argc, argv, "n:c:r:f:m:g:W:s:h")) != -1) {
+        switch (c) {
+            case 'n':
+                frames = atoi(optarg);
+                break;
+            case 'c':
+                readers = atoi(optarg);
+                break;
+            case 'r':
+                fps = atoi(optarg);
+                break;
+            case 'f':
+                fileName = optarg;
+                break;
+            case 'm':
+                if (strcmp(optarg, "copy") == 0) {
+                    mode = READ_COPY;
+                }
+                else if (strcmp(optarg, "batch") == 0) {
+                    mode = READ_BATCH;
+                }
+                else if (strcmp(optarg, "peek") == 0) {
+                    mode = READ_PEEK;
+                }
+                else {
+                    printUsage();
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'g':
+                gopCache = atoi(optarg);
+                break;
+            case 'W':
+                slots = atoi(optarg);
+                break;
+            case 's':
+                ringSize = atoi(optarg);
+                break;
+            default:
+                printUsage();
+                exit(c == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+    }
+
+    if (readers < 1 || readers > SHM_MAX_READERS) {
+        fprintf(stderr, "Between 1 and %d consumers\n", SHM_MAX_READERS);
+        exit(EXIT_FAILURE);
+    }
+
+    if (slots < 1 || slots > SHM_MAX_LEASES) {
+        fprintf(stderr, "Between 1 and %d slots\n", SHM_MAX_LEASES);
+        exit(EXIT_FAILURE);
+    }
+
+    if (fileName != NULL) {
+        if (loadStream(fileName) < 0) {
+            exit(EXIT_FAILURE);
+        }
+    }
+    else {
+        modelStream();
+    }
+
+    for (i = 0; i < numAus; i++) {
+        maxSize = aus[i].size > maxSize ? aus[i].size : maxSize;
+        bytes += aus[i].size;
+    }
+
+    /* Each slot past the first also needs room to move its frame down */
+    reserve = (2 * slots - 1) * maxSize;
+    if (ringSize == 0) {
+        ringSize = reserve + DEFAULT_HISTORY;
+    }
+
+    printf("%d frames from %s, %u bytes average, %u max, %u byte ring, "
+           "%d slots, %d consumers\n", frames, fileName ? fileName : "model",
+           bytes / numAus, maxSize, ringSize, slots, readers);
+
+    shm = createShm(SHM_PATH, ringSize, gopCache);
+    if (shm == NULL || pipe(fds) < 0) {
+        fprintf(stderr, "Failed to create shm\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < readers; i++) {
+        if (fork() == 0) {
+            close(fds[0]);
+            /* Batch records are never larger than the frames in the ring */
+            consume(mode, ringSize, frames, fds[1]);
+        }
+    }
+
+    for (i = 0; i < readers; i++) {
+        if (read(fds[0], &ready, 1) != 1) {
+            fprintf(stderr, "Consumer died before registering\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    /* Like the encoder, only know the frame size after writing it */
+    for (i = 0; i < slots; i++) {
+        slot[i] = leaseShm(shm, maxSize);
+        if (slot[i] == NULL) {
+            fprintf(stderr, "Failed to lease a slot\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    memset(&frame, 0, sizeof(frame));
+    start = next = nowUs();
+
+    for (i = 0; i <= frames; i++) {
+        if (fps > 0) {
+            ts.tv_sec = next / 1000000;
+            ts.tv_nsec = next % 1000000 * 1000;
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL)
+                   == EINTR);
+            next += 1000000 / fps;
+        }
+
+        if (i < frames) {
+            frame.size = aus[i % numAus].size;
+            frame.flags = aus[i % numAus].flags;
+            frame.streamId = 0;
+        }
+        else {
+            frame.size = sizeof(unsigned int);
+            frame.flags = 0;
+            frame.streamId = STREAM_END;
+        }
+
+        frame.captureTime = nowUs();
+        fillFrame(slot[i % slots], frame.size, i);
+        commitShm(shm, &frame);
+
+        /* The oldest slot was published, lease the next one in its place */
+        slot[i % slots] = leaseShm(shm, maxSize);
+        if (slot[i % slots] == NULL) {
+            fprintf(stderr, "Failed to lease a slot\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    elapsed = nowUs() - start;
+    getrusage(RUSAGE_SELF, &usage);
+
+    printf("producer   %8.0f frames/s %6u overruns %6u futex wakes "
+           "%6ld context switches\n",
+           frames * 1e6 / elapsed, shm->hdr->overruns, shm->hdr->wakeups,
+           usage.ru_nvcsw + usage.ru_nivcsw);
+
+    /*
+     * Frames only take the bytes they need, also those published from a
+     * slot leased behind others. Unless the index is what runs out, the
+     * ring keeps at least half of the history past the leased slots.
+     */
+    heldBytes = 0;
+    for (seq = shm->hdr->oldest; seq != shm->hdr->head; seq++) {
+        heldBytes += shm->hdr->index[seq % shm->hdr->indexSize].size;
+    }
+    held = shm->hdr->head - shm->hdr->oldest;
+
+    printf("ring       %6u frames %8u bytes held\n", held, heldBytes);
+
+    if (held < shm->hdr->indexSize / 2 && ringSize > reserve &&
+        heldBytes < (ringSize - reserve) / 2) {
+        fprintf(stderr, "Ring held %u bytes of a %u byte history\n",
+                heldBytes, ringSize - reserve);
+        failed = 1;
+    }
+
+    memset(&total, 0, sizeof(total));
+
+    for (i = 0; i < readers; i++) {
+        if (read(fds[0], &res, sizeof(res)) != sizeof(res)) {
+            fprintf(stderr, "Consumer died before reporting\n");
+            failed = 1;
+            continue;
+        }
+
+        printf("consumer %d %6u frames %6u drops %6u corrupt "
+               "p50 %6.0f us p99 %6.0f us max %6.0f us "
+               "%6u futex waits %6ld context switches\n",
+               i, res.frames, res.drops, res.corrupt, res.p50, res.p99,
+               res.max, res.waits, res.csw);
+
+        /*
+         * Every frame is either read or counted as dropped. A frame read
+         * just as the writer retires it can count as both.
+         */
+        if (res.corrupt > 0 || res.frames + res.drops < (unsigned) frames) {
+            failed = 1;
+        }
+
+        total.frames += res.frames;
+        total.drops += res.drops;
+        total.waits += res.waits;
+    }
+
+    while (wait(NULL) > 0);
+
+    printf("total      %6u frames %6u drops %6u futex waits %s\n",
+           total.frames, total.drops, total.waits, failed ? "FAIL" : "OK");
+
+    deleteShm(shm);
+
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
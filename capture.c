@@ -23,6 +23,8 @@
 #include <ti/sdo/dmai/Rendezvous.h>
 
 #include "capture.h"
+#include "frame.h"
+#include "latency.h"
 #include "../demo.h"
 
 #define MODULE_NAME     "Capture Thread"
@@ -33,12 +35,29 @@
 /* Buffering for the capture driver */
 #define NUM_CAPTURE_BUFS         3
 
-/* Number of buffers in the pipe to the capture thread */
-/* Note: It needs to match capture.c pipe size */
-#define VIDEO_PIPE_SIZE          3
-
 #define NUM_BUFS (NUM_CAPTURE_BUFS + NUM_DISPLAY_BUFS + VIDEO_PIPE_SIZE)
 
+/******************************************************************************
+ * frameRateOf
+ ******************************************************************************/
+static Int frameRateOf(VideoStd_Type videoStd)
+{
+    switch (videoStd) {
+        case VideoStd_D1_PAL:
+        case VideoStd_1080I_25:
+            return 25000;
+
+        case VideoStd_720P_50:
+            return 50000;
+
+        case VideoStd_720P_60:
+            return 60000;
+
+        default:
+            return 30000;
+    }
+}
+
 /******************************************************************************
  * captureThrFxn
  ******************************************************************************/
@@ -55,15 +74,23 @@ Void *captureThrFxn(Void *arg)
     Display_Handle        hDisplay = NULL;
     Framecopy_Handle      hFcDisp  = NULL;
     Framecopy_Handle      hFcEnc   = NULL;
+    Framecopy_Handle      hFcRsz   = NULL;
     BufTab_Handle         hBufTab  = NULL;    
     Buffer_Handle         hDstBuf, hCapBuf, hDisBuf, hRzbBuf, hBuf;
+    Buffer_Handle         hRszBuf;
     BufferGfx_Dimensions  disDim, capDim;
+    BufferGfx_Dimensions  cropDim, rszDim;
+    Bool                  rszConfigured = FALSE;
     VideoStd_Type         videoStd;
     Int32                 width, height, lcdwidth, lcdheight, bufSize, RzbbufSize;
     Int                   fifoRet;
     ColorSpace_Type       colorSpace = ColorSpace_YUV420PSEMI; //ColorSpace_UYVY;
     Int                   bufIdx;
     Bool                  frameCopy = TRUE;
+    FrameInfo            *info;
+    LatencyHist          *copyHist  = latencyCreate("copy");
+    UInt64                captureTime;
+    UInt32                frameCnt = 0;
 
 #ifdef PDEBUG
     FILE               *outFile         = NULL;
@@ -158,14 +185,17 @@ Void *captureThrFxn(Void *arg)
     gblSetImageWidth(envp->imageWidth);
     gblSetImageHeight(envp->imageHeight);
 
-    /* Report the video standard and image size back to the main thread */
-    Rendezvous_meet(envp->hRendezvousCapStd);
-
     if(envp->videoStd == VideoStd_720P_60) {
         cAttrs.videoStd = VideoStd_720P_30;
     } else {
         cAttrs.videoStd = envp->videoStd;    
     }
+
+    /* The rate frames come in at, 720P 60 is captured at 30 */
+    envp->frameRate = frameRateOf(cAttrs.videoStd);
+
+    /* Report the video standard and image size back to the main thread */
+    Rendezvous_meet(envp->hRendezvousCapStd);
     cAttrs.numBufs    = NUM_CAPTURE_BUFS;    
     cAttrs.colorSpace = colorSpace;
     cAttrs.captureDimension = &gfxAttrs.dim;
@@ -276,6 +306,27 @@ Void *captureThrFxn(Void *arg)
             ERR("Failed to configure frame copy job\n");
             cleanup(THREAD_FAILURE);
         }
+
+        /*
+         * Resizer b writes into the capture buffer, which goes back to the
+         * driver right after the copies. The video thread gets a copy of
+         * the whole resized frame, the display the middle of it.
+         */
+        BufferGfx_getDimensions(hRzbBuf, &cropDim);
+        rszDim.x          = 0;
+        rszDim.y          = 0;
+        rszDim.width      = envp->resizeWidth;
+        rszDim.height     = envp->resizeHeight;
+        rszDim.lineLength = cropDim.lineLength;
+
+        /* Create frame copy module for resized encode buffer */
+        fcAttrs.accel = TRUE;
+        hFcRsz = Framecopy_create(&fcAttrs);
+
+        if (hFcRsz == NULL) {
+            ERR("Failed to create frame copy job\n");
+            cleanup(THREAD_FAILURE);
+        }
     }else {
         for (bufIdx = 0; bufIdx < VIDEO_PIPE_SIZE; bufIdx++) {
             /* Queue the video buffers for main thread processing */
@@ -304,6 +355,8 @@ Void *captureThrFxn(Void *arg)
             cleanup(THREAD_FAILURE);
         }
 
+        captureTime = frameTime();
+
         /* Get a buffer from the display device */
         if (Display_get(hDisplay, &hDisBuf) < 0) {
             ERR("Failed to get display buffer\n");
@@ -335,18 +388,65 @@ Void *captureThrFxn(Void *arg)
                 cleanup(THREAD_FAILURE);
             }
 
+            /* Tag the frame for the encode and publish stages */
+            if ((info = getFrameInfo(hDstBuf))) {
+                info->seq         = frameCnt;
+                info->captureTime = captureTime;
+                info->copyTime    = frameTime();
+                latencyAdd(copyHist, captureTime, info->copyTime);
+            }
+
             /* Send buffer to video thread for encoding */
             if (Fifo_put(envp->hOutFifo, hDstBuf) < 0) {
                 ERR("Failed to send buffer to video thread\n");
                 cleanup(THREAD_FAILURE);
             }            
 
+            /* Get a buffer for the resized frame from the video thread */
+            fifoRet = Fifo_get(envp->hResizeInFifo, &hRszBuf);
+
+            if (fifoRet < 0) {
+                ERR("Failed to get resize buffer from video thread\n");
+                cleanup(THREAD_FAILURE);
+            }
+
+            /* Did the video thread flush the fifo? */
+            if (fifoRet == Dmai_EFLUSH) {
+                cleanup(THREAD_SUCCESS);
+            }
+
+            /* Copy all of the resized frame, the display keeps its crop */
+            BufferGfx_setDimensions(hRzbBuf, &rszDim);
+
+            if (!rszConfigured) {
+                if (Framecopy_config(hFcRsz, hRzbBuf, hRszBuf) < 0) {
+                    ERR("Failed to configure frame copy job\n");
+                    cleanup(THREAD_FAILURE);
+                }
+
+                rszConfigured = TRUE;
+            }
+
+            if (Framecopy_execute(hFcRsz, hRzbBuf, hRszBuf) < 0) {
+                ERR("Failed to execute frame copy job\n");
+                cleanup(THREAD_FAILURE);
+            }
+
+            BufferGfx_setDimensions(hRzbBuf, &cropDim);
+
             /* Send resized buffer to video thread for encoding */
-            if (Fifo_put(envp->hOutFifo, hRzbBuf) < 0) {
+            if (Fifo_put(envp->hResizeOutFifo, hRszBuf) < 0) {
                 ERR("Failed to send buffer to video thread\n");
                 cleanup(THREAD_FAILURE);
             }            
         }else {
+            /* Tag the frame for the encode and publish stages */
+            if ((info = getFrameInfo(hCapBuf))) {
+                info->seq         = frameCnt;
+                info->captureTime = captureTime;
+                info->copyTime    = captureTime;
+            }
+
             /* Send buffer to video thread for encoding */
             if (Fifo_put(envp->hOutFifo, hCapBuf) < 0) {
                 ERR("Failed to send buffer to video thread\n");
@@ -399,6 +499,8 @@ Void *captureThrFxn(Void *arg)
         /* Incremement statistics for the user interface */
         gblIncFrames();
 
+        frameCnt++;
+
     }
 
 cleanup:
@@ -407,6 +509,7 @@ cleanup:
     Rendezvous_force(envp->hRendezvousInit);
     Pause_off(envp->hPauseProcess);
     Fifo_flush(envp->hOutFifo);
+    Fifo_flush(envp->hResizeOutFifo);
 
     /* Meet up with other threads before cleaning up */
     Rendezvous_meet(envp->hRendezvousCleanup);
@@ -420,6 +523,10 @@ cleanup:
         Framecopy_delete(hFcEnc);
     }
 
+    if (hFcRsz) {
+        Framecopy_delete(hFcRsz);
+    }
+
     if (hDisplay) {
         Display_delete(hDisplay);
     }
@@ -16,9 +16,16 @@
 
 #include <ti/sdo/dmai/Fifo.h>
 #include <ti/sdo/dmai/Pause.h>
+#include <ti/sdo/dmai/Capture.h>
 #include <ti/sdo/dmai/Rendezvous.h>
 #include <ti/sdo/dmai/VideoStd.h>
 
+/*
+ * Buffers in the pipe between the capture and video threads, both of the
+ * captured frames and of the resizer b copies
+ */
+#define VIDEO_PIPE_SIZE         3
+
 /* Environment passed when creating the thread */
 typedef struct CaptureEnv {
     Rendezvous_Handle hRendezvousInit;
@@ -28,11 +35,14 @@ typedef struct CaptureEnv {
     Pause_Handle      hPauseProcess;
     Fifo_Handle       hOutFifo;
     Fifo_Handle       hInFifo;
+    Fifo_Handle       hResizeInFifo;    /* buffers to copy resizer b to */
+    Fifo_Handle       hResizeOutFifo;   /* and the copies of its frames */
     VideoStd_Type     videoStd;
     Int32             imageWidth;
     Int32             imageHeight;
     Int32             resizeWidth;
     Int32             resizeHeight;
+    Int               frameRate;        /* fps * 1000, set by the thread */
     Capture_Input     videoInput;
 } CaptureEnv;
 
@@ -0,0 +1,301 @@
+/*
+ * eventbuf.c
+ *
+ * Pre-event history of the encoded stream. Frames are packed back to back
+ * in a ring, each behind a small header, and never wrap: a frame that
+ * doesn't fit before the end of the ring goes to the start and the bytes
+ * left over are covered by a padding record. The start of every GOP is
+ * remembered, so the history is always trimmed at an IDR and whatever is
+ * left can be decoded from its first frame on.
+ *
+ * The writer thread is the only user, nothing here is locked.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <xdc/std.h>
+
+#include <ti/sdo/dmai/Dmai.h>
+
+#include "eventbuf.h"
+
+#define MODULE_NAME     "EventBuf"
+
+/* Records start on this boundary, a multiple of the header size */
+#define EVENT_ALIGN             16
+
+/* key of a record covering the unused end of the ring */
+#define EVENT_PAD               2
+
+#define alignUp(x, a)           (((x) + (a) - 1) / (a) * (a))
+
+/* In front of every frame in the ring */
+typedef struct EventFrame {
+    UInt32  size;               /* payload bytes, or record bytes if padding */
+    UInt32  key;
+    UInt64  time;
+} EventFrame;
+
+/* Where a GOP starts */
+typedef struct EventGop {
+    UInt64  pos;
+    UInt64  time;
+} EventGop;
+
+struct EventBuf {
+    Int8           *ring;
+    UInt32          size;
+    UInt64          history;    /* microseconds */
+    UInt64          rd;         /* running byte positions */
+    UInt64          wr;
+    EventGop        gops[EVENT_MAX_GOPS];
+    Int             gopFirst;
+    Int             numGops;
+    Bool            skipping;
+    EventBufStats   stats;
+};
+
+/******************************************************************************
+ * frameAt
+ ******************************************************************************/
+static EventFrame *frameAt(EventBuf *eb, UInt64 pos)
+{
+    return (EventFrame *) (eb->ring + pos % eb->size);
+}
+
+/******************************************************************************
+ * recordSize
+ ******************************************************************************/
+static UInt32 recordSize(EventFrame *frame)
+{
+    if (frame->key == EVENT_PAD) {
+        return frame->size;
+    }
+
+    return alignUp(sizeof(EventFrame) + frame->size, EVENT_ALIGN);
+}
+
+/******************************************************************************
+ * skipPadding
+ ******************************************************************************/
+static Void skipPadding(EventBuf *eb)
+{
+    if (eb->rd < eb->wr && frameAt(eb, eb->rd)->key == EVENT_PAD) {
+        eb->rd += frameAt(eb, eb->rd)->size;
+    }
+}
+
+/******************************************************************************
+ * evictGop
+ ******************************************************************************/
+static UInt32 evictGop(EventBuf *eb)
+{
+    UInt32 frames = 0;
+    UInt64 end;
+
+    if (eb->numGops > 1) {
+        end = eb->gops[(eb->gopFirst + 1) % EVENT_MAX_GOPS].pos;
+    }
+    else {
+        /* The frames to come depend on the ones dropped */
+        end = eb->wr;
+        eb->skipping = TRUE;
+    }
+
+    /* Also drops what is left of a GOP partly released */
+    while (eb->rd < end) {
+        if (frameAt(eb, eb->rd)->key != EVENT_PAD) {
+            frames++;
+        }
+        eb->rd += recordSize(frameAt(eb, eb->rd));
+    }
+
+    eb->gopFirst = (eb->gopFirst + 1) % EVENT_MAX_GOPS;
+    eb->numGops--;
+
+    return frames;
+}
+
+/******************************************************************************
+ * eventBufCreate
+ ******************************************************************************/
+EventBuf *eventBufCreate(Int32 bufSize, UInt32 historyMs)
+{
+    EventBuf *eb;
+
+    eb = calloc(1, sizeof(EventBuf));
+
+    if (eb == NULL) {
+        Dmai_err0("Failed to allocate event buffer object\n");
+        return NULL;
+    }
+
+    eb->size = alignUp(bufSize, EVENT_ALIGN);
+    eb->history = (UInt64) historyMs * 1000;
+    eb->ring = malloc(eb->size);
+
+    if (eb->ring == NULL) {
+        Dmai_err1("Failed to allocate %u byte event buffer\n", eb->size);
+        free(eb);
+        return NULL;
+    }
+
+    return eb;
+}
+
+/******************************************************************************
+ * eventBufPut
+ ******************************************************************************/
+Int eventBufPut(EventBuf *eb, Int8 *buf, Int32 size, UInt64 time, Bool key)
+{
+    EventFrame *frame;
+    UInt32      need = alignUp(sizeof(EventFrame) + size, EVENT_ALIGN);
+    UInt32      pad;
+
+    /* The history has to start at an IDR */
+    if ((eb->numGops == 0 || eb->skipping) && !key) {
+        eb->stats.skipped++;
+        return Dmai_EFAIL;
+    }
+
+    if (need > eb->size) {
+        Dmai_err1("Dropping %d byte frame, too large for the history\n", size);
+        eb->skipping = TRUE;
+        eb->stats.skipped++;
+        return Dmai_EFAIL;
+    }
+
+    /* A new GOP needs an entry, the oldest one makes room */
+    if (key && eb->numGops == EVENT_MAX_GOPS) {
+        eb->stats.evicted += evictGop(eb);
+    }
+
+    while (TRUE) {
+        /* The frame and the padding in front of it if it has to wrap */
+        pad = eb->size - eb->wr % eb->size;
+        pad = pad < need ? pad : 0;
+
+        /* An empty ring just starts over */
+        if (eb->rd == eb->wr) {
+            eb->wr += pad;
+            eb->rd = eb->wr;
+            pad = 0;
+            break;
+        }
+
+        if (eb->wr + pad + need - eb->rd <= eb->size) {
+            break;
+        }
+
+        eb->stats.evicted += evictGop(eb);
+    }
+
+    if (eb->skipping && !key) {
+        eb->stats.skipped++;
+        return Dmai_EFAIL;
+    }
+
+    if (pad) {
+        frame = frameAt(eb, eb->wr);
+        frame->size = pad;
+        frame->key = EVENT_PAD;
+        eb->wr += pad;
+    }
+
+    if (key) {
+        eb->gops[(eb->gopFirst + eb->numGops) % EVENT_MAX_GOPS].pos = eb->wr;
+        eb->gops[(eb->gopFirst + eb->numGops) % EVENT_MAX_GOPS].time = time;
+        eb->numGops++;
+        eb->skipping = FALSE;
+    }
+
+    frame = frameAt(eb, eb->wr);
+    frame->size = size;
+    frame->key = key;
+    frame->time = time;
+    memcpy(frame + 1, buf, size);
+    eb->wr += need;
+
+    eb->stats.frames++;
+    if (eb->wr - eb->rd > eb->stats.maxBytes) {
+        eb->stats.maxBytes = eb->wr - eb->rd;
+    }
+
+    return Dmai_EOK;
+}
+
+/******************************************************************************
+ * eventBufAge
+ ******************************************************************************/
+Void eventBufAge(EventBuf *eb, UInt64 time)
+{
+    /* Keep the newest GOP that is at least as old as the history */
+    while (eb->numGops > 1 &&
+           time - eb->gops[(eb->gopFirst + 1) % EVENT_MAX_GOPS].time >=
+           eb->history) {
+        evictGop(eb);
+    }
+}
+
+/******************************************************************************
+ * eventBufPeek
+ ******************************************************************************/
+Int8 *eventBufPeek(EventBuf *eb, Int32 *size, UInt64 *time, Bool *key)
+{
+    EventFrame *frame;
+
+    skipPadding(eb);
+
+    if (eb->rd == eb->wr) {
+        return NULL;
+    }
+
+    frame = frameAt(eb, eb->rd);
+    *size = frame->size;
+    *time = frame->time;
+    *key = frame->key ? TRUE : FALSE;
+
+    return (Int8 *) (frame + 1);
+}
+
+/******************************************************************************
+ * eventBufRelease
+ ******************************************************************************/
+Void eventBufRelease(EventBuf *eb)
+{
+    skipPadding(eb);
+
+    if (eb->rd == eb->wr) {
+        return;
+    }
+
+    eb->rd += recordSize(frameAt(eb, eb->rd));
+    skipPadding(eb);
+
+    /* The oldest GOP is gone once the next one is reached */
+    if (eb->numGops > 1 &&
+        eb->rd == eb->gops[(eb->gopFirst + 1) % EVENT_MAX_GOPS].pos) {
+        eb->gopFirst = (eb->gopFirst + 1) % EVENT_MAX_GOPS;
+        eb->numGops--;
+    }
+}
+
+/******************************************************************************
+ * eventBufGetStats
+ ******************************************************************************/
+Void eventBufGetStats(EventBuf *eb, EventBufStats *stats)
+{
+    *stats = eb->stats;
+}
+
+/******************************************************************************
+ * eventBufDelete
+ ******************************************************************************/
+Void eventBufDelete(EventBuf *eb)
+{
+    if (eb) {
+        free(eb->ring);
+        free(eb);
+    }
+}
@@ -0,0 +1,52 @@
+/*
+ * eventbuf.h
+ *
+ * Pre-event history of the encoded stream. Frames are kept in RAM in whole
+ * GOPs, so when an event comes the recording can start some seconds before
+ * it, at an IDR.
+ */
+
+#ifndef _EVENTBUF_H
+#define _EVENTBUF_H
+
+#include <xdc/std.h>
+
+/* Most GOPs the history can hold, older ones are dropped */
+#define EVENT_MAX_GOPS          64
+
+typedef struct EventBuf EventBuf;
+
+/* What the history did so far */
+typedef struct EventBufStats {
+    UInt32  frames;             /* frames stored */
+    UInt32  skipped;            /* frames not stored waiting for an IDR */
+    UInt32  evicted;            /* frames pushed out early for lack of room */
+    UInt32  maxBytes;           /* most bytes held at the same time */
+} EventBufStats;
+
+/* Create a history of bufSize bytes covering at least historyMs */
+extern EventBuf *eventBufCreate(Int32 bufSize, UInt32 historyMs);
+
+/*
+ * Copy in a frame captured at time (microseconds), key if it is an IDR.
+ * The oldest GOPs make room for it if the buffer is full.
+ */
+extern Int eventBufPut(EventBuf *eb, Int8 *buf, Int32 size, UInt64 time,
+                       Bool key);
+
+/* Drop the oldest GOPs as long as the rest covers the history at time */
+extern Void eventBufAge(EventBuf *eb, UInt64 time);
+
+/* Oldest frame still held, NULL if there is none */
+extern Int8 *eventBufPeek(EventBuf *eb, Int32 *size, UInt64 *time,
+                          Bool *key);
+
+/* Done with the frame returned by eventBufPeek() */
+extern Void eventBufRelease(EventBuf *eb);
+
+/* Copy of the statistics */
+extern Void eventBufGetStats(EventBuf *eb, EventBufStats *stats);
+
+extern Void eventBufDelete(EventBuf *eb);
+
+#endif /* _EVENTBUF_H */
@@ -0,0 +1,72 @@
+/*
+ * frame.c
+ *
+ * Per frame information that travels through the pipeline alongside the
+ * DMAI buffers. The slot of a buffer is only written by the thread that
+ * currently owns the buffer; handing the buffer over through a Fifo hands
+ * over the information with it.
+ */
+
+#include <time.h>
+#include <pthread.h>
+
+#include <xdc/std.h>
+
+#include <ti/sdo/dmai/Dmai.h>
+#include <ti/sdo/dmai/Buffer.h>
+
+#include "frame.h"
+
+#define MODULE_NAME     "Frame"
+
+typedef struct FrameSlot {
+    Buffer_Handle   hBuf;
+    FrameInfo       info;
+} FrameSlot;
+
+static FrameSlot        slots[FRAME_MAX_BUFS];
+static Int              numSlots;
+static pthread_mutex_t  slotMutex = PTHREAD_MUTEX_INITIALIZER;
+
+/******************************************************************************
+ * frameTime
+ ******************************************************************************/
+UInt64 frameTime(Void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (UInt64) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/******************************************************************************
+ * getFrameInfo
+ ******************************************************************************/
+FrameInfo *getFrameInfo(Buffer_Handle hBuf)
+{
+    FrameInfo *info = NULL;
+    Int i;
+
+    pthread_mutex_lock(&slotMutex);
+
+    for (i = 0; i < numSlots; i++) {
+        if (slots[i].hBuf == hBuf) {
+            info = &slots[i].info;
+            break;
+        }
+    }
+
+    if (info == NULL && numSlots < FRAME_MAX_BUFS) {
+        slots[numSlots].hBuf = hBuf;
+        info = &slots[numSlots++].info;
+    }
+
+    pthread_mutex_unlock(&slotMutex);
+
+    if (info == NULL) {
+        Dmai_err1("No frame information slot left for buffer %p\n", hBuf);
+    }
+
+    return info;
+}
@@ -0,0 +1,33 @@
+/*
+ * frame.h
+ *
+ * Per frame information that travels through the pipeline alongside the
+ * DMAI buffers, which have no room for it themselves.
+ */
+
+#ifndef _FRAME_H
+#define _FRAME_H
+
+#include <xdc/std.h>
+
+#include <ti/sdo/dmai/Buffer.h>
+
+/* Most buffers that can carry frame information at the same time */
+#define FRAME_MAX_BUFS          32
+
+/* Information about the frame a buffer currently holds */
+typedef struct FrameInfo {
+    UInt32  seq;                /* capture frame number */
+    UInt64  captureTime;        /* frameTime() when the frame was captured */
+    UInt64  copyTime;           /* copied for the encoder, or captureTime */
+    UInt64  encodeStart;        /* this stream's Venc1_process() called */
+    UInt64  encodeTime;         /* and returned */
+} FrameInfo;
+
+/* Monotonic time in microseconds */
+extern UInt64 frameTime(Void);
+
+/* Information slot for a buffer, created on first use */
+extern FrameInfo *getFrameInfo(Buffer_Handle hBuf);
+
+#endif /* _FRAME_H */
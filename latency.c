@@ -0,0 +1,321 @@
+/*
+ * latency.c
+ *
+ * Per stage latency histograms. A stage is timed by one thread only, so
+ * adding a frame is a few plain stores. A reader copying a histogram
+ * checks a generation count the writer bumps before and after each
+ * update, odd while it is under way, and copies again if it changed:
+ * the real time threads never wait for the report.
+ *
+ * The reporter thread runs without real time priority and writes the
+ * table to a temporary file it then renames, readers of the file always
+ * see a whole report.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include <xdc/std.h>
+
+#include <ti/sdo/dmai/Dmai.h>
+
+#include "latency.h"
+#include "barrier.h"
+
+#define MODULE_NAME     "Latency"
+
+#define LATENCY_PATH_LEN        64
+
+struct LatencyHist {
+    Char            name[LATENCY_NAME_LEN];
+    volatile UInt32 gen;        /* odd while the writer updates */
+    UInt32          frames;
+    UInt32          maxUs;
+    UInt64          totalUs;
+    UInt32          buckets[LATENCY_BUCKETS];
+};
+
+static LatencyHist      hists[LATENCY_MAX_HISTS];
+static volatile Int     numHists;
+static pthread_mutex_t  histMutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* The reporter thread */
+static pthread_t        reporter;
+static Bool             reporting;
+static Bool             stopping;
+static pthread_mutex_t  reportMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   reportCond = PTHREAD_COND_INITIALIZER;
+static Char             reportPath[LATENCY_PATH_LEN];
+static Int              reportSecs;
+
+/******************************************************************************
+ * bucketOf
+ ******************************************************************************/
+static Int bucketOf(UInt32 us)
+{
+    Int log2;
+
+    if (us < LATENCY_SUB_BUCKETS) {
+        return us;
+    }
+
+    /* The power of two, then which quarter of it */
+    log2 = 31 - __builtin_clz(us);
+
+    return (log2 - 1) * LATENCY_SUB_BUCKETS +
+           ((us >> (log2 - 2)) & (LATENCY_SUB_BUCKETS - 1));
+}
+
+/******************************************************************************
+ * bucketEnd
+ ******************************************************************************/
+static UInt32 bucketEnd(Int bucket)
+{
+    Int log2;
+
+    if (bucket < LATENCY_SUB_BUCKETS) {
+        return bucket + 1;
+    }
+
+    log2 = bucket / LATENCY_SUB_BUCKETS + 1;
+
+    return (UInt32) (LATENCY_SUB_BUCKETS + bucket % LATENCY_SUB_BUCKETS + 1)
+           << (log2 - 2);
+}
+
+/******************************************************************************
+ * percentile
+ ******************************************************************************/
+static UInt32 percentile(LatencyHist *h, UInt32 pct)
+{
+    UInt32  want = (UInt64) h->frames * pct / 100;
+    UInt32  seen = 0;
+    Int     i;
+
+    for (i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += h->buckets[i];
+
+        if (seen > want) {
+            break;
+        }
+    }
+
+    /* Never more than the slowest frame */
+    return i < LATENCY_BUCKETS && bucketEnd(i) < h->maxUs ? bucketEnd(i) :
+                                                            h->maxUs;
+}
+
+/******************************************************************************
+ * copyHist
+ ******************************************************************************/
+static Void copyHist(LatencyHist *h, LatencyHist *copy)
+{
+    UInt32 gen;
+
+    do {
+        while ((gen = h->gen) & 1) {
+            sched_yield();
+        }
+
+        memoryBarrier();
+        memcpy(copy, h, sizeof(LatencyHist));
+        memoryBarrier();
+    } while (h->gen != gen);
+}
+
+/******************************************************************************
+ * latencyCreate
+ ******************************************************************************/
+LatencyHist *latencyCreate(Char *name)
+{
+    LatencyHist    *h = NULL;
+    Int             i;
+
+    pthread_mutex_lock(&histMutex);
+
+    for (i = 0; i < numHists; i++) {
+        if (strcmp(hists[i].name, name) == 0) {
+            h = &hists[i];
+            break;
+        }
+    }
+
+    if (h == NULL && numHists < LATENCY_MAX_HISTS) {
+        h = &hists[numHists];
+        strncpy(h->name, name, LATENCY_NAME_LEN - 1);
+
+        /* Only listed once it has its name */
+        memoryBarrier();
+        numHists++;
+    }
+
+    pthread_mutex_unlock(&histMutex);
+
+    if (h == NULL) {
+        Dmai_err1("No histogram left for %s\n", name);
+    }
+
+    return h;
+}
+
+/******************************************************************************
+ * latencyAdd
+ ******************************************************************************/
+Void latencyAdd(LatencyHist *h, UInt64 from, UInt64 to)
+{
+    UInt32 us;
+
+    if (h == NULL) {
+        return;
+    }
+
+    us = to > from ? to - from : 0;
+
+    h->gen++;
+    memoryBarrier();
+
+    h->frames++;
+    h->totalUs += us;
+    h->buckets[bucketOf(us)]++;
+    if (us > h->maxUs) {
+        h->maxUs = us;
+    }
+
+    memoryBarrier();
+    h->gen++;
+}
+
+/******************************************************************************
+ * latencyReport
+ ******************************************************************************/
+Void latencyReport(FILE *fp)
+{
+    LatencyHist h;
+    Int         n = numHists;
+    Int         i;
+
+    memoryBarrier();
+
+    fprintf(fp, "%-16s %8s %9s %9s %9s %9s %9s\n", "stage (us)", "frames",
+            "average", "p50", "p90", "p99", "max");
+
+    for (i = 0; i < n; i++) {
+        copyHist(&hists[i], &h);
+
+        fprintf(fp, "%-16s %8u %9u %9u %9u %9u %9u\n", h.name,
+                (unsigned) h.frames,
+                (unsigned) (h.frames ? h.totalUs / h.frames : 0),
+                (unsigned) percentile(&h, 50), (unsigned) percentile(&h, 90),
+                (unsigned) percentile(&h, 99), (unsigned) h.maxUs);
+    }
+}
+
+/******************************************************************************
+ * writeReport
+ ******************************************************************************/
+static Void writeReport(Void)
+{
+    Char    tmpPath[LATENCY_PATH_LEN + 4];
+    FILE   *fp;
+
+    snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", reportPath);
+    fp = fopen(tmpPath, "w");
+
+    if (fp == NULL) {
+        Dmai_err2("Failed to open %s (%d)\n", tmpPath, errno);
+        return;
+    }
+
+    latencyReport(fp);
+
+    if (fclose(fp) != 0 || rename(tmpPath, reportPath) != 0) {
+        Dmai_err2("Failed to write %s (%d)\n", reportPath, errno);
+    }
+}
+
+/******************************************************************************
+ * reporterThrFxn
+ ******************************************************************************/
+static Void *reporterThrFxn(Void *arg)
+{
+    struct timespec until;
+
+    clock_gettime(CLOCK_REALTIME, &until);
+
+    pthread_mutex_lock(&reportMutex);
+
+    while (!stopping) {
+        until.tv_sec += reportSecs;
+
+        if (pthread_cond_timedwait(&reportCond, &reportMutex, &until) ==
+            ETIMEDOUT) {
+            pthread_mutex_unlock(&reportMutex);
+            writeReport();
+            pthread_mutex_lock(&reportMutex);
+        }
+    }
+
+    pthread_mutex_unlock(&reportMutex);
+
+    return NULL;
+}
+
+/******************************************************************************
+ * latencyStart
+ ******************************************************************************/
+Int latencyStart(Char *path, Int periodSecs)
+{
+    pthread_attr_t      attr;
+    struct sched_param  schedParam;
+
+    if (reporting || periodSecs <= 0) {
+        return Dmai_EOK;
+    }
+
+    strncpy(reportPath, path, LATENCY_PATH_LEN - 1);
+    reportSecs = periodSecs;
+    stopping = FALSE;
+
+    /* The report must never compete with the real time threads */
+    pthread_attr_init(&attr);
+    pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+    pthread_attr_setschedpolicy(&attr, SCHED_OTHER);
+    schedParam.sched_priority = 0;
+    pthread_attr_setschedparam(&attr, &schedParam);
+
+    if (pthread_create(&reporter, &attr, reporterThrFxn, NULL)) {
+        Dmai_err0("Failed to create latency reporter thread\n");
+        pthread_attr_destroy(&attr);
+        return Dmai_EFAIL;
+    }
+
+    pthread_attr_destroy(&attr);
+    reporting = TRUE;
+
+    return Dmai_EOK;
+}
+
+/******************************************************************************
+ * latencyStop
+ ******************************************************************************/
+Void latencyStop(Void)
+{
+    if (!reporting) {
+        return;
+    }
+
+    pthread_mutex_lock(&reportMutex);
+    stopping = TRUE;
+    pthread_cond_signal(&reportCond);
+    pthread_mutex_unlock(&reportMutex);
+
+    pthread_join(reporter, NULL);
+    reporting = FALSE;
+
+    /* What the last frames did too */
+    writeReport();
+}
@@ -0,0 +1,54 @@
+/*
+ * latency.h
+ *
+ * Per stage latency of the frames on their way from the sensor to the
+ * file and the shm readers. Each stage keeps a histogram that only the
+ * thread timing it writes to, a reporter thread copies them out now and
+ * then without holding anyone up.
+ */
+
+#ifndef _LATENCY_H
+#define _LATENCY_H
+
+#include <stdio.h>
+
+#include <xdc/std.h>
+
+/* Most stages that can be timed */
+#define LATENCY_MAX_HISTS       24
+
+/* Longest stage name */
+#define LATENCY_NAME_LEN        16
+
+/*
+ * Histogram buckets. Below 4 us each bucket is 1 us wide, above that
+ * every power of two is split in 4, so a bucket is at most 25% wide.
+ */
+#define LATENCY_SUB_BUCKETS     4
+#define LATENCY_BUCKETS         124
+
+/* Where the reporter thread publishes the histograms */
+#define LATENCY_PATH            "/tmp/encode_latency.txt"
+
+typedef struct LatencyHist LatencyHist;
+
+/*
+ * Histogram of the stage called name, created the first time it is asked
+ * for. Only one thread may add to it. NULL if there is no room left, the
+ * other functions take that and do nothing.
+ */
+extern LatencyHist *latencyCreate(Char *name);
+
+/* Count a frame that went through the stage from time from to time to */
+extern Void latencyAdd(LatencyHist *h, UInt64 from, UInt64 to);
+
+/* Write a table of all histograms to fp */
+extern Void latencyReport(FILE *fp);
+
+/* Rewrite path with the table every periodSecs seconds */
+extern Int latencyStart(Char *path, Int periodSecs);
+
+/* Stop the reporter thread, if started */
+extern Void latencyStop(Void);
+
+#endif /* _LATENCY_H */
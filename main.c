@@ -33,13 +33,18 @@
 #include <ti/sdo/dmai/Capture.h>
 #include <ti/sdo/dmai/BufferGfx.h>
 #include <ti/sdo/dmai/Rendezvous.h>
+#include <ti/sdo/dmai/ce/Senc1.h>
 
 #include <ti/sdo/fc/rman/rman.h>
 
 #include "video.h"
 #include "capture.h"
 #include "writer.h"
+#include "publish.h"
+#include "latency.h"
+#include "snapshot.h"
 #include "speech.h"
+#include "audiobuf.h"
 #include "../ctrl.h"
 #include "../demo.h"
 #include "../ui.h"
@@ -51,9 +56,16 @@
 #define WRITERTHREADCREATED     0x80
 #define VIDEOTHREADCREATED      0x100
 #define SPEECHTHREADCREATED     0x200
+#define SNAPSHOTTHREADCREATED   0x800
+#define PUBLISHTHREADCREATED    0x1000  /* shifted left by the stream */
+
+/* Seconds of speech the writer can fall behind the speech thread */
+#define AUDIO_SLACK             4
 
 /* Thread priorities */
-#define WRITER_THREAD_PRIORITY  sched_get_priority_max(SCHED_FIFO) - 3
+#define SNAPSHOT_THREAD_PRIORITY sched_get_priority_max(SCHED_FIFO) - 5
+#define WRITER_THREAD_PRIORITY  sched_get_priority_max(SCHED_FIFO) - 4
+#define PUBLISH_THREAD_PRIORITY sched_get_priority_max(SCHED_FIFO) - 3
 #define SPEECH_THREAD_PRIORITY  sched_get_priority_max(SCHED_FIFO) - 2
 #define VIDEO_THREAD_PRIORITY   sched_get_priority_max(SCHED_FIFO) - 1
 #define CAPTURE_THREAD_PRIORITY sched_get_priority_max(SCHED_FIFO)
@@ -75,10 +87,26 @@ typedef struct Args {
     Int            time;
     Int            osd;
     Int            interface;
+    Int            segmentTime;
+    Int32          segmentSize;
+    Int            mp4;
+    Int            preEvent;
+    Int            postEvent;
+    Int            writerBufs;
+    Int            subWriterBufs;
+    Int            freeSpace;
+    Int            syncMs;
+    Int            syncSize;
+    Int            subBitRate;
+    Int            subFrameRate;
+    Int            latencySecs;
+    Int            serial;
+    Int            numStreams;      /* given with -T, after the first two */
+    VideoStream    streams[VIDEO_MAX_STREAMS - 2];
 } Args;
 
 #define DEFAULT_ARGS \
-    { Display_Output_LCD, VideoStd_D1_NTSC, "D1 NTSC", Sound_Input_MIC,Capture_Input_COMPOSITE, NULL, NULL, NULL, NULL, 0, 0, -1, FALSE, FOREVER, FALSE, FALSE }
+    { Display_Output_LCD, VideoStd_D1_NTSC, "D1 NTSC", Sound_Input_MIC,Capture_Input_COMPOSITE, NULL, NULL, NULL, NULL, 0, 0, -1, FALSE, FOREVER, FALSE, FALSE, 3600, 0, FALSE, 0, 10, 2, 1, 0, 0, 0, 128 * 1024, 15000, 10, FALSE, 0, {} }
 
 /* Global variable declarations for this application */
 GlobalData gbl = GBL_DATA_INIT;
@@ -92,6 +120,14 @@ Void signalHandler(int sig)
     gblSetQuit();
 }
 
+/******************************************************************************
+ * Event signal handler
+ ******************************************************************************/
+Void eventSignalHandler(int sig)
+{
+    writerTrigger();
+}
+
 /******************************************************************************
  * getCodec
  ******************************************************************************/
@@ -122,13 +158,21 @@ static void usage(void)
 {
     fprintf(stderr, "Usage: encode [options]\n\n"
       "Options:\n"
-      "-s | --speechfile       Speech file to record to\n"
+      "-s | --speechfile       Speech file to record to, with -m the speech\n"
+      "                        goes into the MP4 instead\n"
       "-O | --display_output   Video output to use (see below).\n"
       "-v | --videofile        Video file to record to\n"
       "-y | --display_standard Video standard to use for display (see below).\n"
       "-r | --resolution       Video resolution ('width'x'height')\n"
       "                        [video standard default]\n"
       "-b | --videobitrate     Bit rate to encode video at [variable]\n"
+      "-R | --sub_bitrate      Bit rate of the resized stream, -1 for\n"
+      "                        variable [131072]\n"
+      "-f | --sub_fps          Frames per second of the resized stream,\n"
+      "                        0 for every frame captured [15]\n"
+      "-T | --stream           One more stream published to shm,\n"
+      "                        'width'x'height'[:bitrate[:fps]][:none],\n"
+      "                        none only encodes it, up to 2 times [none]\n"
       "-x | --svideo           Use s-video instead of composite video \n"
       "                        input [off]\n"
       "-l | --linein           Use linein for encoding sound instead of mic \n"
@@ -137,6 +181,31 @@ static void usage(void)
       "-t | --time             Number of seconds to run the demo [infinite]\n"
       "-o | --osd              Show demo data on an OSD [off]\n"
       "-i | --interface        Launch the demo interface when exiting [off]\n"
+      "-S | --segment_time     Seconds of video per recorded file, 0 for\n"
+      "                        no limit [3600]\n"
+      "-B | --segment_size     Megabytes per recorded file up to 2047, 0\n"
+      "                        for no limit [0]\n"
+      "-m | --mp4              Record fragmented MP4 instead of raw H.264\n"
+      "                        [off]\n"
+      "-E | --pre_event        Only record on events (snapshot or SIGUSR1),\n"
+      "                        starting this many seconds before [0]\n"
+      "-A | --post_event       Seconds recorded after the last event [10]\n"
+      "-w | --writer_bufs      Encoded frames the writer can fall behind\n"
+      "                        by, 1 to 4 [2]\n"
+      "-W | --shm_bufs         Frames publishing of each shm stream can fall\n"
+      "                        behind by, each holding a worst case shm slot,\n"
+      "                        1 to 4 [1]\n"
+      "-F | --free_space       Megabytes kept free on the card by deleting\n"
+      "                        the oldest recordings and snapshots, 0 to\n"
+      "                        never delete [0]\n"
+      "-D | --sync_ms          Most milliseconds of recording a power cut\n"
+      "                        can lose, 0 for no limit [0]\n"
+      "-M | --sync_mb          Most megabytes of recording a power cut can\n"
+      "                        lose, 0 for no limit [0]\n"
+      "-L | --latency          Seconds between latency reports in\n"
+      "                        " LATENCY_PATH ", 0 for none [10]\n"
+      "-P | --serial           Encode the streams one after the other in\n"
+      "                        the video thread, not each in its own [off]\n"
       "-h | --help             Print this message\n\n"
       "Video standards available:\n"
       "\t1\tD1 @ 30 fps (NTSC) [Default]\n"
@@ -158,7 +227,7 @@ static void usage(void)
  ******************************************************************************/
 static Void parseArgs(Int argc, Char *argv[], Args *argsp)
 {
-    const Char shortOptions[] = "s:O:v:y:r:b:xlkt:oih";
+    const Char shortOptions[] = "s:O:v:y:r:b:R:f:T:xlkt:oiS:B:mE:A:w:W:F:D:M:L:Ph";
     const struct option longOptions[] = {
         {"speechfile",       required_argument, NULL, 's'},
         {"display_output",   required_argument, NULL, 'O'},
@@ -166,12 +235,27 @@ static Void parseArgs(Int argc, Char *argv[], Args *argsp)
         {"display_standard", required_argument, NULL, 'y'},
         {"resolution",       required_argument, NULL, 'r'},
         {"videobitrate",     required_argument, NULL, 'b'},
+        {"sub_bitrate",      required_argument, NULL, 'R'},
+        {"sub_fps",          required_argument, NULL, 'f'},
+        {"stream",           required_argument, NULL, 'T'},
         {"svideo",           no_argument,       NULL, 'x'},
         {"linein",           no_argument,       NULL, 'l'},
         {"keyboard",         no_argument,       NULL, 'k'},
         {"time",             required_argument, NULL, 't'},
         {"osd",              no_argument,       NULL, 'o'},
         {"interface",        no_argument,       NULL, 'i'},
+        {"segment_time",     required_argument, NULL, 'S'},
+        {"segment_size",     required_argument, NULL, 'B'},
+        {"mp4",              no_argument,       NULL, 'm'},
+        {"pre_event",        required_argument, NULL, 'E'},
+        {"post_event",       required_argument, NULL, 'A'},
+        {"writer_bufs",      required_argument, NULL, 'w'},
+        {"shm_bufs",         required_argument, NULL, 'W'},
+        {"free_space",       required_argument, NULL, 'F'},
+        {"sync_ms",          required_argument, NULL, 'D'},
+        {"sync_mb",          required_argument, NULL, 'M'},
+        {"latency",          required_argument, NULL, 'L'},
+        {"serial",           no_argument,       NULL, 'P'},
         {"help",             no_argument,       NULL, 'h'},
         {0, 0, 0, 0}
     };
@@ -296,6 +380,69 @@ static Void parseArgs(Int argc, Char *argv[], Args *argsp)
                 argsp->videoBitRate = atoi(optarg);
                 break;
 
+            case 'R':
+                argsp->subBitRate = atoi(optarg);
+                break;
+
+            case 'f':
+                argsp->subFrameRate = atoi(optarg) * 1000;
+                if (argsp->subFrameRate < 0) {
+                    fprintf(stderr, "Sub stream frame rate must not be "
+                            "negative\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
+            case 'T':
+            {
+                VideoStream *stream;
+                Char        *opt;
+                Int          field;
+
+                if (argsp->numStreams == VIDEO_MAX_STREAMS - 2) {
+                    fprintf(stderr, "At most %d more streams\n",
+                            VIDEO_MAX_STREAMS - 2);
+                    exit(EXIT_FAILURE);
+                }
+
+                stream = &argsp->streams[argsp->numStreams++];
+                stream->bitRate = -1;
+                stream->sink = VideoSink_SHM;
+
+                if (sscanf(optarg, "%ldx%ld", &stream->width,
+                                              &stream->height) != 2 ||
+                    stream->width < 16 || stream->height < 16) {
+                    fprintf(stderr, "Invalid stream supplied (%s)\n",
+                            optarg);
+                    usage();
+                    exit(EXIT_FAILURE);
+                }
+
+                /* Width and height must be multiple of 16 */
+                stream->width  &= ~0xf;
+                stream->height &= ~0xf;
+
+                /* Then bit rate and frame rate, or none, after colons */
+                for (opt = strchr(optarg, ':'), field = 0; opt;
+                     opt = strchr(opt + 1, ':'), field++) {
+                    if (strncmp(opt + 1, "none", 4) == 0) {
+                        stream->sink = VideoSink_NONE;
+                    }
+                    else if (field == 0) {
+                        stream->bitRate = atoi(opt + 1);
+                    }
+                    else if (field == 1) {
+                        stream->frameRate = atoi(opt + 1) * 1000;
+                    }
+                    else {
+                        fprintf(stderr, "Unknown stream option: %s\n",
+                                opt + 1);
+                        exit(EXIT_FAILURE);
+                    }
+                }
+                break;
+            }
+
             case 'x':
                 argsp->videoInput = Capture_Input_SVIDEO;
                 break;
@@ -320,6 +467,102 @@ static Void parseArgs(Int argc, Char *argv[], Args *argsp)
                 argsp->interface = TRUE;
                 break;
 
+            case 'S':
+                argsp->segmentTime = atoi(optarg);
+                if (argsp->segmentTime < 0) {
+                    fprintf(stderr, "Segment time must not be negative\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
+            case 'B':
+                argsp->segmentSize = atoi(optarg);
+                if (argsp->segmentSize < 0 ||
+                    argsp->segmentSize > WRITER_MAX_SEGMENT_MB) {
+                    fprintf(stderr, "Segment size must be 0 to %d MB\n",
+                            WRITER_MAX_SEGMENT_MB);
+                    exit(EXIT_FAILURE);
+                }
+                argsp->segmentSize *= 1024 * 1024;
+                break;
+
+            case 'm':
+                argsp->mp4 = TRUE;
+                break;
+
+            case 'E':
+                argsp->preEvent = atoi(optarg);
+                if (argsp->preEvent < 0) {
+                    fprintf(stderr, "Pre event time must not be negative\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
+            case 'A':
+                argsp->postEvent = atoi(optarg);
+                if (argsp->postEvent < 0) {
+                    fprintf(stderr, "Post event time must not be negative\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
+            case 'w':
+                argsp->writerBufs = atoi(optarg);
+                if (argsp->writerBufs < 1 ||
+                    argsp->writerBufs > WRITER_MAX_BUFS) {
+                    fprintf(stderr, "Writer buffers must be 1 to %d\n",
+                            WRITER_MAX_BUFS);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
+            case 'W':
+                argsp->subWriterBufs = atoi(optarg);
+                /* Each buffer holds a shm slot leased until published */
+                if (argsp->subWriterBufs < 1 ||
+                    argsp->subWriterBufs > SHM_MAX_LEASES) {
+                    fprintf(stderr, "Shm buffers must be 1 to %d\n",
+                            SHM_MAX_LEASES);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
+            case 'F':
+                argsp->freeSpace = atoi(optarg);
+                if (argsp->freeSpace < 0) {
+                    fprintf(stderr, "Free space must not be negative\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
+            case 'D':
+                argsp->syncMs = atoi(optarg);
+                if (argsp->syncMs < 0) {
+                    fprintf(stderr, "Sync interval must not be negative\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
+            case 'M':
+                argsp->syncSize = atoi(optarg);
+                if (argsp->syncSize < 0) {
+                    fprintf(stderr, "Sync size must not be negative\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
+            case 'L':
+                argsp->latencySecs = atoi(optarg);
+                if (argsp->latencySecs < 0) {
+                    fprintf(stderr, "Latency interval must not be negative\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
+            case 'P':
+                argsp->serial = TRUE;
+                break;
+
             case 'h':
                 usage();
                 exit(EXIT_SUCCESS);
@@ -421,23 +664,33 @@ Int main(Int argc, Char *argv[])
     Rendezvous_Handle   hRendezvousCleanup  = NULL;
     Pause_Handle        hPauseProcess       = NULL;
     UI_Handle           hUI                 = NULL;
+    AudioBuf           *audioBuf            = NULL;
+    SPHENC1_Params     *speechParams        = NULL;
     struct sched_param  schedParam;
     pthread_t           captureThread;
     pthread_t           writerThread;
+    pthread_t           publishThread[VIDEO_MAX_STREAMS];
+    pthread_t           snapshotThread;
     pthread_t           videoThread;
     pthread_t           speechThread;
     CaptureEnv          captureEnv;
     WriterEnv           writerEnv;
+    PublishEnv          publishEnv[VIDEO_MAX_STREAMS];
+    VideoStream        *stream;
+    SnapshotEnv         snapshotEnv;
     VideoEnv            videoEnv;
     SpeechEnv           speechEnv;
     CtrlEnv             ctrlEnv;
     Int                 numThreads;
+    Int                 i;
     pthread_attr_t      attr;
     Void               *ret;
 
     /* Zero out the thread environments */
     Dmai_clear(captureEnv);
     Dmai_clear(writerEnv);
+    Dmai_clear(publishEnv);
+    Dmai_clear(snapshotEnv);
     Dmai_clear(videoEnv);
     Dmai_clear(speechEnv);
     Dmai_clear(ctrlEnv);
@@ -458,6 +711,9 @@ Int main(Int argc, Char *argv[])
 
     /* Initialize signal handler for SIGINT */
     signal(SIGINT, signalHandler);
+
+    /* An external trigger records the video around it */
+    signal(SIGUSR1, eventSignalHandler);
     
     /* Initialize Davinci Multimedia Application Interface */
     Dmai_init();
@@ -471,6 +727,11 @@ Int main(Int argc, Char *argv[])
         cleanup(EXIT_FAILURE);
     }
 
+    /* Time the stages of every frame, report them now and then */
+    if (latencyStart(LATENCY_PATH, args.latencySecs) < 0) {
+        cleanup(EXIT_FAILURE);
+    }
+
     /* Create the Pause object */
     hPauseProcess = Pause_create(&pAttrs);
 
@@ -483,7 +744,14 @@ Int main(Int argc, Char *argv[])
     numThreads = 1;
 
     if (args.videoFile) {
-        numThreads += 3;
+        /* Capture, video, writer, snapshot and the resized stream */
+        numThreads += 5;
+
+        for (i = 0; i < args.numStreams; i++) {
+            if (args.streams[i].sink == VideoSink_SHM) {
+                numThreads += 1;
+            }
+        }
     }
 
     if (args.speechFile) {
@@ -524,8 +792,12 @@ Int main(Int argc, Char *argv[])
         /* Create the capture fifos */
         captureEnv.hInFifo = Fifo_create(&fAttrs);
         captureEnv.hOutFifo = Fifo_create(&fAttrs);
+        captureEnv.hResizeInFifo = Fifo_create(&fAttrs);
+        captureEnv.hResizeOutFifo = Fifo_create(&fAttrs);
 
-        if (captureEnv.hInFifo == NULL || captureEnv.hOutFifo == NULL) {
+        if (captureEnv.hInFifo == NULL || captureEnv.hOutFifo == NULL ||
+            captureEnv.hResizeInFifo == NULL ||
+            captureEnv.hResizeOutFifo == NULL) {
             ERR("Failed to open display fifos\n");
             cleanup(EXIT_FAILURE);
         }
@@ -546,7 +818,7 @@ Int main(Int argc, Char *argv[])
         captureEnv.videoInput         = args.videoInput;
         captureEnv.imageWidth         = args.imageWidth;
         captureEnv.imageHeight        = args.imageHeight;
-        /* TODO */
+        /* The capture driver sets up resizer b for CIF */
         VideoStd_getResolution(VideoStd_CIF, &captureEnv.resizeWidth,
                                              &captureEnv.resizeHeight);
 
@@ -574,6 +846,66 @@ Int main(Int argc, Char *argv[])
             cleanup(EXIT_FAILURE);
         }
 
+        /*
+         * The recording at the capture resolution, the resized stream
+         * published live, then any more given on the command line.
+         */
+        videoEnv.streams[0].width   = captureEnv.imageWidth;
+        videoEnv.streams[0].height  = captureEnv.imageHeight;
+        videoEnv.streams[0].bitRate = args.videoBitRate;
+        videoEnv.streams[0].sink    = VideoSink_FILE;
+        videoEnv.streams[0].hInFifo = writerEnv.hInFifo;
+        videoEnv.streams[0].hOutFifo = writerEnv.hOutFifo;
+        videoEnv.streams[1].width   = captureEnv.resizeWidth;
+        videoEnv.streams[1].height  = captureEnv.resizeHeight;
+        videoEnv.streams[1].bitRate = args.subBitRate;
+        videoEnv.streams[1].frameRate = args.subFrameRate;
+        videoEnv.streams[1].sink    = VideoSink_SHM;
+        videoEnv.numStreams         = 2;
+
+        for (i = 0; i < args.numStreams; i++) {
+            stream = &args.streams[i];
+
+            if (stream->width > captureEnv.imageWidth ||
+                stream->height > captureEnv.imageHeight) {
+                ERR("Stream %ldx%ld larger than the capture\n",
+                    stream->width, stream->height);
+                cleanup(EXIT_FAILURE);
+            }
+
+            videoEnv.streams[videoEnv.numStreams++] = *stream;
+        }
+
+        /* Create the publish fifos, each live stream has its own pipe */
+        for (i = 0; i < videoEnv.numStreams; i++) {
+            stream = &videoEnv.streams[i];
+
+            if (stream->sink != VideoSink_SHM) {
+                continue;
+            }
+
+            publishEnv[i].hInFifo = Fifo_create(&fAttrs);
+            publishEnv[i].hOutFifo = Fifo_create(&fAttrs);
+
+            if (publishEnv[i].hInFifo == NULL ||
+                publishEnv[i].hOutFifo == NULL) {
+                ERR("Failed to open publish fifos\n");
+                cleanup(EXIT_FAILURE);
+            }
+
+            stream->hInFifo = publishEnv[i].hInFifo;
+            stream->hOutFifo = publishEnv[i].hOutFifo;
+        }
+
+        /* Create the snapshot fifos */
+        snapshotEnv.hInFifo = Fifo_create(&fAttrs);
+        snapshotEnv.hOutFifo = Fifo_create(&fAttrs);
+
+        if (snapshotEnv.hInFifo == NULL || snapshotEnv.hOutFifo == NULL) {
+            ERR("Failed to open snapshot fifos\n");
+            cleanup(EXIT_FAILURE);
+        }
+
         /* Set the video thread priority */
         schedParam.sched_priority = VIDEO_THREAD_PRIORITY;
         if (pthread_attr_setschedparam(&attr, &schedParam)) {
@@ -588,23 +920,20 @@ Int main(Int argc, Char *argv[])
         videoEnv.hPauseProcess      = hPauseProcess;
         videoEnv.hCaptureOutFifo    = captureEnv.hOutFifo;
         videoEnv.hCaptureInFifo     = captureEnv.hInFifo;
-        videoEnv.hWriterOutFifo     = writerEnv.hOutFifo;
-        videoEnv.hWriterInFifo      = writerEnv.hInFifo;
+        videoEnv.hResizeInFifo      = captureEnv.hResizeInFifo;
+        videoEnv.hResizeOutFifo     = captureEnv.hResizeOutFifo;
+        videoEnv.hSnapshotOutFifo   = snapshotEnv.hOutFifo;
+        videoEnv.hSnapshotInFifo    = snapshotEnv.hInFifo;
         videoEnv.videoEncoder       = args.videoEncoder->codecName;
         videoEnv.params             = args.videoEncoder->params;
         videoEnv.dynParams          = args.videoEncoder->dynParams;
-        videoEnv.videoBitRate       = args.videoBitRate;
         videoEnv.imageWidth         = captureEnv.imageWidth;
         videoEnv.imageHeight        = captureEnv.imageHeight;
         videoEnv.resizeWidth        = captureEnv.resizeWidth;
         videoEnv.resizeHeight       = captureEnv.resizeHeight;
-        videoEnv.imgEncoder         = "jpegenc";
         videoEnv.engineName         = engine->engineName;
-        if (args.videoStd == VideoStd_D1_PAL) {
-            videoEnv.videoFrameRate     = 25000;
-        } else {
-            videoEnv.videoFrameRate     = 30000;
-        }
+        videoEnv.serial             = args.serial;
+        videoEnv.videoFrameRate     = captureEnv.frameRate;
 
         if (pthread_create(&videoThread, &attr, videoThrFxn, &videoEnv)) {
             ERR("Failed to create video thread\n");
@@ -627,13 +956,48 @@ Int main(Int argc, Char *argv[])
             cleanup(EXIT_FAILURE);
         }
 
+        /*
+         * Speech goes into the MP4 next to the video instead of its own
+         * file. The writer holds it as long as the pre-event video.
+         */
+        if (args.speechFile && args.mp4) {
+            audioBuf = audioBufCreate((args.preEvent + AUDIO_SLACK) *
+                                      SPEECH_SAMPLE_RATE / SPEECH_BLOCK_SIZE,
+                                      SPEECH_BLOCK_SIZE);
+
+            if (audioBuf == NULL) {
+                ERR("Failed to create audio buffer\n");
+                cleanup(EXIT_FAILURE);
+            }
+
+            speechParams = args.speechEncoder->params ?
+                           args.speechEncoder->params :
+                           (SPHENC1_Params *) &Senc1_Params_DEFAULT;
+
+            printf("Recording speech into the MP4, %s is not written\n",
+                   args.speechFile);
+        }
+
         /* Create the writer thread */
         writerEnv.hRendezvousInit    = hRendezvousInit;
         writerEnv.hRendezvousCleanup = hRendezvousCleanup;
         writerEnv.hPauseProcess      = hPauseProcess;
         writerEnv.videoFile          = args.videoFile;
-        writerEnv.outBufSize         = videoEnv.outBufSize;
-        writerEnv.outsBufSize        = videoEnv.outsBufSize;
+        writerEnv.outBufSize         = videoEnv.streams[0].outBufSize;
+        writerEnv.numBufs            = args.writerBufs;
+        writerEnv.freeSpace          = args.freeSpace;
+        writerEnv.syncMs             = args.syncMs;
+        writerEnv.syncSize           = args.syncSize;
+        writerEnv.segmentTime        = args.segmentTime;
+        writerEnv.segmentSize        = args.segmentSize;
+        writerEnv.mp4                = args.mp4;
+        writerEnv.preEvent           = args.preEvent;
+        writerEnv.postEvent          = args.postEvent;
+        writerEnv.audioBuf           = audioBuf;
+        writerEnv.ulaw               = audioBuf && speechParams->compandingLaw
+                                       == ISPEECH1_PCM_COMPAND_ULAW;
+        writerEnv.imageWidth         = videoEnv.imageWidth;
+        writerEnv.imageHeight        = videoEnv.imageHeight;
 
         if (pthread_create(&writerThread, &attr, writerThrFxn, &writerEnv)) {
             ERR("Failed to create writer thread\n");
@@ -642,6 +1006,60 @@ Int main(Int argc, Char *argv[])
 
         initMask |= WRITERTHREADCREATED;
 
+        /* Set the publish thread priority, above the recording */
+        schedParam.sched_priority = PUBLISH_THREAD_PRIORITY;
+        if (pthread_attr_setschedparam(&attr, &schedParam)) {
+            ERR("Failed to set scheduler parameters\n");
+            cleanup(EXIT_FAILURE);
+        }
+
+        /* Create a publish thread for every live stream */
+        for (i = 0; i < videoEnv.numStreams; i++) {
+            if (videoEnv.streams[i].sink != VideoSink_SHM) {
+                continue;
+            }
+
+            publishEnv[i].hRendezvousInit    = hRendezvousInit;
+            publishEnv[i].hRendezvousCleanup = hRendezvousCleanup;
+            publishEnv[i].hPauseProcess      = hPauseProcess;
+            publishEnv[i].streamId           = i;
+            publishEnv[i].stream             = &videoEnv.streams[i];
+            publishEnv[i].outBufSize         = videoEnv.streams[i].outBufSize;
+            publishEnv[i].numBufs            = args.subWriterBufs;
+
+            if (pthread_create(&publishThread[i], &attr, publishThrFxn,
+                               &publishEnv[i])) {
+                ERR("Failed to create publish thread\n");
+                cleanup(EXIT_FAILURE);
+            }
+
+            initMask |= PUBLISHTHREADCREATED << i;
+        }
+
+        /* Set the snapshot thread priority, below everything else */
+        schedParam.sched_priority = SNAPSHOT_THREAD_PRIORITY;
+        if (pthread_attr_setschedparam(&attr, &schedParam)) {
+            ERR("Failed to set scheduler parameters\n");
+            cleanup(EXIT_FAILURE);
+        }
+
+        /* Create the snapshot thread */
+        snapshotEnv.hRendezvousInit    = hRendezvousInit;
+        snapshotEnv.hRendezvousCleanup = hRendezvousCleanup;
+        snapshotEnv.hPauseProcess      = hPauseProcess;
+        snapshotEnv.imgEncoder         = "jpegenc";
+        snapshotEnv.engineName         = engine->engineName;
+        snapshotEnv.inBufSize          = videoEnv.inBufSize;
+        snapshotEnv.imageWidth         = videoEnv.imageWidth;
+        snapshotEnv.imageHeight        = videoEnv.imageHeight;
+
+        if (pthread_create(&snapshotThread, &attr, snapshotThrFxn,
+                           &snapshotEnv)) {
+            ERR("Failed to create snapshot thread\n");
+            cleanup(EXIT_FAILURE);
+        }
+
+        initMask |= SNAPSHOTTHREADCREATED;
     }
 
     /* Create the speech thread if a file name is supplied */
@@ -663,6 +1081,7 @@ Int main(Int argc, Char *argv[])
         speechEnv.params             = args.speechEncoder->params;
         speechEnv.dynParams          = args.speechEncoder->dynParams;
         speechEnv.engineName         = engine->engineName;
+        speechEnv.audioBuf           = audioBuf;
 
         if (pthread_create(&speechThread, &attr, speechThrFxn, &speechEnv)) {
             ERR("Failed to create speech thread\n");
@@ -719,10 +1138,46 @@ cleanup:
         }
     }
 
+    for (i = 0; i < VIDEO_MAX_STREAMS; i++) {
+        if (initMask & (PUBLISHTHREADCREATED << i)) {
+            if (pthread_join(publishThread[i], &ret) == 0) {
+                if (ret == THREAD_FAILURE) {
+                    status = EXIT_FAILURE;
+                }
+            }
+        }
+    }
+
+    if (initMask & SNAPSHOTTHREADCREATED) {
+        if (pthread_join(snapshotThread, &ret) == 0) {
+            if (ret == THREAD_FAILURE) {
+                status = EXIT_FAILURE;
+            }
+        }
+    }
+
     if (writerEnv.hOutFifo) {
         Fifo_delete(writerEnv.hOutFifo);
     }
 
+    for (i = 0; i < VIDEO_MAX_STREAMS; i++) {
+        if (publishEnv[i].hOutFifo) {
+            Fifo_delete(publishEnv[i].hOutFifo);
+        }
+
+        if (publishEnv[i].hInFifo) {
+            Fifo_delete(publishEnv[i].hInFifo);
+        }
+    }
+
+    if (snapshotEnv.hOutFifo) {
+        Fifo_delete(snapshotEnv.hOutFifo);
+    }
+
+    if (snapshotEnv.hInFifo) {
+        Fifo_delete(snapshotEnv.hInFifo);
+    }
+
     if (writerEnv.hInFifo) {
         Fifo_delete(writerEnv.hInFifo);
     }
@@ -739,6 +1194,27 @@ cleanup:
         Fifo_delete(captureEnv.hOutFifo);
     }
 
+    /* All stages are done */
+    latencyStop();
+
+    if (args.videoFile) {
+        printf("Latency of each stage:\n");
+        latencyReport(stdout);
+    }
+
+    if (captureEnv.hResizeInFifo) {
+        Fifo_delete(captureEnv.hResizeInFifo);
+    }
+
+    if (captureEnv.hResizeOutFifo) {
+        Fifo_delete(captureEnv.hResizeOutFifo);
+    }
+
+    /* The speech and writer threads are both done with it */
+    if (audioBuf) {
+        audioBufDelete(audioBuf);
+    }
+
     if (captureEnv.hInFifo) {
         Fifo_delete(captureEnv.hInFifo);
     }
@@ -0,0 +1,943 @@
+/*
+ * mp4mux.c
+ *
+ * Fragmented MP4 recording of the encoded H.264 stream. The samples of a
+ * fragment are converted from Annex-B to length prefixed NAL units straight
+ * into the fragment buffer while their sizes and times go into a small
+ * sample table. When the next IDR arrives the moof is built in the room
+ * kept free in front of the samples, so the whole fragment goes to the
+ * storage ring with a single copy and either all of it or none of it
+ * reaches the file.
+ *
+ * Audio is gathered apart while the GOP goes on and lands behind the video
+ * samples in the same mdat, described by a second traf, so the file is
+ * interleaved a GOP at a time without a write per speech block. Its
+ * decode times run on from the capture time of the first block, jitter
+ * is absorbed and real gaps are filled with silence.
+ *
+ * Parameter sets only go into the avcC of the init segment, access unit
+ * delimiters are dropped. The random access index (mfra) written when a
+ * file is finished lets players seek without walking the fragments, a file
+ * cut short by a power loss still plays by walking them.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <xdc/std.h>
+
+#include <ti/sdo/dmai/Dmai.h>
+
+#include "mp4mux.h"
+#include "nal.h"
+#include "frame.h"
+
+#define MODULE_NAME     "Mp4Mux"
+
+/* Largest SPS or PPS kept for the init segment */
+#define MP4_PARAM_MAX           128
+
+/* Room for the init segment with both parameter sets at their largest */
+#define MP4_INIT_MAX            (1280 + 2 * MP4_PARAM_MAX)
+
+/* Bytes of moof for a fragment of n samples, see writeFragment() */
+#define MP4_MOOF_SIZE(n)        (96 + 8 * (n))
+
+/* Bytes of the audio traf, see writeFragment() */
+#define MP4_AUDIO_TRAF_SIZE     76
+
+/* Room kept in front of the samples for the moof and the mdat header */
+#define MP4_HDR_ROOM            (MP4_MOOF_SIZE(MP4_MAX_SAMPLES) + \
+                                 MP4_AUDIO_TRAF_SIZE + 8)
+
+/* The video track, and the audio track if there is one */
+#define MP4_TRACK_ID            1
+#define MP4_AUDIO_TRACK_ID      2
+
+/* Sample flags of an IDR and of any other frame */
+#define MP4_SAMPLE_SYNC         0x02000000
+#define MP4_SAMPLE_NON_SYNC     0x01010000
+
+/* tfhd: default-base-is-moof, default-sample-flags-present */
+#define MP4_TFHD_FLAGS          0x020020
+
+/* trun: data-offset, first-sample-flags, sample-duration, sample-size */
+#define MP4_TRUN_FLAGS          0x000305
+
+/* Audio tfhd: default-base-is-moof, default duration, size and flags */
+#define MP4_AUDIO_TFHD_FLAGS    0x020038
+
+/* Audio trun: data-offset only, every sample is one byte long */
+#define MP4_AUDIO_TRUN_FLAGS    0x000001
+
+/* A G.711 byte of silence */
+#define MP4_ULAW_SILENCE        0xff
+#define MP4_ALAW_SILENCE        0xd5
+
+/* Bytes of a tfra entry with one byte traf, trun and sample numbers */
+#define MP4_TFRA_ENTRY_SIZE     19
+
+/* A fragment starting with an IDR, for the random access index */
+typedef struct Mp4Random {
+    UInt64  time;
+    UInt64  offset;             /* of the moof in the file */
+} Mp4Random;
+
+struct Mp4Mux {
+    Storage        *st;
+    Int32           width;
+    Int32           height;
+    UInt8          *buf;        /* boxes, then the samples of the fragment */
+    UInt8          *data;
+    UInt32          dataSize;
+    UInt32          used;       /* sample bytes in the fragment */
+    Int             numSamples;
+    UInt32          sizes[MP4_MAX_SAMPLES];
+    UInt64          times[MP4_MAX_SAMPLES];     /* decode times */
+    Bool            firstSync;
+    Bool            started;    /* init segment of the file written */
+    Bool            skipping;   /* lost a frame, waiting for an IDR */
+    UInt64          fileStart;  /* capture time of the first frame */
+    UInt64          filePos;    /* bytes queued for the file */
+    UInt32          fragSeq;
+    UInt32          lastDuration;
+    UInt8           sps[MP4_PARAM_MAX];
+    Int             spsLen;
+    UInt8           pps[MP4_PARAM_MAX];
+    Int             ppsLen;
+    Mp4Random      *random;
+    Int             numRandom;
+    Int             maxRandom;
+    Bool            audio;      /* a G.711 track is recorded */
+    Bool            ulaw;
+    UInt8          *audioBuf;   /* audio of the fragment */
+    UInt32          audioSize;
+    UInt32          audioUsed;
+    Bool            audioStarted;
+    UInt64          audioStart; /* decode time of audioBuf[0] */
+    UInt64          audioNext;  /* decode time of the next byte */
+    Mp4MuxStats     stats;
+};
+
+/******************************************************************************
+ * put16, put32, put64
+ ******************************************************************************/
+static UInt8 *put16(UInt8 *p, UInt32 val)
+{
+    p[0] = val >> 8;
+    p[1] = val;
+
+    return p + 2;
+}
+
+static UInt8 *put32(UInt8 *p, UInt32 val)
+{
+    p[0] = val >> 24;
+    p[1] = val >> 16;
+    p[2] = val >> 8;
+    p[3] = val;
+
+    return p + 4;
+}
+
+static UInt8 *put64(UInt8 *p, UInt64 val)
+{
+    p = put32(p, (UInt32) (val >> 32));
+
+    return put32(p, (UInt32) val);
+}
+
+static UInt8 *putZero(UInt8 *p, Int n)
+{
+    memset(p, 0, n);
+
+    return p + n;
+}
+
+/******************************************************************************
+ * boxStart, boxEnd
+ ******************************************************************************/
+static UInt8 *boxStart(UInt8 *p, const Char *type)
+{
+    /* The size is filled in by boxEnd() once the contents are known */
+    memcpy(p + 4, type, 4);
+
+    return p + 8;
+}
+
+static UInt8 *fullBoxStart(UInt8 *p, const Char *type, Int version,
+                           UInt32 flags)
+{
+    return put32(boxStart(p, type), (version << 24) | flags);
+}
+
+static Void boxEnd(UInt8 *box, UInt8 *end)
+{
+    put32(box, end - box);
+}
+
+/******************************************************************************
+ * putMatrix
+ ******************************************************************************/
+static UInt8 *putMatrix(UInt8 *p)
+{
+    /* Unity transformation */
+    p = put32(p, 0x00010000);
+    p = putZero(p, 12);
+    p = put32(p, 0x00010000);
+    p = putZero(p, 12);
+
+    return put32(p, 0x40000000);
+}
+
+/******************************************************************************
+ * putDinf
+ ******************************************************************************/
+static UInt8 *putDinf(UInt8 *p)
+{
+    UInt8  *dinf, *box;
+
+    dinf = p; p = boxStart(p, "dinf");
+    box = p; p = fullBoxStart(p, "dref", 0, 0);
+    p = put32(p, 1);
+    p = fullBoxStart(p, "url ", 0, 0x1);  /* samples are in this file */
+    boxEnd(p - 12, p);
+    boxEnd(box, p);
+    boxEnd(dinf, p);
+
+    return p;
+}
+
+/******************************************************************************
+ * putEmptyTables
+ ******************************************************************************/
+static UInt8 *putEmptyTables(UInt8 *p)
+{
+    UInt8  *box;
+
+    /* The sample tables are empty, the samples are in the fragments */
+    box = p; p = fullBoxStart(p, "stts", 0, 0);
+    p = put32(p, 0);
+    boxEnd(box, p);
+
+    box = p; p = fullBoxStart(p, "stsc", 0, 0);
+    p = put32(p, 0);
+    boxEnd(box, p);
+
+    box = p; p = fullBoxStart(p, "stsz", 0, 0);
+    p = putZero(p, 8);
+    boxEnd(box, p);
+
+    box = p; p = fullBoxStart(p, "stco", 0, 0);
+    p = put32(p, 0);
+    boxEnd(box, p);
+
+    return p;
+}
+
+/******************************************************************************
+ * putTrex
+ ******************************************************************************/
+static UInt8 *putTrex(UInt8 *p, UInt32 trackId)
+{
+    UInt8  *box;
+
+    box = p; p = fullBoxStart(p, "trex", 0, 0);
+    p = put32(p, trackId);
+    p = put32(p, 1);                    /* sample description index */
+    p = putZero(p, 12);                 /* defaults, set in every tfhd */
+    boxEnd(box, p);
+
+    return p;
+}
+
+/******************************************************************************
+ * putAudioTrak
+ ******************************************************************************/
+static UInt8 *putAudioTrak(Mp4Mux *mux, UInt8 *p)
+{
+    UInt8  *trak, *mdia, *minf, *stbl, *stsd, *entry;
+    UInt8  *box;
+
+    trak = p; p = boxStart(p, "trak");
+
+    box = p; p = fullBoxStart(p, "tkhd", 0, 0x3);  /* enabled, in movie */
+    p = putZero(p, 8);
+    p = put32(p, MP4_AUDIO_TRACK_ID);
+    p = putZero(p, 4);
+    p = put32(p, 0);                    /* duration */
+    p = putZero(p, 8);
+    p = putZero(p, 4);                  /* layer, group */
+    p = put16(p, 0x0100);               /* full volume */
+    p = putZero(p, 2);
+    p = putMatrix(p);
+    p = putZero(p, 8);                  /* no width or height */
+    boxEnd(box, p);
+
+    mdia = p; p = boxStart(p, "mdia");
+
+    box = p; p = fullBoxStart(p, "mdhd", 0, 0);
+    p = putZero(p, 8);
+    p = put32(p, MP4_AUDIO_RATE);
+    p = put32(p, 0);
+    p = put16(p, 0x55c4);               /* "und" */
+    p = put16(p, 0);
+    boxEnd(box, p);
+
+    box = p; p = fullBoxStart(p, "hdlr", 0, 0);
+    p = put32(p, 0);
+    memcpy(p, "soun", 4);
+    p = putZero(p + 4, 12);
+    memcpy(p, "SoundHandler", 13);
+    p += 13;
+    boxEnd(box, p);
+
+    minf = p; p = boxStart(p, "minf");
+
+    box = p; p = fullBoxStart(p, "smhd", 0, 0);
+    p = putZero(p, 4);                  /* balance */
+    boxEnd(box, p);
+
+    p = putDinf(p);
+
+    stbl = p; p = boxStart(p, "stbl");
+
+    stsd = p; p = fullBoxStart(p, "stsd", 0, 0);
+    p = put32(p, 1);
+
+    /* Sample entry as for QuickTime, which players know G.711 by */
+    entry = p; p = boxStart(p, mux->ulaw ? "ulaw" : "alaw");
+    p = putZero(p, 6);
+    p = put16(p, 1);                    /* data reference index */
+    p = putZero(p, 8);
+    p = put16(p, 1);                    /* mono */
+    p = put16(p, 16);                   /* sample size as decoded */
+    p = putZero(p, 4);
+    p = put32(p, MP4_AUDIO_RATE << 16);
+    boxEnd(entry, p);
+
+    boxEnd(stsd, p);
+
+    p = putEmptyTables(p);
+
+    boxEnd(stbl, p);
+    boxEnd(minf, p);
+    boxEnd(mdia, p);
+    boxEnd(trak, p);
+
+    return p;
+}
+
+/******************************************************************************
+ * writeInit
+ ******************************************************************************/
+static Int writeInit(Mp4Mux *mux)
+{
+    UInt8   init[MP4_INIT_MAX];
+    UInt8  *p = init;
+    UInt8  *moov, *trak, *mdia, *minf, *stbl, *stsd, *avc1, *mvex;
+    UInt8  *box;
+
+    box = p; p = boxStart(p, "ftyp");
+    memcpy(p, "iso5", 4);
+    p = put32(p + 4, 512);
+    memcpy(p, "iso5iso6avc1mp41", 16);
+    p += 16;
+    boxEnd(box, p);
+
+    moov = p; p = boxStart(p, "moov");
+
+    box = p; p = fullBoxStart(p, "mvhd", 0, 0);
+    p = putZero(p, 8);                  /* creation, modification time */
+    p = put32(p, 1000);                 /* timescale */
+    p = put32(p, 0);                    /* duration, all in the fragments */
+    p = put32(p, 0x00010000);           /* rate */
+    p = put16(p, 0x0100);               /* volume */
+    p = putZero(p, 10);
+    p = putMatrix(p);
+    p = putZero(p, 24);
+    p = put32(p, mux->audio ? MP4_AUDIO_TRACK_ID + 1 : MP4_TRACK_ID + 1);
+    boxEnd(box, p);
+
+    trak = p; p = boxStart(p, "trak");
+
+    box = p; p = fullBoxStart(p, "tkhd", 0, 0x3);  /* enabled, in movie */
+    p = putZero(p, 8);
+    p = put32(p, MP4_TRACK_ID);
+    p = putZero(p, 4);
+    p = put32(p, 0);                    /* duration */
+    p = putZero(p, 8);
+    p = putZero(p, 8);                  /* layer, group, volume */
+    p = putMatrix(p);
+    p = put32(p, mux->width << 16);
+    p = put32(p, mux->height << 16);
+    boxEnd(box, p);
+
+    mdia = p; p = boxStart(p, "mdia");
+
+    box = p; p = fullBoxStart(p, "mdhd", 0, 0);
+    p = putZero(p, 8);
+    p = put32(p, MP4_TIMESCALE);
+    p = put32(p, 0);
+    p = put16(p, 0x55c4);               /* "und" */
+    p = put16(p, 0);
+    boxEnd(box, p);
+
+    box = p; p = fullBoxStart(p, "hdlr", 0, 0);
+    p = put32(p, 0);
+    memcpy(p, "vide", 4);
+    p = putZero(p + 4, 12);
+    memcpy(p, "VideoHandler", 13);
+    p += 13;
+    boxEnd(box, p);
+
+    minf = p; p = boxStart(p, "minf");
+
+    box = p; p = fullBoxStart(p, "vmhd", 0, 0x1);
+    p = putZero(p, 8);
+    boxEnd(box, p);
+
+    p = putDinf(p);
+
+    stbl = p; p = boxStart(p, "stbl");
+
+    stsd = p; p = fullBoxStart(p, "stsd", 0, 0);
+    p = put32(p, 1);
+
+    avc1 = p; p = boxStart(p, "avc1");
+    p = putZero(p, 6);
+    p = put16(p, 1);                    /* data reference index */
+    p = putZero(p, 16);
+    p = put16(p, mux->width);
+    p = put16(p, mux->height);
+    p = put32(p, 0x00480000);           /* 72 dpi */
+    p = put32(p, 0x00480000);
+    p = put32(p, 0);
+    p = put16(p, 1);                    /* frame count */
+    p = putZero(p, 32);                 /* compressor name */
+    p = put16(p, 0x0018);               /* depth */
+    p = put16(p, 0xffff);
+
+    box = p; p = boxStart(p, "avcC");
+    *p++ = 1;                           /* configuration version */
+    *p++ = mux->sps[1];                 /* profile */
+    *p++ = mux->sps[2];                 /* constraint flags */
+    *p++ = mux->sps[3];                 /* level */
+    *p++ = 0xff;                        /* 4 byte NAL lengths */
+    *p++ = 0xe1;                        /* one SPS */
+    p = put16(p, mux->spsLen);
+    memcpy(p, mux->sps, mux->spsLen);
+    p += mux->spsLen;
+    *p++ = 1;                           /* one PPS */
+    p = put16(p, mux->ppsLen);
+    memcpy(p, mux->pps, mux->ppsLen);
+    p += mux->ppsLen;
+    boxEnd(box, p);
+
+    boxEnd(avc1, p);
+    boxEnd(stsd, p);
+
+    p = putEmptyTables(p);
+
+    boxEnd(stbl, p);
+    boxEnd(minf, p);
+    boxEnd(mdia, p);
+    boxEnd(trak, p);
+
+    if (mux->audio) {
+        p = putAudioTrak(mux, p);
+    }
+
+    mvex = p; p = boxStart(p, "mvex");
+    p = putTrex(p, MP4_TRACK_ID);
+    if (mux->audio) {
+        p = putTrex(p, MP4_AUDIO_TRACK_ID);
+    }
+    boxEnd(mvex, p);
+
+    boxEnd(moov, p);
+
+    if (storagePut(mux->st, (Int8 *) init, p - init, TRUE) < 0) {
+        return Dmai_EFAIL;
+    }
+
+    mux->filePos = p - init;
+    mux->stats.boxBytes += p - init;
+    mux->stats.files++;
+
+    return Dmai_EOK;
+}
+
+/******************************************************************************
+ * addRandom
+ ******************************************************************************/
+static Void addRandom(Mp4Mux *mux, UInt64 time, UInt64 offset)
+{
+    Mp4Random  *random;
+    Int         max;
+
+    if (mux->numRandom == mux->maxRandom) {
+        max = mux->maxRandom ? mux->maxRandom * 2 : 64;
+        random = realloc(mux->random, max * sizeof(Mp4Random));
+
+        /* The index is only a shortcut, players can do without it */
+        if (random == NULL) {
+            return;
+        }
+
+        mux->random = random;
+        mux->maxRandom = max;
+    }
+
+    mux->random[mux->numRandom].time = time;
+    mux->random[mux->numRandom].offset = offset;
+    mux->numRandom++;
+}
+
+/******************************************************************************
+ * writeFragment
+ ******************************************************************************/
+static Void writeFragment(Mp4Mux *mux, UInt32 lastDuration)
+{
+    Int         n = mux->numSamples;
+    UInt32      moofSize = MP4_MOOF_SIZE(n);
+    UInt32      audioUsed = mux->audioUsed;
+    UInt8      *start;
+    UInt8      *p;
+    UInt8      *traf, *box;
+    Int         i;
+
+    /* The audio goes behind the video if there is room left for it */
+    if (audioUsed > mux->dataSize - mux->used) {
+        mux->stats.audioDropped += audioUsed;
+        audioUsed = 0;
+    }
+
+    if (audioUsed > 0) {
+        moofSize += MP4_AUDIO_TRAF_SIZE;
+        memcpy(mux->data + mux->used, mux->audioBuf, audioUsed);
+    }
+
+    start = mux->data - 8 - moofSize;
+    p = start;
+
+    /* The boxes end right where the samples begin */
+    p = boxStart(p, "moof");
+
+    box = p; p = fullBoxStart(p, "mfhd", 0, 0);
+    p = put32(p, ++mux->fragSeq);
+    boxEnd(box, p);
+
+    traf = p; p = boxStart(p, "traf");
+
+    box = p; p = fullBoxStart(p, "tfhd", 0, MP4_TFHD_FLAGS);
+    p = put32(p, MP4_TRACK_ID);
+    p = put32(p, MP4_SAMPLE_NON_SYNC);
+    boxEnd(box, p);
+
+    box = p; p = fullBoxStart(p, "tfdt", 1, 0);
+    p = put64(p, mux->times[0]);
+    boxEnd(box, p);
+
+    box = p; p = fullBoxStart(p, "trun", 0, MP4_TRUN_FLAGS);
+    p = put32(p, n);
+    p = put32(p, moofSize + 8);         /* data offset from the moof */
+    p = put32(p, mux->firstSync ? MP4_SAMPLE_SYNC : MP4_SAMPLE_NON_SYNC);
+    for (i = 0; i < n; i++) {
+        p = put32(p, i < n - 1 ? (UInt32) (mux->times[i + 1] - mux->times[i])
+                               : lastDuration);
+        p = put32(p, mux->sizes[i]);
+    }
+    boxEnd(box, p);
+
+    boxEnd(traf, p);
+
+    if (audioUsed > 0) {
+        traf = p; p = boxStart(p, "traf");
+
+        box = p; p = fullBoxStart(p, "tfhd", 0, MP4_AUDIO_TFHD_FLAGS);
+        p = put32(p, MP4_AUDIO_TRACK_ID);
+        p = put32(p, 1);                /* sample duration */
+        p = put32(p, 1);                /* sample size */
+        p = put32(p, MP4_SAMPLE_SYNC);
+        boxEnd(box, p);
+
+        box = p; p = fullBoxStart(p, "tfdt", 1, 0);
+        p = put64(p, mux->audioStart);
+        boxEnd(box, p);
+
+        box = p; p = fullBoxStart(p, "trun", 0, MP4_AUDIO_TRUN_FLAGS);
+        p = put32(p, audioUsed);
+        p = put32(p, moofSize + 8 + mux->used);
+        boxEnd(box, p);
+
+        boxEnd(traf, p);
+    }
+
+    boxEnd(start, p);
+
+    box = p; p = boxStart(p, "mdat");
+    boxEnd(box, p + mux->used + audioUsed);
+
+    /*
+     * A fragment not starting with an IDR is only queued if the one before
+     * made it, so storage never records frames whose references are gone.
+     */
+    if (storagePut(mux->st, (Int8 *) start,
+                   moofSize + 8 + mux->used + audioUsed,
+                   mux->firstSync) == Dmai_EOK) {
+        if (mux->firstSync) {
+            addRandom(mux, mux->times[0], mux->filePos);
+        }
+
+        mux->filePos += moofSize + 8 + mux->used + audioUsed;
+        mux->stats.fragments++;
+        mux->stats.dataBytes += mux->used;
+        mux->stats.boxBytes += moofSize + 8;
+        mux->stats.audioBytes += audioUsed;
+    }
+    else {
+        mux->stats.dropped++;
+    }
+
+    mux->lastDuration = lastDuration;
+    mux->numSamples = 0;
+    mux->used = 0;
+    mux->audioUsed = 0;
+    mux->audioStart = mux->audioNext;
+}
+
+/******************************************************************************
+ * writeIndex
+ ******************************************************************************/
+static Void writeIndex(Mp4Mux *mux)
+{
+    UInt32      size;
+    UInt8      *mfra, *p, *box;
+    Int         i;
+
+    size = 8 + 24 + MP4_TFRA_ENTRY_SIZE * mux->numRandom + 16;
+    mfra = malloc(size);
+
+    if (mfra == NULL) {
+        Dmai_err0("Failed to allocate the random access index\n");
+        return;
+    }
+
+    p = boxStart(mfra, "mfra");
+
+    box = p; p = fullBoxStart(p, "tfra", 1, 0);
+    p = put32(p, MP4_TRACK_ID);
+    p = put32(p, 0);                    /* one byte sample numbers */
+    p = put32(p, mux->numRandom);
+    for (i = 0; i < mux->numRandom; i++) {
+        p = put64(p, mux->random[i].time);
+        p = put64(p, mux->random[i].offset);
+        *p++ = 1;                       /* traf, trun and sample number */
+        *p++ = 1;
+        *p++ = 1;
+    }
+    boxEnd(box, p);
+
+    /* Lets a player find the mfra from the end of the file */
+    box = p; p = fullBoxStart(p, "mfro", 0, 0);
+    p = put32(p, size);
+    boxEnd(box, p);
+
+    boxEnd(mfra, p);
+
+    if (storagePut(mux->st, (Int8 *) mfra, size, TRUE) == Dmai_EOK) {
+        mux->stats.boxBytes += size;
+    }
+
+    free(mfra);
+}
+
+/******************************************************************************
+ * copySamples
+ ******************************************************************************/
+static Int32 copySamples(Mp4Mux *mux, UInt8 *buf, Int32 size)
+{
+    UInt8      *dst = mux->data + mux->used;
+    UInt32      room = mux->dataSize - mux->used;
+    UInt32      len = 0;
+    Int32       start, nal, end, nalLen;
+
+    start = nalFindStart(buf, size);
+
+    while (start < size) {
+        nal = start + 3;
+        end = nal + nalFindStart(buf + nal, size - nal);
+
+        /* Zeros in front of a 4 byte start code don't belong to the NAL */
+        for (nalLen = end - nal; nalLen > 0 && buf[nal + nalLen - 1] == 0;
+             nalLen--);
+
+        if (nalLen > 0) {
+            switch (buf[nal] & 0x1f) {
+                case NAL_TYPE_SPS:
+                    if (nalLen <= MP4_PARAM_MAX) {
+                        memcpy(mux->sps, buf + nal, nalLen);
+                        mux->spsLen = nalLen;
+                    }
+                    break;
+                case NAL_TYPE_PPS:
+                    if (nalLen <= MP4_PARAM_MAX) {
+                        memcpy(mux->pps, buf + nal, nalLen);
+                        mux->ppsLen = nalLen;
+                    }
+                    break;
+                case NAL_TYPE_AUD:
+                    break;
+                default:
+                    if (len + 4 + nalLen > room) {
+                        return -1;
+                    }
+
+                    put32(dst + len, nalLen);
+                    memcpy(dst + len + 4, buf + nal, nalLen);
+                    len += 4 + nalLen;
+                    break;
+            }
+        }
+
+        start = end;
+    }
+
+    return len;
+}
+
+/******************************************************************************
+ * mp4MuxCreate
+ ******************************************************************************/
+Mp4Mux *mp4MuxCreate(Storage *st, Int32 width, Int32 height, Int32 bufSize)
+{
+    Mp4Mux *mux;
+
+    if (bufSize <= MP4_HDR_ROOM) {
+        Dmai_err1("Fragment buffer of %d bytes too small\n", bufSize);
+        return NULL;
+    }
+
+    mux = calloc(1, sizeof(Mp4Mux));
+
+    if (mux == NULL) {
+        Dmai_err0("Failed to allocate space for muxer\n");
+        return NULL;
+    }
+
+    mux->buf = malloc(bufSize);
+
+    if (mux->buf == NULL) {
+        Dmai_err1("Failed to allocate %d byte fragment buffer\n", bufSize);
+        free(mux);
+        return NULL;
+    }
+
+    mux->st = st;
+    mux->width = width;
+    mux->height = height;
+    mux->data = mux->buf + MP4_HDR_ROOM;
+    mux->dataSize = bufSize - MP4_HDR_ROOM;
+
+    /* Until two frames give the real one, assume 30 fps */
+    mux->lastDuration = MP4_TIMESCALE / 30;
+
+    return mux;
+}
+
+/******************************************************************************
+ * mp4MuxPut
+ ******************************************************************************/
+Int mp4MuxPut(Mp4Mux *mux, UInt8 *buf, Int32 size, UInt64 time, Bool key)
+{
+    UInt64      start = frameTime();
+    UInt64      now;
+    UInt64      dts = 0;
+    Int32       len;
+    Int         ret = Dmai_EFAIL;
+
+    if (mux->started) {
+        dts = (time - mux->fileStart) * MP4_TIMESCALE / 1000000;
+
+        /* Every GOP gets a fragment of its own */
+        if (mux->numSamples > 0 &&
+            (key || mux->numSamples == MP4_MAX_SAMPLES)) {
+            writeFragment(mux, dts - mux->times[mux->numSamples - 1]);
+        }
+    }
+
+    /* Nothing can be decoded after a lost frame until the next IDR */
+    if ((!mux->started || mux->skipping) && !key) {
+        mux->stats.skipped++;
+        goto out;
+    }
+
+    len = copySamples(mux, buf, size);
+
+    /* Start another fragment if the buffer is full */
+    if (len < 0 && mux->numSamples > 0) {
+        writeFragment(mux, dts - mux->times[mux->numSamples - 1]);
+        len = copySamples(mux, buf, size);
+    }
+
+    if (len < 0) {
+        Dmai_err1("Dropping %d byte frame, too large to mux\n", size);
+        mux->skipping = TRUE;
+        mux->stats.skipped++;
+        goto out;
+    }
+
+    /* Only parameter sets or delimiters, no picture */
+    if (len == 0) {
+        goto out;
+    }
+
+    if (!mux->started) {
+        /* The init segment needs the parameter sets of the stream */
+        if (mux->spsLen < 4 || mux->ppsLen == 0 || writeInit(mux) < 0) {
+            mux->stats.skipped++;
+            goto out;
+        }
+
+        mux->started = TRUE;
+        mux->fileStart = time;
+        mux->fragSeq = 0;
+        mux->numRandom = 0;
+        dts = 0;
+    }
+
+    if (mux->numSamples == 0) {
+        mux->firstSync = key;
+    }
+
+    mux->sizes[mux->numSamples] = len;
+    mux->times[mux->numSamples] = dts;
+    mux->numSamples++;
+    mux->used += len;
+    mux->skipping = FALSE;
+    mux->stats.frames++;
+    ret = Dmai_EOK;
+
+out:
+    now = frameTime();
+    mux->stats.muxUs += now - start;
+    if (now - start > mux->stats.maxMuxUs) {
+        mux->stats.maxMuxUs = now - start;
+    }
+
+    return ret;
+}
+
+/******************************************************************************
+ * mp4MuxSetAudio
+ ******************************************************************************/
+Int mp4MuxSetAudio(Mp4Mux *mux, Bool ulaw, Int32 bufSize)
+{
+    mux->audioBuf = malloc(bufSize);
+
+    if (mux->audioBuf == NULL) {
+        Dmai_err1("Failed to allocate %d byte audio buffer\n", bufSize);
+        return Dmai_EFAIL;
+    }
+
+    mux->audio = TRUE;
+    mux->ulaw = ulaw;
+    mux->audioSize = bufSize;
+
+    return Dmai_EOK;
+}
+
+/******************************************************************************
+ * mp4MuxPutAudio
+ ******************************************************************************/
+Int mp4MuxPutAudio(Mp4Mux *mux, UInt8 *buf, Int32 size, UInt64 time)
+{
+    UInt64      pos;
+    UInt32      pad = 0;
+
+    /* Only audio that belongs to the file being written */
+    if (!mux->audio || !mux->started || time < mux->fileStart) {
+        return Dmai_EFAIL;
+    }
+
+    pos = (time - mux->fileStart) * MP4_AUDIO_RATE / 1000000;
+
+    if (!mux->audioStarted) {
+        mux->audioStarted = TRUE;
+        mux->audioStart = pos;
+        mux->audioNext = pos;
+    }
+
+    /*
+     * Capture times jitter by a few ms around where the audio runs on to.
+     * More than half a block late is a gap, more than a block early means
+     * the audio clock ran ahead and a block is dropped to catch up.
+     */
+    if (pos > mux->audioNext + size / 2) {
+        pad = pos - mux->audioNext;
+    }
+    else if (pos + size < mux->audioNext) {
+        mux->stats.audioDropped += size;
+        return Dmai_EFAIL;
+    }
+
+    if (mux->audioUsed + pad + size > mux->audioSize) {
+        mux->stats.audioDropped += size;
+        return Dmai_EFAIL;
+    }
+
+    memset(mux->audioBuf + mux->audioUsed,
+           mux->ulaw ? MP4_ULAW_SILENCE : MP4_ALAW_SILENCE, pad);
+    memcpy(mux->audioBuf + mux->audioUsed + pad, buf, size);
+    mux->audioUsed += pad + size;
+    mux->audioNext += pad + size;
+    mux->stats.audioPadded += pad;
+
+    return Dmai_EOK;
+}
+
+/******************************************************************************
+ * mp4MuxFinish
+ ******************************************************************************/
+Int mp4MuxFinish(Mp4Mux *mux)
+{
+    if (!mux->started) {
+        return Dmai_EOK;
+    }
+
+    /* The last frame is taken to last as long as the one before */
+    if (mux->numSamples > 0) {
+        writeFragment(mux, mux->numSamples > 1 ?
+                      (UInt32) (mux->times[mux->numSamples - 1] -
+                                mux->times[mux->numSamples - 2]) :
+                      mux->lastDuration);
+    }
+
+    writeIndex(mux);
+
+    mux->started = FALSE;
+    mux->audioStarted = FALSE;
+    mux->audioUsed = 0;
+
+    return Dmai_EOK;
+}
+
+/******************************************************************************
+ * mp4MuxGetStats
+ ******************************************************************************/
+Void mp4MuxGetStats(Mp4Mux *mux, Mp4MuxStats *stats)
+{
+    *stats = mux->stats;
+}
+
+/******************************************************************************
+ * mp4MuxDelete
+ ******************************************************************************/
+Void mp4MuxDelete(Mp4Mux *mux)
+{
+    free(mux->random);
+    free(mux->audioBuf);
+    free(mux->buf);
+    free(mux);
+}
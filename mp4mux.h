@@ -0,0 +1,86 @@
+/*
+ * mp4mux.h
+ *
+ * Fragmented MP4 recording of the encoded H.264 stream, optionally with
+ * G.711 speech next to it. Every file starts with an init segment and each
+ * GOP follows as a moof/mdat fragment carrying the audio captured during
+ * it, so a recording can be played and seeked while it is still being
+ * written and everything up to the last complete fragment survives a power
+ * loss.
+ */
+
+#ifndef _MP4MUX_H
+#define _MP4MUX_H
+
+#include <xdc/std.h>
+
+#include "storage.h"
+
+/* Most frames in one fragment, a longer GOP is split */
+#define MP4_MAX_SAMPLES         256
+
+/* Track timescale, the usual 90 kHz of video */
+#define MP4_TIMESCALE           90000
+
+/* G.711 samples per second, one byte each */
+#define MP4_AUDIO_RATE          8000
+
+typedef struct Mp4Mux Mp4Mux;
+
+/* What the muxer did so far */
+typedef struct Mp4MuxStats {
+    UInt32  files;              /* init segments written */
+    UInt32  frames;             /* frames muxed */
+    UInt32  skipped;            /* frames dropped waiting for an IDR */
+    UInt32  fragments;          /* fragments queued for storage */
+    UInt32  dropped;            /* fragments storage had no room for */
+    UInt64  dataBytes;          /* sample bytes */
+    UInt64  boxBytes;           /* bytes of boxes around the samples */
+    UInt64  muxUs;              /* time spent in mp4MuxPut() */
+    UInt32  maxMuxUs;           /* slowest mp4MuxPut() */
+    UInt64  audioBytes;         /* audio samples recorded */
+    UInt32  audioPadded;        /* silence filled into gaps */
+    UInt32  audioDropped;       /* audio samples there was no room for */
+} Mp4MuxStats;
+
+/*
+ * Create a muxer writing to st. A fragment is kept in a buffer of bufSize
+ * bytes until it is complete, a GOP that doesn't fit is split.
+ */
+extern Mp4Mux *mp4MuxCreate(Storage *st, Int32 width, Int32 height,
+                            Int32 bufSize);
+
+/*
+ * Add an Annex-B frame captured at time (microseconds), key if it is an
+ * IDR. A file only starts at an IDR once SPS and PPS are known, frames
+ * before that are skipped.
+ */
+extern Int mp4MuxPut(Mp4Mux *mux, UInt8 *buf, Int32 size, UInt64 time,
+                     Bool key);
+
+/*
+ * Record a G.711 track as well, ulaw or else alaw. The audio of a fragment
+ * is kept in a buffer of bufSize bytes. Call before the first frame.
+ */
+extern Int mp4MuxSetAudio(Mp4Mux *mux, Bool ulaw, Int32 bufSize);
+
+/*
+ * Add G.711 bytes captured starting at time (microseconds). Audio from
+ * before the first frame of the file is dropped, gaps are filled with
+ * silence. Put the audio captured before a frame ahead of the frame.
+ */
+extern Int mp4MuxPutAudio(Mp4Mux *mux, UInt8 *buf, Int32 size, UInt64 time);
+
+/*
+ * Write out the last fragment and the random access index of the current
+ * file. The next frame put starts a new file, call it before storageOpen().
+ */
+extern Int mp4MuxFinish(Mp4Mux *mux);
+
+/* Copy of the statistics */
+extern Void mp4MuxGetStats(Mp4Mux *mux, Mp4MuxStats *stats);
+
+/* Free the muxer, call mp4MuxFinish() first to complete the file */
+extern Void mp4MuxDelete(Mp4Mux *mux);
+
+#endif /* _MP4MUX_H */
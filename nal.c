@@ -0,0 +1,77 @@
+/*
+ * nal.c
+ *
+ * Helpers for the H.264 Annex-B streams produced by the encoder.
+ */
+
+#include <xdc/std.h>
+
+#include "nal.h"
+
+/******************************************************************************
+ * nalScanFrame
+ ******************************************************************************/
+Int nalScanFrame(UInt8 *buf, Int32 size)
+{
+    Int flags = 0;
+    Int32 i;
+    Int type;
+
+    /*
+     * Parameter sets and SEI come before the slices, so only the start of
+     * the frame is walked and the slice data itself is never scanned.
+     */
+    for (i = 0; i + 3 < size; i++) {
+        if (buf[i] != 0 || buf[i + 1] != 0 || buf[i + 2] != 1) {
+            continue;
+        }
+
+        type = buf[i + 3] & 0x1f;
+
+        switch (type) {
+            case NAL_TYPE_SPS:
+                flags |= NAL_HAS_SPS;
+                break;
+            case NAL_TYPE_PPS:
+                flags |= NAL_HAS_PPS;
+                break;
+            case NAL_TYPE_IDR:
+                return flags | NAL_IS_IDR;
+            case NAL_TYPE_SLICE:
+                return flags;
+            default:
+                break;
+        }
+
+        i += 3;
+    }
+
+    return flags;
+}
+
+/******************************************************************************
+ * nalFindStart
+ ******************************************************************************/
+Int32 nalFindStart(UInt8 *buf, Int32 size)
+{
+    Int32 i = 0;
+
+    /*
+     * A start code ends in 01 preceded by two zeros, so while the third byte
+     * looked at is above 1 none of the three positions can start one. Slice
+     * data is walked three bytes at a time.
+     */
+    while (i + 2 < size) {
+        if (buf[i + 2] > 1) {
+            i += 3;
+        }
+        else if (buf[i + 2] == 1 && buf[i + 1] == 0 && buf[i] == 0) {
+            return i;
+        }
+        else {
+            i++;
+        }
+    }
+
+    return size;
+}
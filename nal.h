@@ -0,0 +1,31 @@
+/*
+ * nal.h
+ *
+ * Helpers for the H.264 Annex-B streams produced by the encoder.
+ */
+
+#ifndef _NAL_H
+#define _NAL_H
+
+#include <xdc/std.h>
+
+/* NAL unit types */
+#define NAL_TYPE_SLICE          1
+#define NAL_TYPE_IDR            5
+#define NAL_TYPE_SEI            6
+#define NAL_TYPE_SPS            7
+#define NAL_TYPE_PPS            8
+#define NAL_TYPE_AUD            9
+
+/* What nalScanFrame() found in front of the first slice */
+#define NAL_HAS_SPS             0x1
+#define NAL_HAS_PPS             0x2
+#define NAL_IS_IDR              0x4
+
+/* Summarize the NAL units of one encoded frame */
+extern Int nalScanFrame(UInt8 *buf, Int32 size);
+
+/* Offset of the next 00 00 01 start code in buf, size if there is none */
+extern Int32 nalFindStart(UInt8 *buf, Int32 size);
+
+#endif /* _NAL_H */
@@ -0,0 +1,261 @@
+/*
+ * publish.c
+ *
+ * ============================================================================
+ * Copyright (c) Texas Instruments Inc 2009
+ *
+ * Use of this software is controlled by the terms and conditions found in the
+ * license agreement under which this software has been supplied or provided.
+ * ============================================================================
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <xdc/std.h>
+
+#include <ti/sdo/dmai/Fifo.h>
+#include <ti/sdo/dmai/BufTab.h>
+#include <ti/sdo/dmai/Rendezvous.h>
+
+#include "publish.h"
+#include "shm.h"
+#include "nal.h"
+#include "frame.h"
+#include "latency.h"
+#include "../demo.h"
+
+#define MODULE_NAME     "Publish Thread"
+
+/* Shm of a stream, numbered from 1 */
+#define SHM_DIR_FMT             "/shm/video/v%d"
+#define SHM_DIR_LEN             32
+
+/* Bytes of encoded frames kept in shm besides the slot being encoded into */
+#define SUB_SHM_HISTORY         (256 * 1024)
+
+/* Bytes of shm kept for replaying the current GOP to new readers */
+#define SUB_GOP_CACHE_SIZE      (256 * 1024)
+
+/******************************************************************************
+ * leaseSubBuf
+ ******************************************************************************/
+static Int leaseSubBuf(SHM_ST *shm, Buffer_Handle hBuf, Int32 size)
+{
+    Int8 *slot = (Int8 *) leaseShm(shm, size);
+
+    if (slot == NULL) {
+        return Dmai_EFAIL;
+    }
+
+    /* Let the encoder write straight into the next shm slot */
+    Buffer_setUserPtr(hBuf, slot);
+    Buffer_setSize(hBuf, size);
+
+    return Dmai_EOK;
+}
+
+/******************************************************************************
+ * publishSubBuf
+ ******************************************************************************/
+static Void publishSubBuf(SHM_ST *shm, Buffer_Handle hBuf, Int streamId,
+                          PublishLatency *latency, LatencyHist **hists)
+{
+    FrameInfo  *info  = getFrameInfo(hBuf);
+    SHM_FRAME   frame;
+    UInt64      now;
+    UInt32      us;
+    Int         nal;
+
+    /* Describe the frame so readers don't have to parse the bitstream */
+    memset(&frame, 0, sizeof(frame));
+    frame.size     = Buffer_getNumBytesUsed(hBuf);
+    frame.streamId = streamId;
+
+    nal = nalScanFrame((UInt8 *) Buffer_getUserPtr(hBuf), frame.size);
+    if (nal & NAL_IS_IDR) {
+        frame.flags |= SHM_FLAG_KEY;
+    }
+    if (nal & NAL_HAS_SPS) {
+        frame.flags |= SHM_FLAG_CONFIG;
+    }
+
+    if (info) {
+        frame.captureTime = info->captureTime;
+    }
+
+    /* The frame was encoded into shm, just publish it */
+    if (commitShm(shm, &frame) == 0) {
+        ERR("Failed to publish frame of stream %d\n", streamId);
+        return;
+    }
+
+    /* How long readers waited for it since the sensor */
+    if (info) {
+        now = frameTime();
+        us = now - info->captureTime;
+        latencyAdd(hists[0], info->encodeTime, now);
+        latencyAdd(hists[1], info->captureTime, now);
+
+        latency->frames++;
+        latency->totalUs += us;
+        if (us > latency->maxUs) {
+            latency->maxUs = us;
+        }
+    }
+}
+
+/******************************************************************************
+ * publishThrFxn
+ ******************************************************************************/
+Void *publishThrFxn(Void *arg)
+{
+    PublishEnv         *envp            = (PublishEnv *) arg;
+    Void               *status          = THREAD_SUCCESS;
+    Buffer_Attrs        bAttrs          = Buffer_Attrs_DEFAULT;
+    Buffer_Attrs        rAttrs          = Buffer_Attrs_DEFAULT;
+    BufTab_Handle       hsBufTab        = NULL;
+    Buffer_Handle       hShmBuf         = NULL;
+    Buffer_Handle       hsOutBuf;
+    Int                 fifoRet;
+    Int                 bufIdx;
+    Int32               shmSize;
+    Char                shmDir[SHM_DIR_LEN];
+    Char                name[LATENCY_NAME_LEN];
+    LatencyHist        *hists[2];
+    SHM_ST	           *shm_pns         = NULL;
+
+    /*
+     * Keep the shm ring in a contiguous buffer so the encoder can write the
+     * stream straight into it. Readers map it through CMEM. Frames
+     * only take the bytes they need, the worst case outBufSize is only
+     * reserved for the frames being encoded, twice for every slot past the
+     * first, which also needs room to move its frame down when published.
+     */
+    shmSize = (2 * envp->numBufs - 1) * envp->outBufSize + SUB_SHM_HISTORY;
+    hShmBuf = Buffer_create(shmDataSize(shmSize, SUB_GOP_CACHE_SIZE),
+                            &bAttrs);
+
+    if (hShmBuf == NULL) {
+        ERR("Failed to allocate contiguous buffers\n");
+        cleanup(THREAD_FAILURE);
+    }
+
+    /* Create a share memory for tansporting data to upper layer */
+    snprintf(shmDir, sizeof(shmDir), SHM_DIR_FMT, envp->streamId + 1);
+    shm_pns = createShmExt(shmDir, shmSize, SUB_GOP_CACHE_SIZE,
+                           (char *) Buffer_getUserPtr(hShmBuf),
+                           (unsigned long) Buffer_getPhysicalPtr(hShmBuf));
+    Dmai_dbg1("bufsize is %d\n",envp->outBufSize);
+
+    if (shm_pns == NULL) {
+        ERR("Failed to create share memory\n");
+        cleanup(THREAD_FAILURE);
+    }
+
+    /* The video thread only encodes the stream while someone reads it */
+    envp->stream->shm = shm_pns;
+
+    /* Encoded frame to shm, and sensor to shm */
+    snprintf(name, sizeof(name), "s%d publish", envp->streamId);
+    hists[0] = latencyCreate(name);
+    snprintf(name, sizeof(name), "s%d to shm", envp->streamId);
+    hists[1] = latencyCreate(name);
+
+    /*
+     * Create a table of buffers for communicating resized buffers to
+     * and from the video thread. They only reference shm slots.
+     */
+    rAttrs.reference = TRUE;
+    hsBufTab = BufTab_create(envp->numBufs, envp->outBufSize, &rAttrs);
+
+    if (hsBufTab == NULL) {
+        ERR("Failed to allocate contiguous buffers\n");
+        cleanup(THREAD_FAILURE);
+    }
+
+    /* Send all buffers to the video thread each with a shm slot */
+    for (bufIdx = 0; bufIdx < envp->numBufs; bufIdx++) {
+        if (leaseSubBuf(shm_pns, BufTab_getBuf(hsBufTab, bufIdx),
+                        envp->outBufSize) < 0) {
+            ERR("Failed to lease a shm slot\n");
+            cleanup(THREAD_FAILURE);
+        }
+
+        if (Fifo_put(envp->hOutFifo, BufTab_getBuf(hsBufTab, bufIdx)) < 0) {
+            ERR("Failed to send buffer to video thread\n");
+            cleanup(THREAD_FAILURE);
+        }
+    }
+
+    /* Signal that initialization is done and wait for other threads */
+    Rendezvous_meet(envp->hRendezvousInit);
+
+    while (TRUE) {
+        /* Get an encoded resized buffer from the video thread */
+        fifoRet = Fifo_get(envp->hInFifo, &hsOutBuf);
+
+        if (fifoRet < 0) {
+            ERR("Failed to get resized buffer from video thread\n");
+            cleanup(THREAD_FAILURE);
+        }
+
+        /* Did the video thread flush the fifo? */
+        if (fifoRet == Dmai_EFLUSH) {
+            cleanup(THREAD_SUCCESS);
+        }
+
+        /* Publish the encoded resized frame to shm readers */
+        publishSubBuf(shm_pns, hsOutBuf, envp->streamId, &envp->latency,
+                      hists);
+
+        /* Return resized buffer to video thread with the next slot */
+        if (leaseSubBuf(shm_pns, hsOutBuf, envp->outBufSize) < 0) {
+            ERR("Failed to lease a shm slot\n");
+            cleanup(THREAD_FAILURE);
+        }
+
+        if (Fifo_put(envp->hOutFifo, hsOutBuf) < 0) {
+            ERR("Failed to send buffer to video thread\n");
+            cleanup(THREAD_FAILURE);
+        }
+    }
+
+cleanup:
+    /* Make sure the other threads aren't waiting for us */
+    Rendezvous_force(envp->hRendezvousInit);
+    Pause_off(envp->hPauseProcess);
+    Fifo_flush(envp->hOutFifo);
+
+    /* Meet up with other threads before cleaning up */
+    Rendezvous_meet(envp->hRendezvousCleanup);
+
+    /* Clean up the thread before exiting */
+    if (envp->latency.frames) {
+        printf("Publish: stream %d, %u frames, capture to shm %llu us on "
+               "average, %u us at most\n", envp->streamId,
+               (unsigned) envp->latency.frames,
+               (unsigned long long) (envp->latency.totalUs /
+                                     envp->latency.frames),
+               (unsigned) envp->latency.maxUs);
+    }
+
+    if (hsBufTab) {
+        BufTab_delete(hsBufTab);
+    }
+
+	if (shm_pns) {
+        printf("Shm: %u frames, %u overruns, %u rejected, GOP cache %u of "
+               "%u bytes (%u GOPs too large)\n", shm_pns->hdr->head,
+               shm_pns->hdr->overruns, shm_pns->hdr->rejects,
+               shm_pns->hdr->gopUsed,
+               shm_pns->hdr->gopSize, shm_pns->hdr->gopOverflows);
+		deleteShm(shm_pns);
+	}
+
+    if (hShmBuf) {
+        Buffer_delete(hShmBuf);
+    }
+
+    return status;
+}
@@ -0,0 +1,43 @@
+/*
+ * publish.h
+ *
+ * Live publishing of an encoded stream to shm readers, a thread for each
+ * published stream so the recording never holds them up.
+ */
+
+#ifndef _PUBLISH_H
+#define _PUBLISH_H
+
+#include <xdc/std.h>
+
+#include <ti/sdo/dmai/Fifo.h>
+#include <ti/sdo/dmai/Pause.h>
+#include <ti/sdo/dmai/Rendezvous.h>
+
+#include "video.h"
+
+/* Time from capture to publishing */
+typedef struct PublishLatency {
+    UInt32            frames;
+    UInt32            maxUs;
+    UInt64            totalUs;
+} PublishLatency;
+
+/* Environment passed when creating the thread */
+typedef struct PublishEnv {
+    Rendezvous_Handle hRendezvousInit;
+    Rendezvous_Handle hRendezvousCleanup;
+    Pause_Handle      hPauseProcess;
+    Fifo_Handle       hOutFifo;
+    Fifo_Handle       hInFifo;
+    Int               streamId;         /* published as /shm/video/v<id+1> */
+    VideoStream      *stream;           /* told where its readers are */
+    Int32             outBufSize;
+    Int               numBufs;          /* shm slots leased at a time */
+    PublishLatency    latency;          /* written by the publish thread */
+} PublishEnv;
+
+/* Thread function prototype */
+extern Void *publishThrFxn(Void *arg);
+
+#endif /* _PUBLISH_H */
@@ -0,0 +1,436 @@
+/*
+ * quota.c
+ *
+ * Keeps free space on the recording card. The directories are listed once
+ * when they are added, from then on inotify says which files were finished
+ * or removed, so the card is never rescanned. Free space itself comes from
+ * statvfs().
+ *
+ * When free space runs short the oldest finished file is shrunk from its
+ * end in steps of QUOTA_TRUNCATE_STEP and unlinked once it is small. FAT
+ * releases clusters one by one, deleting a large file in one go would
+ * hold the file system for a long time. quotaStep() does one step per
+ * call and is run by the storage thread between chunk writes, so freeing
+ * space never competes with writing the recording.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/inotify.h>
+
+#include <xdc/std.h>
+
+#include <ti/sdo/dmai/Dmai.h>
+
+#include "quota.h"
+
+#define MODULE_NAME     "Quota"
+
+#define QUOTA_DIR_LEN           48
+#define QUOTA_NAME_LEN          32
+
+/* Bytes released by one truncate */
+#define QUOTA_TRUNCATE_STEP     (8 * 1024 * 1024)
+
+/* A file in one of the directories */
+typedef struct QuotaFile {
+    Char    name[QUOTA_NAME_LEN];
+    Int     dir;
+    UInt64  size;
+    time_t  mtime;
+    Bool    closed;             /* finished, can be deleted */
+} QuotaFile;
+
+struct Quota {
+    UInt64          freeBytes;
+    Int             fd;         /* inotify */
+    Int             numDirs;
+    Char            dirs[QUOTA_MAX_DIRS][QUOTA_DIR_LEN];
+    Int             wd[QUOTA_MAX_DIRS];
+    QuotaFile      *files;      /* oldest first */
+    Int             numFiles;
+    Int             maxFiles;
+    Int             victimFd;   /* file being deleted */
+    QuotaFile       victim;
+    QuotaStats      stats;
+};
+
+/******************************************************************************
+ * timeMs
+ ******************************************************************************/
+static UInt32 timeMs(Void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/******************************************************************************
+ * makePath
+ ******************************************************************************/
+static Void makePath(Quota *q, QuotaFile *file, Char *path)
+{
+    sprintf(path, "%s/%s", q->dirs[file->dir], file->name);
+}
+
+/******************************************************************************
+ * findFile
+ ******************************************************************************/
+static Int findFile(Quota *q, Int dir, Char *name)
+{
+    Int i;
+
+    /* New files are at the end, which is where most lookups are for */
+    for (i = q->numFiles - 1; i >= 0; i--) {
+        if (q->files[i].dir == dir && strcmp(q->files[i].name, name) == 0) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+/******************************************************************************
+ * addFile
+ ******************************************************************************/
+static QuotaFile *addFile(Quota *q, Int dir, Char *name)
+{
+    QuotaFile  *files;
+    Int         max;
+
+    if (name[0] == '.' || strlen(name) >= QUOTA_NAME_LEN) {
+        return NULL;
+    }
+
+    if (q->numFiles == q->maxFiles) {
+        max = q->maxFiles ? q->maxFiles * 2 : 256;
+        files = realloc(q->files, max * sizeof(QuotaFile));
+
+        if (files == NULL) {
+            Dmai_err1("Failed to track %s\n", name);
+            return NULL;
+        }
+
+        q->files = files;
+        q->maxFiles = max;
+    }
+
+    memset(&q->files[q->numFiles], 0, sizeof(QuotaFile));
+    strcpy(q->files[q->numFiles].name, name);
+    q->files[q->numFiles].dir = dir;
+    q->stats.files++;
+
+    return &q->files[q->numFiles++];
+}
+
+/******************************************************************************
+ * removeFile
+ ******************************************************************************/
+static Void removeFile(Quota *q, Int i)
+{
+    if (q->files[i].closed) {
+        q->stats.bytes -= q->files[i].size;
+    }
+
+    q->stats.files--;
+    q->numFiles--;
+    memmove(&q->files[i], &q->files[i + 1],
+            (q->numFiles - i) * sizeof(QuotaFile));
+}
+
+/******************************************************************************
+ * closeFile
+ ******************************************************************************/
+static Void closeFile(Quota *q, QuotaFile *file)
+{
+    Char        path[QUOTA_DIR_LEN + QUOTA_NAME_LEN + 1];
+    struct stat st;
+
+    makePath(q, file, path);
+
+    /* Anything but a regular file is left alone */
+    if (stat(path, &st) == 0 && S_ISREG(st.st_mode)) {
+        if (file->closed) {
+            q->stats.bytes -= file->size;
+        }
+
+        file->size = st.st_size;
+        file->mtime = st.st_mtime;
+        file->closed = TRUE;
+        q->stats.bytes += file->size;
+    }
+}
+
+/******************************************************************************
+ * readEvents
+ ******************************************************************************/
+static Void readEvents(Quota *q)
+{
+    Char                    buf[4096]
+                                __attribute__ ((aligned(8)));
+    struct inotify_event   *event;
+    QuotaFile              *file;
+    ssize_t                 len;
+    Char                   *p;
+    Int                     dir, i;
+
+    while ((len = read(q->fd, buf, sizeof(buf))) > 0) {
+        for (p = buf; p < buf + len; p += sizeof(*event) + event->len) {
+            event = (struct inotify_event *) p;
+
+            for (dir = 0; dir < q->numDirs; dir++) {
+                if (q->wd[dir] == event->wd) {
+                    break;
+                }
+            }
+
+            if (dir == q->numDirs || event->len == 0) {
+                continue;
+            }
+
+            i = findFile(q, dir, event->name);
+
+            if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+                if (i >= 0) {
+                    removeFile(q, i);
+                }
+                continue;
+            }
+
+            file = i >= 0 ? &q->files[i] : addFile(q, dir, event->name);
+
+            /* Only files nobody writes any more can go */
+            if (file && (event->mask & IN_CLOSE_WRITE)) {
+                closeFile(q, file);
+            }
+        }
+    }
+}
+
+/******************************************************************************
+ * compareAge
+ ******************************************************************************/
+static int compareAge(const void *a, const void *b)
+{
+    const QuotaFile *fa = a, *fb = b;
+
+    if (fa->mtime != fb->mtime) {
+        return fa->mtime < fb->mtime ? -1 : 1;
+    }
+
+    return strcmp(fa->name, fb->name);
+}
+
+/******************************************************************************
+ * freeSpace
+ ******************************************************************************/
+static UInt64 freeSpace(Quota *q)
+{
+    struct statvfs vfs;
+
+    if (statvfs(q->dirs[0], &vfs) != 0) {
+        return (UInt64) -1;
+    }
+
+    return (UInt64) vfs.f_bavail * vfs.f_frsize;
+}
+
+/******************************************************************************
+ * quotaCreate
+ ******************************************************************************/
+Quota *quotaCreate(UInt64 freeBytes)
+{
+    Quota *q;
+
+    q = calloc(1, sizeof(Quota));
+
+    if (q == NULL) {
+        Dmai_err0("Failed to allocate quota object\n");
+        return NULL;
+    }
+
+    q->freeBytes = freeBytes;
+    q->victimFd = -1;
+    q->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+    if (q->fd == -1) {
+        Dmai_err1("Failed to initialize inotify (%d)\n", errno);
+        free(q);
+        return NULL;
+    }
+
+    return q;
+}
+
+/******************************************************************************
+ * quotaAddDir
+ ******************************************************************************/
+Int quotaAddDir(Quota *q, Char *dirName)
+{
+    DIR            *dirp;
+    struct dirent  *entry;
+    QuotaFile      *file;
+    Int             dir = q->numDirs;
+    Int             first = q->numFiles;
+
+    if (dir == QUOTA_MAX_DIRS || strlen(dirName) >= QUOTA_DIR_LEN) {
+        Dmai_err1("Can't look after %s\n", dirName);
+        return Dmai_EFAIL;
+    }
+
+    /* Watch before listing so nothing falls in between */
+    q->wd[dir] = inotify_add_watch(q->fd, dirName, IN_CLOSE_WRITE |
+                                   IN_CREATE | IN_MOVED_TO | IN_DELETE |
+                                   IN_MOVED_FROM);
+
+    if (q->wd[dir] == -1) {
+        Dmai_err2("Failed to watch %s (%d)\n", dirName, errno);
+        return Dmai_EFAIL;
+    }
+
+    strcpy(q->dirs[dir], dirName);
+    q->numDirs++;
+
+    dirp = opendir(dirName);
+
+    if (dirp == NULL) {
+        Dmai_err2("Failed to list %s (%d)\n", dirName, errno);
+        return Dmai_EFAIL;
+    }
+
+    while ((entry = readdir(dirp)) != NULL) {
+        if (findFile(q, dir, entry->d_name) < 0 &&
+            (file = addFile(q, dir, entry->d_name)) != NULL) {
+            closeFile(q, file);
+        }
+    }
+
+    closedir(dirp);
+
+    /* What was there before is older than anything written from now on */
+    qsort(q->files, q->numFiles, sizeof(QuotaFile), compareAge);
+
+    Dmai_dbg3("%s holds %d files, %llu bytes in all\n", dirName,
+              q->numFiles - first, (unsigned long long) q->stats.bytes);
+
+    return Dmai_EOK;
+}
+
+/******************************************************************************
+ * quotaStep
+ ******************************************************************************/
+Bool quotaStep(Quota *q)
+{
+    Char        path[QUOTA_DIR_LEN + QUOTA_NAME_LEN + 1];
+    struct stat st;
+    UInt32      start, ms;
+    Int         i;
+
+    readEvents(q);
+
+    if (q->victimFd == -1) {
+        if (q->numDirs == 0 || freeSpace(q) >= q->freeBytes) {
+            return FALSE;
+        }
+
+        /* The oldest file that is finished, never the one being written */
+        for (i = 0; i < q->numFiles && !q->files[i].closed; i++);
+
+        if (i == q->numFiles) {
+            return FALSE;
+        }
+
+        q->victim = q->files[i];
+        makePath(q, &q->victim, path);
+        q->victimFd = open(path, O_WRONLY);
+
+        if (q->victimFd == -1) {
+            Dmai_err2("Failed to open %s for deleting (%d)\n", path, errno);
+            removeFile(q, i);
+            return TRUE;
+        }
+
+        return TRUE;
+    }
+
+    makePath(q, &q->victim, path);
+    start = timeMs();
+
+    if (fstat(q->victimFd, &st) != 0) {
+        st.st_size = 0;
+    }
+
+    /* Shrink it from the end a step at a time, then unlink what is left */
+    if (st.st_size > QUOTA_TRUNCATE_STEP) {
+        if (ftruncate(q->victimFd, st.st_size - QUOTA_TRUNCATE_STEP) == 0) {
+            q->stats.deletedBytes += QUOTA_TRUNCATE_STEP;
+        }
+        else {
+            Dmai_err2("Failed to shrink %s (%d)\n", path, errno);
+            close(q->victimFd);
+            q->victimFd = -1;
+        }
+    }
+    else {
+        close(q->victimFd);
+        q->victimFd = -1;
+
+        if (unlink(path) == 0) {
+            q->stats.deletedFiles++;
+            q->stats.deletedBytes += st.st_size;
+        }
+        else {
+            Dmai_err2("Failed to delete %s (%d)\n", path, errno);
+        }
+    }
+
+    ms = timeMs() - start;
+    q->stats.steps++;
+    if (ms > q->stats.maxStepMs) {
+        q->stats.maxStepMs = ms;
+    }
+
+    /* Forget it once done, the list may have moved in the meantime */
+    if (q->victimFd == -1 &&
+        (i = findFile(q, q->victim.dir, q->victim.name)) >= 0) {
+        removeFile(q, i);
+    }
+
+    return TRUE;
+}
+
+/******************************************************************************
+ * quotaGetStats
+ ******************************************************************************/
+Void quotaGetStats(Quota *q, QuotaStats *stats)
+{
+    *stats = q->stats;
+}
+
+/******************************************************************************
+ * quotaDelete
+ ******************************************************************************/
+Void quotaDelete(Quota *q)
+{
+    if (q) {
+        if (q->victimFd != -1) {
+            close(q->victimFd);
+        }
+
+        close(q->fd);
+        free(q->files);
+        free(q);
+    }
+}
@@ -0,0 +1,51 @@
+/*
+ * quota.h
+ *
+ * Keeps free space on the recording card by deleting the oldest files in
+ * the recording directories, a little at a time, from the storage thread
+ * while it has nothing to write.
+ */
+
+#ifndef _QUOTA_H
+#define _QUOTA_H
+
+#include <xdc/std.h>
+
+/* Most directories one quota can look after */
+#define QUOTA_MAX_DIRS          4
+
+typedef struct Quota Quota;
+
+/* What the quota did so far */
+typedef struct QuotaStats {
+    UInt32  files;              /* files in the directories */
+    UInt64  bytes;              /* bytes of the finished ones */
+    UInt32  deletedFiles;
+    UInt64  deletedBytes;
+    UInt32  steps;              /* truncate or unlink calls */
+    UInt32  maxStepMs;          /* slowest of them */
+} QuotaStats;
+
+/* Keep at least freeBytes free on the file system of the directories */
+extern Quota *quotaCreate(UInt64 freeBytes);
+
+/*
+ * Look after the files in dirName, all on the same file system. Its
+ * contents are listed once, after that changes are followed as they
+ * happen. Files whose names start with a dot are never touched.
+ */
+extern Int quotaAddDir(Quota *q, Char *dirName);
+
+/*
+ * Do a bounded piece of work: pick up new and removed files, and if free
+ * space is short shrink or delete the oldest file. Returns TRUE while
+ * there is more to do.
+ */
+extern Bool quotaStep(Quota *q);
+
+/* Copy of the statistics */
+extern Void quotaGetStats(Quota *q, QuotaStats *stats);
+
+extern Void quotaDelete(Quota *q);
+
+#endif /* _QUOTA_H */
@@ -0,0 +1,395 @@
+/*
+ * recovery.c
+ *
+ * Repairs the recording cut short by a power cut or a crash. Only the
+ * newest recording can be affected, every file before it was closed, and
+ * synced if a durability policy is set, before the next one was opened.
+ * Its end may hold a partial frame, or zeros where the file size reached
+ * the card but the data didn't. Nothing is rewritten, the file is read
+ * from the end back to the last complete frame and truncated there:
+ *
+ * - raw H.264 loses its last NAL unit together with the SEI, parameter
+ *   sets and earlier slices of the same frame in front of it,
+ * - fragmented MP4 loses whatever follows its last complete mdat box,
+ * - the keyframe index loses its records past the end of the video.
+ *
+ * Spare files the storage thread prepared but never used are removed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include <xdc/std.h>
+
+#include <ti/sdo/dmai/Dmai.h>
+
+#include "recovery.h"
+#include "storage.h"
+#include "nal.h"
+
+#define MODULE_NAME     "Recovery"
+
+#define RECOVERY_PATH_LEN       128
+
+/* Bytes read at a time while looking for the last frame */
+#define RECOVERY_WINDOW         (64 * 1024)
+
+/* Gives up looking for a frame start this far from the end */
+#define RECOVERY_MAX_SCAN       (8 * 1024 * 1024)
+
+/* Bytes of a keyframe index record, see writer.c */
+#define RECOVERY_INDEX_RECORD   16
+
+/* The newest recording of a kind */
+typedef struct RecoveryFile {
+    Char    name[RECOVERY_PATH_LEN];
+    time_t  mtime;
+} RecoveryFile;
+
+/******************************************************************************
+ * makePath
+ ******************************************************************************/
+static Void makePath(Char *dirName, Char *name, Char *path)
+{
+    snprintf(path, RECOVERY_PATH_LEN, "%s/%s", dirName, name);
+}
+
+/******************************************************************************
+ * trimFile
+ ******************************************************************************/
+static Void trimFile(Int fd, Char *path, off_t size, off_t newSize)
+{
+    if (newSize >= size) {
+        return;
+    }
+
+    if (ftruncate(fd, newSize) == -1) {
+        Dmai_err2("Failed to trim %s (%d)\n", path, errno);
+        return;
+    }
+
+    fsync(fd);
+    printf("Recovered %s, %lld bytes cut from its end\n", path,
+           (long long) (size - newSize));
+}
+
+/******************************************************************************
+ * findAccessUnit
+ ******************************************************************************/
+static off_t findAccessUnit(Int fd, off_t size, UInt8 *buf)
+{
+    off_t   pos     = size;
+    off_t   cut     = size;
+    off_t   lo, hi;
+    Bool    partial = FALSE;
+    Bool    slice, first;
+    Int     q, type;
+
+    while (pos > 0 && size - pos < RECOVERY_MAX_SCAN) {
+        lo = pos > RECOVERY_WINDOW ? pos - RECOVERY_WINDOW : 0;
+        hi = pos + 5 < size ? pos + 5 : size;
+
+        if (pread(fd, buf, hi - lo, lo) != hi - lo) {
+            return -1;
+        }
+
+        /* The start code nearest to pos, including one across lo */
+        for (q = pos - lo - 1; q >= 0; q--) {
+            if (q + 2 < hi - lo &&
+                buf[q] == 0 && buf[q + 1] == 0 && buf[q + 2] == 1) {
+                break;
+            }
+        }
+
+        if (q < 0) {
+            pos = lo;
+            continue;
+        }
+
+        /* A NAL unit cut before its header is just dropped */
+        type  = q + 3 < hi - lo ? buf[q + 3] & 0x1f : 0;
+        slice = type >= NAL_TYPE_SLICE && type <= NAL_TYPE_IDR;
+        first = q + 4 < hi - lo ? (buf[q + 4] & 0x80) != 0 : FALSE;
+
+        pos = lo + q;
+        if (q > 0 && buf[q - 1] == 0) {
+            pos--;
+        }
+
+        /*
+         * The last NAL unit goes whatever it is. In front of it go the
+         * slices of the same frame, first_mb_in_slice 0 starting a frame,
+         * and what comes before a frame's first slice.
+         */
+        if (cut == size) {
+            partial = slice && !first;
+        }
+        else if (slice && partial) {
+            partial = !first;
+        }
+        else if (slice || type < NAL_TYPE_SEI || type > NAL_TYPE_AUD) {
+            return cut;
+        }
+
+        cut = pos;
+    }
+
+    /* Nothing but the start of the file before the last frame */
+    return pos == 0 ? cut : -1;
+}
+
+/******************************************************************************
+ * recoverH264
+ ******************************************************************************/
+static off_t recoverH264(Char *path, UInt8 *buf)
+{
+    struct stat st;
+    off_t       cut;
+    Int         fd;
+
+    fd = open(path, O_RDWR);
+
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        Dmai_err2("Failed to open %s for recovery (%d)\n", path, errno);
+        if (fd != -1) {
+            close(fd);
+        }
+        return -1;
+    }
+
+    cut = findAccessUnit(fd, st.st_size, buf);
+
+    if (cut < 0) {
+        Dmai_err1("No frame found at the end of %s, left alone\n", path);
+        cut = st.st_size;
+    }
+
+    trimFile(fd, path, st.st_size, cut);
+    close(fd);
+
+    return cut;
+}
+
+/******************************************************************************
+ * recoverMp4
+ ******************************************************************************/
+static Void recoverMp4(Char *path)
+{
+    struct stat st;
+    UInt8       hdr[16];
+    UInt64      boxSize;
+    off_t       off     = 0;
+    off_t       good    = 0;
+    Int         fd;
+
+    fd = open(path, O_RDWR);
+
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        Dmai_err2("Failed to open %s for recovery (%d)\n", path, errno);
+        if (fd != -1) {
+            close(fd);
+        }
+        return;
+    }
+
+    /* Walk the top level boxes, a moof only counts with its mdat */
+    while (off + 8 <= st.st_size &&
+           pread(fd, hdr, sizeof(hdr), off) >= 8) {
+        boxSize = (UInt64) hdr[0] << 24 | hdr[1] << 16 | hdr[2] << 8 | hdr[3];
+
+        if (boxSize == 1) {
+            if (off + 16 > st.st_size) {
+                break;
+            }
+            boxSize = (UInt64) hdr[8] << 56 | (UInt64) hdr[9] << 48 |
+                      (UInt64) hdr[10] << 40 | (UInt64) hdr[11] << 32 |
+                      (UInt64) hdr[12] << 24 | hdr[13] << 16 |
+                      hdr[14] << 8 | hdr[15];
+        }
+
+        /* Zeros or a box running past the end, the data never got there */
+        if (boxSize < 8 || boxSize > (UInt64) (st.st_size - off)) {
+            break;
+        }
+
+        off += boxSize;
+        if (memcmp(hdr + 4, "moof", 4) != 0) {
+            good = off;
+        }
+    }
+
+    trimFile(fd, path, st.st_size, good);
+    close(fd);
+}
+
+/******************************************************************************
+ * recoverIndex
+ ******************************************************************************/
+static Void recoverIndex(Char *path, off_t videoSize)
+{
+    struct stat st;
+    UInt64      offset;
+    off_t       end;
+    Int         fd;
+
+    fd = open(path, O_RDWR);
+
+    if (fd == -1) {
+        return;
+    }
+
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return;
+    }
+
+    /* Whole records pointing into what is left of the video */
+    end = st.st_size / RECOVERY_INDEX_RECORD * RECOVERY_INDEX_RECORD;
+
+    while (end > 0 &&
+           pread(fd, &offset, sizeof(offset), end - RECOVERY_INDEX_RECORD) ==
+           sizeof(offset) && offset >= (UInt64) videoSize) {
+        end -= RECOVERY_INDEX_RECORD;
+    }
+
+    trimFile(fd, path, st.st_size, end);
+    close(fd);
+}
+
+/******************************************************************************
+ * keepNewest
+ ******************************************************************************/
+static Void keepNewest(RecoveryFile *newest, Char *name, time_t mtime)
+{
+    if (newest->name[0] == '\0' || mtime > newest->mtime ||
+        (mtime == newest->mtime && strcmp(name, newest->name) > 0)) {
+        strncpy(newest->name, name, RECOVERY_PATH_LEN - 1);
+        newest->name[RECOVERY_PATH_LEN - 1] = '\0';
+        newest->mtime = mtime;
+    }
+}
+
+/******************************************************************************
+ * recoverDir
+ ******************************************************************************/
+static Void recoverDir(Char *dirName)
+{
+    Char            path[RECOVERY_PATH_LEN];
+    RecoveryFile    h264;
+    RecoveryFile    mp4;
+    DIR            *dirp;
+    struct dirent  *entry;
+    struct stat     st;
+    Char           *ext;
+    UInt8          *buf;
+    off_t           size;
+
+    dirp = opendir(dirName);
+
+    if (dirp == NULL) {
+        Dmai_err2("Failed to list %s (%d)\n", dirName, errno);
+        return;
+    }
+
+    memset(&h264, 0, sizeof(h264));
+    memset(&mp4, 0, sizeof(mp4));
+
+    while ((entry = readdir(dirp)) != NULL) {
+        makePath(dirName, entry->d_name, path);
+
+        if (stat(path, &st) == -1 || !S_ISREG(st.st_mode)) {
+            continue;
+        }
+
+        /* A spare only holds data if it was taken, then it has a name */
+        if (strncmp(entry->d_name, STORAGE_SPARE_NAME,
+                    strlen(STORAGE_SPARE_NAME)) == 0) {
+            if (st.st_size == 0) {
+                unlink(path);
+            }
+            continue;
+        }
+
+        ext = strrchr(entry->d_name, '.');
+
+        if (ext && strcmp(ext, ".264") == 0) {
+            keepNewest(&h264, entry->d_name, st.st_mtime);
+        }
+        else if (ext && strcmp(ext, ".mp4") == 0) {
+            keepNewest(&mp4, entry->d_name, st.st_mtime);
+        }
+    }
+
+    closedir(dirp);
+
+    if (h264.name[0] != '\0') {
+        buf = malloc(RECOVERY_WINDOW + 5);
+
+        if (buf == NULL) {
+            Dmai_err0("Failed to allocate recovery buffer\n");
+            return;
+        }
+
+        makePath(dirName, h264.name, path);
+        size = recoverH264(path, buf);
+        free(buf);
+
+        /* The index next to it under the same name */
+        if (size >= 0) {
+            strcpy(strrchr(path, '.'), ".idx");
+            recoverIndex(path, size);
+        }
+    }
+
+    if (mp4.name[0] != '\0') {
+        makePath(dirName, mp4.name, path);
+        recoverMp4(path);
+    }
+}
+
+/******************************************************************************
+ * recoveryStart
+ ******************************************************************************/
+Int recoveryStart(Char *dirName)
+{
+    Char    path[RECOVERY_PATH_LEN];
+    Int     fd;
+
+    makePath(dirName, RECOVERY_MARKER_NAME, path);
+
+    /* Still there, the last session never got to the end */
+    if (access(path, F_OK) == 0) {
+        Dmai_dbg1("%s was not closed cleanly, recovering\n", dirName);
+        recoverDir(dirName);
+    }
+
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+
+    if (fd == -1) {
+        Dmai_err2("Failed to create %s (%d)\n", path, errno);
+        return Dmai_EFAIL;
+    }
+
+    /* Has to be on the card before anything is recorded */
+    fsync(fd);
+    close(fd);
+
+    return Dmai_EOK;
+}
+
+/******************************************************************************
+ * recoveryEnd
+ ******************************************************************************/
+Void recoveryEnd(Char *dirName)
+{
+    Char    path[RECOVERY_PATH_LEN];
+
+    makePath(dirName, RECOVERY_MARKER_NAME, path);
+    unlink(path);
+}
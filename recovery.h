@@ -0,0 +1,27 @@
+/*
+ * recovery.h
+ *
+ * Repairs the recording cut short by a power cut or a crash. A marker file
+ * in the recording directory says a session is running, if it is still
+ * there when the next one starts the newest recording is trimmed back to
+ * its last complete frame.
+ */
+
+#ifndef _RECOVERY_H
+#define _RECOVERY_H
+
+#include <xdc/std.h>
+
+/* Name of the marker, in the recording directory */
+#define RECOVERY_MARKER_NAME    ".recording"
+
+/*
+ * A recording session in dirName starts. Repairs what the last session
+ * left behind if it didn't end cleanly, then leaves the marker.
+ */
+extern Int recoveryStart(Char *dirName);
+
+/* The session ended cleanly, everything in dirName is complete */
+extern Void recoveryEnd(Char *dirName);
+
+#endif /* _RECOVERY_H */
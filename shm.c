@@ -1,47 +1,103 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <limits.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <sys/ipc.h>
 #include <sys/sem.h>
 #include <sys/shm.h>
+#include <sys/mman.h>
 #include <errno.h>
 #include "shm.h"
+#include "barrier.h"
 
+#ifdef SHM_HOST
+/* Host builds (bench/) have no DMAI, log errors to stderr */
+#define Dmai_dbg0(fmt)
+#define Dmai_dbg1(fmt, a)
+#define Dmai_err0(fmt)          fprintf(stderr, MODULE_NAME ": " fmt)
+#define Dmai_err1(fmt, a)       fprintf(stderr, MODULE_NAME ": " fmt, a)
+#else
 #include <ti/sdo/dmai/Dmai.h>
-
-#define SEM_READ 0
-#define SEM_WRITE 1
+#endif
 
 #define MODULE_NAME   "Shm"
 
+/* Each frame is a SHM_FRAME, padded to SHM_ALIGN, followed by the payload */
+#define SLOT_HDR_SIZE   ((sizeof(SHM_FRAME) + SHM_ALIGN - 1) & ~(SHM_ALIGN - 1))
+
+#define alignOf(size)   (((size) + SHM_ALIGN - 1) & ~(SHM_ALIGN - 1))
+
+/* A writer that published nothing for this long stopped encoding */
+#define SHM_IDLE_US     1000000ULL
+
+union semun
+{
+    int val;
+    struct semid_ds *buf;
+    unsigned short *array;
+};
+
+/******************************************************************************
+ * slotPtr Function
+ ******************************************************************************/
+static char *slotPtr(SHM_ST *shmPtr, unsigned int seq)
+{
+    return shmPtr->shmCon +
+           shmPtr->hdr->index[seq % shmPtr->hdr->indexSize].offset;
+}
+
+/******************************************************************************
+ * shmTime Function
+ ******************************************************************************/
+static unsigned long long shmTime(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/******************************************************************************
+ * futex Function
+ ******************************************************************************/
+static int futex(volatile unsigned int *addr, int op, unsigned int val,
+                 const struct timespec *timeout)
+{
+    /* not FUTEX_PRIVATE, the word is shared between processes */
+    return syscall(SYS_futex, addr, op, val, timeout, 0, 0);
+}
+
 /******************************************************************************
  * P  V Functions
  ******************************************************************************/
-static int p(int semid, unsigned short semnum)
+static int p(int semid)
 {
-    int ret;
-    struct sembuf sops = {semnum, -1, IPC_NOWAIT};
-	//Dmai_dbg1("semid=%d\n",semid);
-    ret = semop(semid, &sops, 1);
-	if (ret == -1)
-	{
-		if (errno != EAGAIN)
+    /* SEM_UNDO releases the lock if a reader dies while registering */
+    struct sembuf sops = {0, -1, SEM_UNDO};
+
+    while(semop(semid, &sops, 1) == -1)
+    {
+        if(errno != EINTR)
             return -1;
-        else
-            return EAGAIN;
-	}
+    }
     return 0;
 }
 
-static void v(int semid, unsigned short semnum)
+static void v(int semid)
 {
-	int ret;
-    struct sembuf sops = {semnum, 1, 0};
-	//Dmai_dbg1("semid=%d\n",semid);
-    ret = semop(semid, &sops, 1);
-	if (ret < 0)
-	{
-		Dmai_err2("RET %d, error %d\n", ret, errno);
-	}
+    struct sembuf sops = {0, 1, SEM_UNDO};
+
+    if(semop(semid, &sops, 1) == -1)
+    {
+        Dmai_err1("semop error %d\n", errno);
+    }
 }
 
 /******************************************************************************
@@ -49,61 +105,216 @@ static void v(int semid, unsigned short semnum)
  ******************************************************************************/
 static int createSem(key_t key)
 {
-    int semid=0;
+    int semid;
     union semun arg;
 
-    /* create semaphore set, first for read, second for write */
-    if((semid = semget(key , 2, IPC_CREAT|IPC_EXCL|0666)) == -1)
+    /* one semaphore guarding the reader table */
+    if((semid = semget(key, 1, IPC_CREAT|0666)) == -1)
     {
-        if(errno == EEXIST)
-        {
-            errno = 0;
-            semid = semget(key , 2, IPC_CREAT|0666);
-            return semid;
-        }
-        else
-        {
-            Dmai_err0("semget semid failed!\n");
-            return semid;
-        }
+        Dmai_err0("semget semid failed!\n");
+        return -1;
     }
 
-    arg.val = 0;
-    if ((semctl(semid, SEM_READ, SETVAL, arg)) == -1)
+    arg.val = 1;
+    if(semctl(semid, 0, SETVAL, arg) == -1)
     {
         Dmai_err0("init semaphore error\n");
-        semctl(semid, SEM_READ, IPC_RMID);
+        semctl(semid, 0, IPC_RMID);
         return -1;
     }
-    arg.val = 1;
-    if ((semctl(semid, SEM_WRITE, SETVAL, arg)) == -1)
+
+    return semid;
+}
+
+/******************************************************************************
+ * mapShm Function
+ ******************************************************************************/
+static int mapShm(SHM_ST *shm_st)
+{
+    void *addr;
+
+    if((addr = shmat(shm_st->shmid, 0, 0)) == (void *)-1)
     {
-        Dmai_err0("init semaphore error\n");
-        semctl(semid, SEM_READ, IPC_RMID);
-        semctl(semid, SEM_WRITE, IPC_RMID);
+        Dmai_err0("attach shm error\n");
         return -1;
     }
 
-    return semid;
-    
+    shm_st->hdr = (SHM_HDR *)addr;
+    shm_st->shmCon = (char *)addr + ((sizeof(SHM_HDR) + SHM_ALIGN - 1) & ~(SHM_ALIGN - 1));
+
+    return 0;
+}
+
+/******************************************************************************
+ * mapData Function
+ ******************************************************************************/
+static int mapData(SHM_ST *shm_st)
+{
+    unsigned long phys = shm_st->hdr->dataPhys;
+    unsigned long pageOff = phys & (getpagesize() - 1);
+    int fd;
+
+    /* the data lives in the writer's contiguous buffer, map it by address */
+    if((fd = open(SHM_CMEM_DEV, O_RDONLY)) == -1)
+    {
+        Dmai_err1("open %s error\n", SHM_CMEM_DEV);
+        return -1;
+    }
+
+    shm_st->mapSize = pageOff + shmDataSize(shm_st->hdr->dataSize,
+                                            shm_st->hdr->gopSize);
+    shm_st->mapBase = mmap(0, shm_st->mapSize, PROT_READ, MAP_SHARED, fd,
+                           phys - pageOff);
+    close(fd);
+
+    if(shm_st->mapBase == MAP_FAILED)
+    {
+        Dmai_err0("map shm data error\n");
+        shm_st->mapBase = 0;
+        return -1;
+    }
+
+    shm_st->shmCon = (char *)shm_st->mapBase + pageOff;
+
+    return 0;
+}
+
+/******************************************************************************
+ * shmDataSize Function
+ ******************************************************************************/
+size_t shmDataSize(size_t shmSize, size_t gopSize)
+{
+    return alignOf(shmSize) + alignOf(gopSize);
 }
 
 /******************************************************************************
- * deleteSem Function
+ * dropCached Function
  ******************************************************************************/
-static void deleteSem(int semid)
+static void dropCached(SHM_HDR *hdr)
 {
-    if(semid == 0)
+    unsigned int end = hdr->gopFirst + hdr->gopFrames;
+    unsigned int from, i;
+    SHM_READER *r;
+
+    /* frames only the cache still held are lost to readers behind them */
+    if((int)(hdr->oldest - end) < 0)
+        end = hdr->oldest;
+
+    for(i = 0, r = hdr->readers; i < SHM_MAX_READERS; i++, r++)
+    {
+        if(r->pid == 0)
+            continue;
+
+        from = r->cursor;
+        if((int)(from - hdr->gopFirst) < 0)
+            from = hdr->gopFirst;
+        if((int)(end - from) > 0)
+            r->drops += end - from;
+    }
+}
+
+/******************************************************************************
+ * cacheFrame Function
+ ******************************************************************************/
+static void cacheFrame(SHM_ST *shmPtr, SHM_FRAME *slot)
+{
+    SHM_HDR *hdr = shmPtr->hdr;
+    unsigned int need = alignOf(SLOT_HDR_SIZE + slot->size);
+    unsigned int n;
+
+    if(hdr->gopSize == 0)
+        return;
+
+    /* a new GOP that decoders can start from, restart the cache */
+    if((slot->flags & (SHM_FLAG_KEY | SHM_FLAG_CONFIG)) ==
+       (SHM_FLAG_KEY | SHM_FLAG_CONFIG))
+    {
+        dropCached(hdr);
+        hdr->gopGen++;
+        memoryBarrier();
+        hdr->gopFirst = slot->seq;
+        hdr->gopFrames = 0;
+        hdr->gopUsed = 0;
+        memoryBarrier();
+        hdr->gopGen++;
+    }
+    else if(hdr->gopFrames == 0 || slot->seq != hdr->gopFirst + hdr->gopFrames)
+    {
+        return;
+    }
+
+    n = hdr->gopFrames;
+    if(n == SHM_GOP_MAX_FRAMES || hdr->gopUsed + need > hdr->gopSize)
+    {
+        /* the GOP outgrew the cache, wait for the next IDR */
+        dropCached(hdr);
+        hdr->gopGen++;
+        memoryBarrier();
+        hdr->gopFrames = 0;
+        hdr->gopUsed = 0;
+        hdr->gopOverflows++;
+        memoryBarrier();
+        hdr->gopGen++;
         return;
-    semctl(semid, 0, IPC_RMID);
+    }
+
+    memcpy(shmPtr->gopCon + hdr->gopUsed, slot, SLOT_HDR_SIZE + slot->size);
+    hdr->gopOffset[n] = hdr->gopUsed;
+    hdr->gopUsed += need;
+
+    memoryBarrier();
+    hdr->gopFrames = n + 1;
 }
 
 /******************************************************************************
- * createShm Function
+ * inGopCache Function
  ******************************************************************************/
-SHM_ST *createShm(const char* pathName, size_t shmSize)
+static int inGopCache(SHM_HDR *hdr, unsigned int seq)
+{
+    return !(hdr->gopGen & 1) && seq - hdr->gopFirst < hdr->gopFrames;
+}
+
+/******************************************************************************
+ * retireFrame Function
+ ******************************************************************************/
+static void retireFrame(SHM_HDR *hdr)
+{
+    unsigned int lost = hdr->oldest;
+    SHM_READER *r;
+    int missed = 0;
+    int i;
+
+    /*
+     * count before moving oldest, a reader seeing the new oldest may skip
+     * the frame right away. Frames still in the GOP cache are not lost.
+     */
+    if(!inGopCache(hdr, lost))
+    {
+        for(i = 0, r = hdr->readers; i < SHM_MAX_READERS; i++, r++)
+        {
+            if(r->pid != 0 && (int)(r->cursor - lost) <= 0)
+            {
+                r->drops++;
+                missed = 1;
+            }
+        }
+    }
+
+    if(missed)
+        hdr->overruns++;
+
+    memoryBarrier();
+    hdr->oldest = lost + 1;
+}
+
+/******************************************************************************
+ * createShmExt Function
+ ******************************************************************************/
+SHM_ST *createShmExt(const char* pathName, size_t shmSize, size_t gopSize,
+                     char *dataPtr, unsigned long dataPhys)
 {
     key_t key;
+    size_t segSize;
 
     /* malloc mm for SHM_ST  */
     SHM_ST *shm_st = (SHM_ST *)malloc(sizeof(SHM_ST));
@@ -113,9 +324,16 @@ SHM_ST *createShm(const char* pathName, size_t shmSize)
         return 0;
     }
     memset(shm_st, 0, sizeof(SHM_ST));
-    shm_st->shmSize = shmSize;
+    shm_st->shmid = -1;
+    shm_st->semid = -1;
+    shm_st->owner = 1;
+    shm_st->readerId = -1;
+    shm_st->dataSize = alignOf(shmSize);
+    segSize = (sizeof(SHM_HDR) + SHM_ALIGN - 1) & ~(SHM_ALIGN - 1);
+    if(dataPtr == 0)
+        segSize += shmDataSize(shmSize, gopSize);
 
-    /* create semaphore for sh mm */
+    /* create semaphore for the reader table */
     key = ftok(pathName, 0);
     if((shm_st->semid = createSem(key)) == -1)
     {
@@ -124,33 +342,118 @@ SHM_ST *createShm(const char* pathName, size_t shmSize)
     }
 
     /* create shm */
-    if((shm_st->shmid = shmget(key, shmSize+(sizeof(unsigned int)), IPC_CREAT|0666)) == -1)
+    if((shm_st->shmid = shmget(key, segSize, IPC_CREAT|0666)) == -1
+        && errno == EINVAL)
     {
-        Dmai_err0("create shm error\n");
-        goto create_failed;
+        /* A segment left behind with another size, replace it */
+        if((shm_st->shmid = shmget(key, 0, 0666)) != -1)
+            shmctl(shm_st->shmid, IPC_RMID, 0);
+        shm_st->shmid = shmget(key, segSize, IPC_CREAT|0666);
     }
 
-    if((int)(shm_st->realSize= (unsigned int *)shmat(shm_st->shmid,0,0)) == -1)
+    if(shm_st->shmid == -1)
     {
-        Dmai_err0("attach shm error\n");
+        Dmai_err0("create shm error\n");
         goto create_failed;
     }
 
-    shm_st->shmCon = shm_st->realSize+1;
-    shm_st->shmPoint = 0;
+    if(mapShm(shm_st) == -1)
+        goto create_failed;
+
+    if(dataPtr != 0)
+        shm_st->shmCon = dataPtr;
+    shm_st->gopCon = shm_st->shmCon + shm_st->dataSize;
+
+    shm_st->hdr->indexSize = SHM_INDEX_SIZE;
+    shm_st->hdr->dataSize = shm_st->dataSize;
+    shm_st->hdr->dataPhys = dataPtr ? dataPhys : 0;
+    shm_st->hdr->head = 0;
+    shm_st->hdr->oldest = 0;
+    shm_st->hdr->overruns = 0;
+    shm_st->hdr->rejects = 0;
+    shm_st->hdr->wakeups = 0;
+    shm_st->hdr->gopSize = alignOf(gopSize);
+    shm_st->hdr->gopGen = 0;
+    shm_st->hdr->gopFirst = 0;
+    shm_st->hdr->gopFrames = 0;
+    shm_st->hdr->gopUsed = 0;
+    shm_st->hdr->gopOverflows = 0;
+    memset(shm_st->hdr->index, 0, sizeof(shm_st->hdr->index));
+    memset(shm_st->hdr->readers, 0, sizeof(shm_st->hdr->readers));
+    memoryBarrier();
+    shm_st->hdr->magic = SHM_MAGIC;
 
     return shm_st;
-    
+
 create_failed:
-    if (shm_st->shmid != 0)
+    if (shm_st->shmid != -1)
         shmctl(shm_st->shmid, IPC_RMID, 0);
 
-    if (shm_st->semid != 0)
-        deleteSem(shm_st->semid);
+    if (shm_st->semid != -1)
+        semctl(shm_st->semid, 0, IPC_RMID);
+
+    free(shm_st);
+
+    return 0;
+}
+
+/******************************************************************************
+ * createShm Function
+ ******************************************************************************/
+SHM_ST *createShm(const char* pathName, size_t shmSize, size_t gopSize)
+{
+    return createShmExt(pathName, shmSize, gopSize, 0, 0);
+}
+
+/******************************************************************************
+ * attachShm Function
+ ******************************************************************************/
+SHM_ST *attachShm(const char* pathName)
+{
+    key_t key;
+
+    SHM_ST *shm_st = (SHM_ST *)malloc(sizeof(SHM_ST));
+    if(shm_st == 0)
+    {
+        Dmai_err0("Malloc SHM_ST failed!\n");
+        return 0;
+    }
+    memset(shm_st, 0, sizeof(SHM_ST));
+    shm_st->readerId = -1;
+
+    /* the writer creates the segment, readers only attach to it */
+    key = ftok(pathName, 0);
+    if((shm_st->semid = semget(key, 1, 0666)) == -1 ||
+       (shm_st->shmid = shmget(key, 0, 0666)) == -1)
+    {
+        Dmai_err0("get shm error\n");
+        goto attach_failed;
+    }
+
+    if(mapShm(shm_st) == -1)
+        goto attach_failed;
+
+    if(shm_st->hdr->magic != SHM_MAGIC)
+    {
+        Dmai_err0("shm is not initialized\n");
+        shmdt(shm_st->hdr);
+        goto attach_failed;
+    }
+
+    shm_st->dataSize = shm_st->hdr->dataSize;
+
+    if(shm_st->hdr->dataPhys != 0 && mapData(shm_st) == -1)
+    {
+        shmdt(shm_st->hdr);
+        goto attach_failed;
+    }
+    shm_st->gopCon = shm_st->shmCon + shm_st->dataSize;
+
+    return shm_st;
+
+attach_failed:
+    free(shm_st);
 
-    if (shm_st != 0)
-        free(shm_st);
-    
     return 0;
 }
 
@@ -161,50 +464,606 @@ void deleteShm(SHM_ST *shmPtr)
 {
     if(shmPtr == 0)
         return;
-    shmdt(shmPtr->realSize);
-    shmctl(shmPtr->shmid, 0, IPC_RMID);
-    deleteSem(shmPtr->semid);
+    unregisterShmReader(shmPtr);
+    if(shmPtr->mapBase)
+        munmap(shmPtr->mapBase, shmPtr->mapSize);
+    shmdt(shmPtr->hdr);
+    if(shmPtr->owner)
+    {
+        shmctl(shmPtr->shmid, IPC_RMID, 0);
+        semctl(shmPtr->semid, 0, IPC_RMID);
+    }
     free(shmPtr);
 }
 
+/******************************************************************************
+ * writerIdle Function
+ ******************************************************************************/
+static int writerIdle(SHM_ST *shmPtr)
+{
+    SHM_HDR *hdr = shmPtr->hdr;
+    unsigned int last = hdr->head - 1;
+    SHM_FRAME *slot;
+
+    if(hdr->head == 0 || (int)(last - hdr->oldest) < 0)
+        return 0;
+
+    slot = (SHM_FRAME *)slotPtr(shmPtr, last);
+
+    return slot->seq == last && shmTime() - slot->publishTime > SHM_IDLE_US;
+}
+
+/******************************************************************************
+ * registerShmReader Function
+ ******************************************************************************/
+int registerShmReader(SHM_ST *shmPtr)
+{
+    SHM_HDR *hdr = shmPtr->hdr;
+    SHM_READER *r;
+    int i;
+
+    if(shmPtr->readerId != -1)
+        return 0;
+
+    if(p(shmPtr->semid) == -1)
+    {
+        Dmai_err0("Failed to lock reader table\n");
+        return -1;
+    }
+
+    for(i = 0; i < SHM_MAX_READERS; i++)
+    {
+        r = &hdr->readers[i];
+
+        /* take a free entry or one left behind by a dead reader */
+        if(r->pid == 0 || (kill(r->pid, 0) == -1 && errno == ESRCH))
+        {
+            r->frames = 0;
+            r->drops = 0;
+            r->lag = 0;
+            r->waiting = 0;
+            r->waits = 0;
+            /*
+             * start at the cached GOP so decoding can begin at once, unless
+             * the writer went idle: then it is from before that and the
+             * writer starts over with an IDR when it sees the reader
+             */
+            r->cursor = hdr->gopFrames && !writerIdle(shmPtr) ?
+                        hdr->gopFirst : hdr->head;
+            memoryBarrier();
+            r->pid = getpid();
+            shmPtr->readerId = i;
+            break;
+        }
+    }
+
+    v(shmPtr->semid);
+
+    if(shmPtr->readerId == -1)
+    {
+        Dmai_err0("No free reader entry\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+/******************************************************************************
+ * unregisterShmReader Function
+ ******************************************************************************/
+void unregisterShmReader(SHM_ST *shmPtr)
+{
+    if(shmPtr->readerId == -1)
+        return;
+
+    shmPtr->hdr->readers[shmPtr->readerId].pid = 0;
+    shmPtr->readerId = -1;
+}
+
+/******************************************************************************
+ * countShmReaders Function
+ ******************************************************************************/
+int countShmReaders(SHM_ST *shmPtr)
+{
+    SHM_READER *r = shmPtr->hdr->readers;
+    int n = 0;
+    int i;
+
+    /* a reader that died without unregistering doesn't count */
+    for(i = 0; i < SHM_MAX_READERS; i++, r++)
+    {
+        if(r->pid != 0 && (kill(r->pid, 0) == 0 || errno != ESRCH))
+            n++;
+    }
+
+    return n;
+}
+
+/******************************************************************************
+ * fitSlot Function
+ ******************************************************************************/
+static void fitSlot(SHM_ST *shmPtr, unsigned int *off, unsigned int *pos,
+                    unsigned int need)
+{
+    /* frames never wrap, skip the rest of the ring if it is too short */
+    if(*off + need > shmPtr->dataSize)
+    {
+        *pos += shmPtr->dataSize - *off;
+        *off = 0;
+    }
+}
+
+/******************************************************************************
+ * leaseShm Function
+ ******************************************************************************/
+char *leaseShm(SHM_ST *shmPtr, unsigned int size)
+{
+    SHM_HDR *hdr = shmPtr->hdr;
+    unsigned int need = alignOf(SLOT_HDR_SIZE + size);
+    unsigned int off = shmPtr->endOff;
+    unsigned int pos = shmPtr->endPos;
+    unsigned int end, n, i;
+    int moved;
+
+    if(shmPtr->leased == SHM_MAX_LEASES)
+    {
+        Dmai_err0("leaseShm: too many slots leased\n");
+        return 0;
+    }
+
+    if(need > shmPtr->dataSize)
+    {
+        Dmai_err1("leaseShm: %u bytes don't fit in the ring\n", size);
+        hdr->rejects++;
+        return 0;
+    }
+
+    /*
+     * the frames of the slots already leased are moved down behind the
+     * last frame published, keep room for them at their worst case
+     */
+    for(i = 0; i < shmPtr->leased; i++)
+    {
+        n = (shmPtr->leaseFirst + i) % SHM_MAX_LEASES;
+        fitSlot(shmPtr, &off, &pos, shmPtr->leaseLen[n]);
+        off += shmPtr->leaseLen[n];
+        pos += shmPtr->leaseLen[n];
+    }
+    fitSlot(shmPtr, &off, &pos, need);
+
+    /* then take the first gap between the leased slots the new one fits */
+    do
+    {
+        moved = 0;
+        for(i = 0; i < shmPtr->leased; i++)
+        {
+            n = (shmPtr->leaseFirst + i) % SHM_MAX_LEASES;
+            if(pos < shmPtr->leasePos[n] + shmPtr->leaseLen[n] &&
+               shmPtr->leasePos[n] < pos + need)
+            {
+                off = shmPtr->leaseOff[n] + shmPtr->leaseLen[n];
+                pos = shmPtr->leasePos[n] + shmPtr->leaseLen[n];
+                fitSlot(shmPtr, &off, &pos, need);
+                moved = 1;
+            }
+        }
+    } while(moved);
+    end = pos + need;
+
+    /* no leased slot may be handed out twice */
+    if(end - shmPtr->endPos > shmPtr->dataSize)
+    {
+        Dmai_err0("leaseShm: ring too small for the slots leased\n");
+        return 0;
+    }
+
+    /* retire every frame the new slot overwrites */
+    while(hdr->oldest != hdr->head &&
+          end - hdr->index[hdr->oldest % hdr->indexSize].pos >
+          shmPtr->dataSize)
+        retireFrame(hdr);
+
+    n = (shmPtr->leaseFirst + shmPtr->leased) % SHM_MAX_LEASES;
+    shmPtr->leaseOff[n] = off;
+    shmPtr->leasePos[n] = pos;
+    shmPtr->leaseLen[n] = need;
+    shmPtr->leased++;
+    memoryBarrier();
+
+    return shmPtr->shmCon + off + SLOT_HDR_SIZE;
+}
+
+/******************************************************************************
+ * commitShm Function
+ ******************************************************************************/
+unsigned int commitShm(SHM_ST *shmPtr, SHM_FRAME *frame)
+{
+    SHM_HDR *hdr = shmPtr->hdr;
+    unsigned int head = hdr->head;
+    unsigned int n = shmPtr->leaseFirst;
+    unsigned int used, off, pos, i;
+    SHM_INDEX *idx;
+    SHM_FRAME *slot;
+    SHM_READER *r;
+    int waiting = 0;
+
+    if(shmPtr->leased == 0)
+    {
+        Dmai_err0("commitShm: no slot leased\n");
+        return 0;
+    }
+
+    /* leases are published in the order they were taken */
+    shmPtr->leaseFirst = (n + 1) % SHM_MAX_LEASES;
+    shmPtr->leased--;
+    used = alignOf(SLOT_HDR_SIZE + frame->size);
+
+    /* a truncated frame would only corrupt the stream, drop it */
+    if(used > shmPtr->leaseLen[n])
+    {
+        Dmai_err1("commitShm: %u byte frame overran its slot\n", frame->size);
+        hdr->rejects++;
+        return 0;
+    }
+
+    /*
+     * publish the frame right behind the one before, moving it down over
+     * the unused end of that frame's slot. A lone slot past the end of
+     * the ring stays where it is, nothing else could use that end.
+     */
+    off = shmPtr->endOff;
+    pos = shmPtr->endPos;
+    fitSlot(shmPtr, &off, &pos, used);
+    if(shmPtr->leased == 0 && off > shmPtr->leaseOff[n])
+    {
+        off = shmPtr->leaseOff[n];
+        pos = shmPtr->leasePos[n];
+    }
+
+    /* the index entry still describes frame head - indexSize */
+    while((int)(head - hdr->oldest) >= (int)hdr->indexSize)
+        retireFrame(hdr);
+    memoryBarrier();
+
+    if(off != shmPtr->leaseOff[n])
+        memmove(shmPtr->shmCon + off + SLOT_HDR_SIZE,
+                shmPtr->shmCon + shmPtr->leaseOff[n] + SLOT_HDR_SIZE,
+                frame->size);
+    shmPtr->endOff = off + used;
+    shmPtr->endPos = pos + used;
+
+    slot = (SHM_FRAME *)(shmPtr->shmCon + off);
+    *slot = *frame;
+    slot->version = SHM_FRAME_VERSION;
+    slot->hdrSize = sizeof(SHM_FRAME);
+    slot->seq = head;
+    slot->publishTime = shmTime();
+
+    idx = &hdr->index[head % hdr->indexSize];
+    idx->seq = head;
+    idx->offset = off;
+    idx->size = frame->size;
+    idx->pos = pos;
+
+    memoryBarrier();
+    hdr->head = head + 1;
+    Dmai_dbg0("commitShm: publish 1 frame\n");
+
+    cacheFrame(shmPtr, slot);
+
+    /* update reader statistics */
+    for(i = 0, r = hdr->readers; i < SHM_MAX_READERS; i++, r++)
+    {
+        if(r->pid == 0)
+            continue;
+
+        r->lag = head + 1 - r->cursor;
+        waiting |= r->waiting;
+    }
+
+    /* only pay for the syscall when some reader sleeps in waitShm() */
+    if(waiting)
+    {
+        futex(&hdr->head, FUTEX_WAKE, INT_MAX, 0);
+        hdr->wakeups++;
+    }
+
+    return slot->size;
+}
+
 /******************************************************************************
  * writeShm Function
  ******************************************************************************/
-unsigned int writeShm(SHM_ST *shmPtr, char *datPtr, unsigned int datSize)
+unsigned int writeShm(SHM_ST *shmPtr, char *datPtr, SHM_FRAME *frame)
+{
+    char *slot;
+
+    if((slot = leaseShm(shmPtr, frame->size)) == 0)
+        return 0;
+
+    memcpy(slot, datPtr, frame->size);
+
+    return commitShm(shmPtr, frame);
+}
+
+/******************************************************************************
+ * peekShm Function
+ ******************************************************************************/
+char *peekShm(SHM_ST *shmPtr, SHM_FRAME *frame)
+{
+    SHM_HDR *hdr = shmPtr->hdr;
+    SHM_READER *r;
+    unsigned int cursor, oldest;
+    unsigned int gen;
+    char *slot;
+
+    if(shmPtr->readerId == -1)
+    {
+        Dmai_err0("peekShm: reader not registered\n");
+        return 0;
+    }
+
+    r = &hdr->readers[shmPtr->readerId];
+    cursor = r->cursor;
+
+    while(cursor != hdr->head)
+    {
+        memoryBarrier();
+        oldest = hdr->oldest;
+
+        if((int)(cursor - oldest) >= 0)
+        {
+            slot = slotPtr(shmPtr, cursor);
+            *frame = *(SHM_FRAME *)slot;
+
+            /* the writer may have reused the space while we looked */
+            memoryBarrier();
+            if((int)(cursor - hdr->oldest) >= 0 && frame->seq == cursor)
+            {
+                shmPtr->peekSeq = cursor;
+                shmPtr->peekGen = 0;
+                shmPtr->peekCached = 0;
+                r->cursor = cursor;
+                return slot + SLOT_HDR_SIZE;
+            }
+        }
+
+        /* behind the ring, the frame may still be in the GOP cache */
+        gen = hdr->gopGen;
+        memoryBarrier();
+        if(!(gen & 1) && cursor - hdr->gopFirst < hdr->gopFrames)
+        {
+            slot = shmPtr->gopCon + hdr->gopOffset[cursor - hdr->gopFirst];
+            *frame = *(SHM_FRAME *)slot;
+
+            memoryBarrier();
+            if(hdr->gopGen == gen && frame->seq == cursor)
+            {
+                shmPtr->peekSeq = cursor;
+                shmPtr->peekGen = gen;
+                shmPtr->peekCached = 1;
+                r->cursor = cursor;
+                return slot + SLOT_HDR_SIZE;
+            }
+        }
+
+        /*
+         * it is gone and the writer counted the drops. Frames the ring lost
+         * but the cache kept were not counted, so resume at the cached IDR
+         * rather than skip them. Frames retired after oldest was read may
+         * have been cached since, so don't skip past it.
+         */
+        gen = hdr->gopGen;
+        memoryBarrier();
+        if(!(gen & 1) && hdr->gopFrames != 0 &&
+           (int)(cursor - hdr->gopFirst) < 0 &&
+           (int)(hdr->gopFirst - oldest) < 0)
+            cursor = hdr->gopFirst;
+        else
+            cursor = oldest;
+    }
+
+    r->cursor = cursor;
+
+    return 0;
+}
+
+/******************************************************************************
+ * releaseShm Function
+ ******************************************************************************/
+int releaseShm(SHM_ST *shmPtr)
 {
-    int ret;
-    /* get the semaphore */
-    ret = p(shmPtr->semid, SEM_WRITE);
-    
-    if(ret == 0)
+    SHM_HDR *hdr = shmPtr->hdr;
+    SHM_READER *r;
+    int intact;
+
+    if(shmPtr->readerId == -1)
+        return -1;
+
+    r = &hdr->readers[shmPtr->readerId];
+
+    /* check the writer didn't reuse the frame while the caller held it */
+    memoryBarrier();
+    if(shmPtr->peekCached)
+        intact = hdr->gopGen == shmPtr->peekGen;
+    else
+        intact = (int)(shmPtr->peekSeq - hdr->oldest) >= 0;
+
+    if(!intact)
+        return -1;
+
+    r->cursor = shmPtr->peekSeq + 1;
+    r->frames++;
+
+    return 0;
+}
+
+/******************************************************************************
+ * readShm Function
+ ******************************************************************************/
+int readShm(SHM_ST *shmPtr, char *datPtr, unsigned int size,
+            SHM_FRAME *frame)
+{
+    SHM_FRAME slotHdr;
+    char *slot;
+
+    while((slot = peekShm(shmPtr, &slotHdr)) != 0)
     {
-      /* write shm */
-      if(datSize < shmPtr->shmSize)
-      {
-         memcpy(shmPtr->shmCon, datPtr, datSize);
-         *shmPtr->realSize = datSize;
-      }
-      else
-      {
-         memcpy(shmPtr->shmCon, datPtr, shmPtr->shmSize);
-         *shmPtr->realSize = shmPtr->shmSize;
-      }
-  
-      /* release semaphore */
-      v(shmPtr->semid, SEM_READ);
-      Dmai_dbg0("writeShm: write 1 frame\n");
-    
-      return (*shmPtr->realSize);
+        /* a cut frame is no use to a decoder, leave it and say its size */
+        if(slotHdr.size > size)
+        {
+            if(frame)
+                *frame = slotHdr;
+            return -1;
+        }
+
+        memcpy(datPtr, slot, slotHdr.size);
+
+        if(releaseShm(shmPtr) == 0)
+        {
+            if(frame)
+                *frame = slotHdr;
+            return slotHdr.size;
+        }
     }
-    else if(ret == EAGAIN) 
+
+    return 0;
+}
+
+/******************************************************************************
+ * readShmBatch Function
+ ******************************************************************************/
+int readShmBatch(SHM_ST *shmPtr, char *datPtr, unsigned int size)
+{
+    SHM_FRAME slotHdr;
+    SHM_FRAME *rec;
+    unsigned int used = 0;
+    unsigned int recSize;
+    int frames = 0;
+    char *slot;
+
+    while(size - used > sizeof(SHM_FRAME) &&
+          (slot = peekShm(shmPtr, &slotHdr)) != 0)
     {
-      Dmai_dbg0("Can't get semaphore right now\n");
-      return 0;
+        rec = (SHM_FRAME *)(datPtr + used);
+        recSize = SHM_BATCH_SIZE(slotHdr.size);
+
+        if(used + recSize > size)
+        {
+            /*
+             * leave it for the next call. If nothing fit at all, hand back
+             * its header so the caller can size the buffer for it
+             */
+            if(frames > 0)
+                break;
+            *rec = slotHdr;
+            return -1;
+        }
+
+        memcpy((char *)(rec + 1), slot, slotHdr.size);
+
+        if(releaseShm(shmPtr) == 0)
+        {
+            *rec = slotHdr;
+            used += recSize;
+            frames++;
+        }
     }
-    else 
+
+    return frames;
+}
+
+/******************************************************************************
+ * waitShm Function
+ ******************************************************************************/
+int waitShm(SHM_ST *shmPtr, int timeoutMs)
+{
+    SHM_HDR *hdr = shmPtr->hdr;
+    SHM_READER *r;
+    unsigned long long deadline = 0, now;
+    struct timespec ts;
+    unsigned int head;
+    int ret = 0;
+
+    if(shmPtr->readerId == -1)
+        return -1;
+
+    r = &hdr->readers[shmPtr->readerId];
+    if(timeoutMs > 0)
+        deadline = shmTime() + (unsigned long long)timeoutMs * 1000;
+
+    while((head = hdr->head) == r->cursor)
     {
-      Dmai_err0("Failed to get semaphore\n");
-      return -1;
+        if(timeoutMs == 0)
+            return 0;
+
+        if(timeoutMs > 0)
+        {
+            if((now = shmTime()) >= deadline)
+                return 0;
+            ts.tv_sec = (deadline - now) / 1000000;
+            ts.tv_nsec = (deadline - now) % 1000000 * 1000;
+        }
+
+        /* announce ourselves before the last look so no wakeup is missed */
+        r->waiting = 1;
+        memoryBarrier();
+        if(hdr->head == head)
+        {
+            r->waits++;
+            ret = futex(&hdr->head, FUTEX_WAIT, head,
+                        timeoutMs > 0 ? &ts : 0);
+        }
+        r->waiting = 0;
+
+        if(ret == -1 && errno != ETIMEDOUT && errno != EAGAIN &&
+           errno != EINTR)
+        {
+            Dmai_err1("waitShm: futex error %d\n", errno);
+            return -1;
+        }
     }
+
+    return 1;
 }
 
+/******************************************************************************
+ * seekShmKey Function
+ ******************************************************************************/
+int seekShmKey(SHM_ST *shmPtr)
+{
+    SHM_HDR *hdr = shmPtr->hdr;
+    unsigned int head = hdr->head;
+    unsigned int seq;
+    SHM_FRAME *slot;
+
+    if(shmPtr->readerId == -1)
+        return -1;
+
+    memoryBarrier();
+
+    /* walk back from the newest frame, only the headers are read */
+    for(seq = head; (int)(seq - hdr->oldest) > 0; )
+    {
+        seq--;
+        slot = (SHM_FRAME *)slotPtr(shmPtr, seq);
+        if(slot->seq == seq && (slot->flags & SHM_FLAG_KEY))
+        {
+            memoryBarrier();
+            if((int)(seq - hdr->oldest) < 0)
+                break;
+
+            hdr->readers[shmPtr->readerId].cursor = seq;
+            return 0;
+        }
+    }
+
+    /* the last IDR already left the ring, replay it from the GOP cache */
+    if(inGopCache(hdr, hdr->gopFirst))
+    {
+        hdr->readers[shmPtr->readerId].cursor = hdr->gopFirst;
+        return 0;
+    }
+
+    return -1;
+}
@@ -1,6 +1,6 @@
 /**************************
  *  File name: shm.h
- *  Descraption: 
+ *  Descraption:
  *      used to share memory between app
  *
  *  Created by zcy
@@ -14,34 +14,184 @@
  *  Headers
  **************************/
 
+/**************************
+ *  Macros
+ **************************/
+/* Identifies an initialized segment ("SHMR") */
+#define SHM_MAGIC       0x53484d52
+
+/* Frames the index can describe, many small P-frames fit in the data ring */
+#define SHM_INDEX_SIZE  256
+
+/*
+ * Slots the writer can have leased at the same time. A frame leased behind
+ * others is moved down to the end of the frame before it when published.
+ */
+#define SHM_MAX_LEASES  4
+
+/* Number of readers that can be registered at the same time */
+#define SHM_MAX_READERS 8
+
+/* Most frames the GOP cache indexes */
+#define SHM_GOP_MAX_FRAMES  128
+
+/* Frames start on a cache line so codecs can write into them */
+#define SHM_ALIGN       32
+
+/* Version of SHM_FRAME, bumped whenever its layout changes */
+#define SHM_FRAME_VERSION   1
+
+/* SHM_FRAME flags */
+#define SHM_FLAG_KEY        0x1         /* IDR frame */
+#define SHM_FLAG_CONFIG     0x2         /* carries SPS/PPS */
+
+/* Where readers map a ring kept in contiguous (CMEM) memory */
+#define SHM_CMEM_DEV    "/dev/cmem"
+
+/* Bytes a frame of size bytes takes in a readShmBatch() buffer */
+#define SHM_BATCH_SIZE(size)    ((sizeof(SHM_FRAME) + (size) + 7) & ~7)
+
+/* Next record in a readShmBatch() buffer */
+#define SHM_BATCH_NEXT(rec) \
+    ((SHM_FRAME *)((char *)(rec) + SHM_BATCH_SIZE((rec)->size)))
+
 /**************************
  *  Structs
  **************************/
+/*
+ * Fixed-size header in front of every frame. Times are CLOCK_MONOTONIC
+ * microseconds, so readers on the same box can compare them with their
+ * own clock to measure latency.
+ */
+typedef struct
+{
+    unsigned short version;             /* SHM_FRAME_VERSION */
+    unsigned short hdrSize;             /* sizeof(SHM_FRAME) of that version */
+    unsigned int size;                  /* payload bytes */
+    unsigned int seq;                   /* publish sequence number */
+    unsigned int streamId;
+    unsigned int flags;                 /* SHM_FLAG_* */
+    unsigned int reserved;
+    unsigned long long captureTime;
+    unsigned long long publishTime;
+} SHM_FRAME;
+
+/*
+ * Where a published frame lives in the data ring. pos is the writer's
+ * running byte count at the frame, it tells which frames a new lease
+ * overwrites.
+ */
+typedef struct
+{
+    volatile unsigned int seq;
+    volatile unsigned int offset;       /* of the SHM_FRAME in the data ring */
+    volatile unsigned int size;         /* payload bytes */
+    volatile unsigned int pos;
+} SHM_INDEX;
+
+/*
+ * Per reader state. cursor and frames are only written by the reader,
+ * drops and lag only by the writer.
+ */
+typedef struct
+{
+    volatile int pid;                   /* 0 if the entry is free */
+    volatile unsigned int cursor;       /* next frame to read */
+    volatile unsigned int frames;       /* frames read */
+    volatile unsigned int drops;        /* frames overwritten unread */
+    volatile unsigned int lag;          /* frames behind at the last publish */
+    volatile int waiting;               /* sleeping in waitShm() */
+    volatile unsigned int waits;        /* futex waits, reader */
+} SHM_READER;
+
+/*
+ * Header at the start of the segment. Frames are packed back to back in a
+ * data ring of dataSize bytes, each taking only the space it needs, and
+ * the index says where frame seq lives. A frame never wraps: if it doesn't
+ * fit before the end of the ring it starts over at offset 0.
+ *
+ * The writer never waits for readers: it retires the oldest frames that a
+ * new lease or index entry overwrites and each reader notices from oldest
+ * that it fell behind. Only registering a reader takes a lock.
+ *
+ * After the data ring comes a GOP cache of gopSize bytes with a
+ * copy of every frame since the last IDR that came with SPS/PPS, so a new
+ * reader can start decoding right away. gopGen is odd while the writer
+ * restarts the cache at a new IDR.
+ */
+typedef struct
+{
+    unsigned int magic;
+    unsigned int indexSize;
+    unsigned int dataSize;              /* bytes of the data ring */
+    unsigned long dataPhys;             /* 0 if the data follows the header */
+    volatile unsigned int head;         /* frames published */
+    volatile unsigned int oldest;       /* oldest frame still in the ring */
+    volatile unsigned int overruns;     /* frames some reader never got */
+    volatile unsigned int rejects;      /* frames too large to publish */
+    volatile unsigned int wakeups;      /* futex wakes issued by the writer */
+    unsigned int gopSize;               /* bytes set aside for the GOP cache */
+    volatile unsigned int gopGen;
+    volatile unsigned int gopFirst;     /* seq of the cached IDR */
+    volatile unsigned int gopFrames;    /* frames cached, 0 if none */
+    volatile unsigned int gopUsed;      /* bytes of the cache in use */
+    volatile unsigned int gopOverflows; /* GOPs that didn't fit */
+    unsigned int gopOffset[SHM_GOP_MAX_FRAMES];
+    SHM_INDEX index[SHM_INDEX_SIZE];
+    SHM_READER readers[SHM_MAX_READERS];
+} SHM_HDR;
+
 typedef struct
 {
     int shmid;
     int semid;
-    unsigned int shmSize;
-    unsigned int *realSize;
-    unsigned int shmPoint;
-    unsigned int *shmCon;
+    int owner;
+    int readerId;
+    unsigned int dataSize;
+    unsigned int endOff;                /* end of the last frame published */
+    unsigned int endPos;
+    unsigned int leased;
+    unsigned int leaseFirst;
+    unsigned int leaseOff[SHM_MAX_LEASES];
+    unsigned int leasePos[SHM_MAX_LEASES];
+    unsigned int leaseLen[SHM_MAX_LEASES];
+    unsigned int peekSeq;
+    unsigned int peekGen;
+    int peekCached;
+    SHM_HDR *hdr;
+    char *shmCon;
+    char *gopCon;
+    void *mapBase;
+    size_t mapSize;
 } SHM_ST;
 
-union semun
-{
-    int val;
-    struct semid_ds *buf;
-    unsigned short *array;
-};
-
 /**************************
  *  Functions
  **************************/
 
-SHM_ST *createShm(const char* pathName, size_t shmSize);
+SHM_ST *createShm(const char* pathName, size_t shmSize, size_t gopSize);
+SHM_ST *createShmExt(const char* pathName, size_t shmSize, size_t gopSize,
+                     char *dataPtr, unsigned long dataPhys);
+size_t shmDataSize(size_t shmSize, size_t gopSize);
+SHM_ST *attachShm(const char* pathName);
 void deleteShm(SHM_ST *shmPtr);
-unsigned int writeShm(SHM_ST *shmPtr, char *datPtr, unsigned int datSize);
-unsigned int readShm(SHM_ST *shmPtr, char *datPtr, unsigned int size);
+int registerShmReader(SHM_ST *shmPtr);
+void unregisterShmReader(SHM_ST *shmPtr);
+int countShmReaders(SHM_ST *shmPtr);
+unsigned int writeShm(SHM_ST *shmPtr, char *datPtr, SHM_FRAME *frame);
+char *leaseShm(SHM_ST *shmPtr, unsigned int size);
+unsigned int commitShm(SHM_ST *shmPtr, SHM_FRAME *frame);
+/*
+ * A frame larger than the buffer is left unread and -1 returned, with its
+ * header in frame or at the start of the batch buffer to tell the size.
+ */
+int readShm(SHM_ST *shmPtr, char *datPtr, unsigned int size,
+            SHM_FRAME *frame);
+int readShmBatch(SHM_ST *shmPtr, char *datPtr, unsigned int size);
+char *peekShm(SHM_ST *shmPtr, SHM_FRAME *frame);
+int releaseShm(SHM_ST *shmPtr);
+int waitShm(SHM_ST *shmPtr, int timeoutMs);
+int seekShmKey(SHM_ST *shmPtr);
 
 #endif
 
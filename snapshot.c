@@ -0,0 +1,240 @@
+/*
+ * snapshot.c
+ *
+ * ============================================================================
+ * Copyright (c) Texas Instruments Inc 2009
+ *
+ * Use of this software is controlled by the terms and conditions found in the
+ * license agreement under which this software has been supplied or provided.
+ * ============================================================================
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <xdc/std.h>
+
+#include <ti/sdo/ce/Engine.h>
+
+#include <ti/sdo/dmai/Fifo.h>
+#include <ti/sdo/dmai/BufTab.h>
+#include <ti/sdo/dmai/BufferGfx.h>
+#include <ti/sdo/dmai/Rendezvous.h>
+#include <ti/sdo/dmai/ce/Ienc1.h>
+#include <ti/sdo/dmai/Time.h>
+
+#include "snapshot.h"
+#include "writer.h"
+#include "frame.h"
+#include "../demo.h"
+
+#define MODULE_NAME     "Snapshot Thread"
+
+/******************************************************************************
+ * writeImage
+ ******************************************************************************/
+static Int writeImage(Buffer_Handle hBuf)
+{
+    Char    pathname[40]    = {"\0"};
+    Char    filename[25]    = {"\0"};
+    FILE   *outFile;
+
+    if (Buffer_getNumBytesUsed(hBuf) == 0) {
+        ERR("Zero bytes image encoded\n");
+        return Dmai_EFAIL;
+    }
+
+    /* Get a image file name associated with the time value */
+    strcpy(pathname, IMAGE_DIR);
+    Time_getStr(filename);
+    strcat(pathname, filename);
+    strcat(pathname, ".jpg");
+    Dmai_dbg1("pathname is %s\n", pathname);
+
+    /* Open a file for storing the image */
+    outFile = fopen(pathname, "w");
+
+    /* A full card loses the snapshot, not the video */
+    if (outFile == NULL) {
+        ERR("Failed to open %s for writing\n", pathname);
+        return Dmai_EFAIL;
+    }
+
+    if (fwrite(Buffer_getUserPtr(hBuf), Buffer_getNumBytesUsed(hBuf), 1,
+               outFile) != 1) {
+        ERR("Error writing to image file\n");
+        fclose(outFile);
+        unlink(pathname);
+        return Dmai_EFAIL;
+    }
+
+    fclose(outFile);
+
+    return Dmai_EOK;
+}
+
+/******************************************************************************
+ * snapshotThrFxn
+ ******************************************************************************/
+Void *snapshotThrFxn(Void *arg)
+{
+    SnapshotEnv            *envp            = (SnapshotEnv *) arg;
+    Void                   *status          = THREAD_SUCCESS;
+    IMGENC1_Params          params          = Ienc1_Params_DEFAULT;
+    IMGENC1_DynamicParams   dynParams       = Ienc1_DynamicParams_DEFAULT;
+    BufferGfx_Attrs         gfxAttrs        = BufferGfx_Attrs_DEFAULT;
+    Buffer_Attrs            bAttrs          = Buffer_Attrs_DEFAULT;
+    Engine_Handle           hEngine         = NULL;
+    Ienc1_Handle            hIe             = NULL;
+    BufTab_Handle           hBufTab         = NULL;
+    Buffer_Handle           hOutBuf         = NULL;
+    Buffer_Handle           hInBuf;
+    Int                     fifoRet;
+    Int                     bufIdx;
+    UInt64                  start;
+    UInt32                  us;
+
+    /* Open the codec engine */
+    hEngine = Engine_open(envp->engineName, NULL, NULL);
+
+    if (hEngine == NULL) {
+        ERR("Failed to open codec engine %s\n", envp->engineName);
+        cleanup(THREAD_FAILURE);
+    }
+
+    /* Set up params and dynparams for jpeg */
+    params.maxWidth                 = envp->imageWidth;
+    params.maxHeight                = envp->imageHeight;
+    params.forceChromaFormat        = XDM_YUV_420P;
+    dynParams.inputWidth            = params.maxWidth;
+    dynParams.inputHeight           = params.maxHeight;
+    dynParams.captureWidth          = params.maxWidth;
+    dynParams.qValue                = 75;
+    dynParams.inputChromaFormat     = XDM_YUV_420SP;
+
+    /* Create the image encoder */
+    hIe = Ienc1_create(hEngine, envp->imgEncoder, &params, &dynParams);
+
+    if (hIe == NULL) {
+        ERR("Failed to create image encoder: %s\n", envp->imgEncoder);
+        cleanup(THREAD_FAILURE);
+    }
+
+    /* The JPEG gets a buffer of its own, never one of the video's */
+    hOutBuf = Buffer_create(Ienc1_getOutBufSize(hIe), &bAttrs);
+
+    if (hOutBuf == NULL) {
+        ERR("Failed to allocate image buffer\n");
+        cleanup(THREAD_FAILURE);
+    }
+
+    /*
+     * Create a table of buffers the video thread copies the frames to
+     * shoot into, laid out like the captured frames.
+     */
+    gfxAttrs.colorSpace     = ColorSpace_YUV420PSEMI;
+    gfxAttrs.dim.width      = envp->imageWidth;
+    gfxAttrs.dim.height     = envp->imageHeight;
+    gfxAttrs.dim.lineLength = BufferGfx_calcLineLength(gfxAttrs.dim.width,
+                                                       gfxAttrs.colorSpace);
+
+    hBufTab = BufTab_create(SNAPSHOT_BUFS, envp->inBufSize,
+                            BufferGfx_getBufferAttrs(&gfxAttrs));
+
+    if (hBufTab == NULL) {
+        ERR("Failed to allocate contiguous buffers\n");
+        cleanup(THREAD_FAILURE);
+    }
+
+    /* Send all buffers to the video thread to be filled with frames */
+    for (bufIdx = 0; bufIdx < SNAPSHOT_BUFS; bufIdx++) {
+        if (Fifo_put(envp->hOutFifo, BufTab_getBuf(hBufTab, bufIdx)) < 0) {
+            ERR("Failed to send buffer to video thread\n");
+            cleanup(THREAD_FAILURE);
+        }
+    }
+
+    /* Signal that initialization is done and wait for other threads */
+    Rendezvous_meet(envp->hRendezvousInit);
+
+    while (TRUE) {
+        /* Get a frame to shoot from the video thread */
+        fifoRet = Fifo_get(envp->hInFifo, &hInBuf);
+
+        if (fifoRet < 0) {
+            ERR("Failed to get buffer from video thread\n");
+            cleanup(THREAD_FAILURE);
+        }
+
+        /* Did the video thread flush the fifo? */
+        if (fifoRet == Dmai_EFLUSH) {
+            cleanup(THREAD_SUCCESS);
+        }
+
+        start = frameTime();
+
+        /* Encode the frame to a image */
+        if (Ienc1_process(hIe, hInBuf, hOutBuf) < 0) {
+            ERR("Failed to encode image buffer\n");
+            cleanup(THREAD_FAILURE);
+        }
+
+        /* The frame is encoded, the video thread can have it back */
+        if (Fifo_put(envp->hOutFifo, hInBuf) < 0) {
+            ERR("Failed to send buffer to video thread\n");
+            cleanup(THREAD_FAILURE);
+        }
+
+        if (writeImage(hOutBuf) == Dmai_EOK) {
+            envp->stats.taken++;
+        }
+        else {
+            envp->stats.failed++;
+        }
+
+        us = frameTime() - start;
+        envp->stats.totalUs += us;
+        if (us > envp->stats.maxUs) {
+            envp->stats.maxUs = us;
+        }
+    }
+
+cleanup:
+    /* Make sure the other threads aren't waiting for us */
+    Rendezvous_force(envp->hRendezvousInit);
+    Pause_off(envp->hPauseProcess);
+    Fifo_flush(envp->hOutFifo);
+
+    /* Meet up with other threads before cleaning up */
+    Rendezvous_meet(envp->hRendezvousCleanup);
+
+    /* Clean up the thread before exiting */
+    if (envp->stats.taken + envp->stats.failed) {
+        printf("Snapshot: %u taken (%u failed), %llu ms on average, "
+               "%u ms at most\n", (unsigned) envp->stats.taken,
+               (unsigned) envp->stats.failed,
+               (unsigned long long) (envp->stats.totalUs / 1000 /
+                                     (envp->stats.taken +
+                                      envp->stats.failed)),
+               (unsigned) (envp->stats.maxUs / 1000));
+    }
+
+    if (hBufTab) {
+        BufTab_delete(hBufTab);
+    }
+
+    if (hOutBuf) {
+        Buffer_delete(hOutBuf);
+    }
+
+    if (hIe) {
+        Ienc1_delete(hIe);
+    }
+
+    if (hEngine) {
+        Engine_close(hEngine);
+    }
+
+    return status;
+}
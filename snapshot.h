@@ -0,0 +1,50 @@
+/*
+ * snapshot.h
+ *
+ * ============================================================================
+ * Copyright (c) Texas Instruments Inc 2009
+ *
+ * Use of this software is controlled by the terms and conditions found in the
+ * license agreement under which this software has been supplied or provided.
+ * ============================================================================
+ */
+
+#ifndef _SNAPSHOT_H
+#define _SNAPSHOT_H
+
+#include <xdc/std.h>
+
+#include <ti/sdo/dmai/Fifo.h>
+#include <ti/sdo/dmai/Pause.h>
+#include <ti/sdo/dmai/Rendezvous.h>
+
+/* Frames that can wait for a JPEG encode at the same time */
+#define SNAPSHOT_BUFS       1
+
+/* What the snapshot thread did so far */
+typedef struct SnapshotStats {
+    UInt32            taken;            /* JPEG files written */
+    UInt32            failed;           /* not written to the card */
+    UInt32            maxUs;            /* slowest encode and write */
+    UInt64            totalUs;
+} SnapshotStats;
+
+/* Environment passed when creating the thread */
+typedef struct SnapshotEnv {
+    Rendezvous_Handle hRendezvousInit;
+    Rendezvous_Handle hRendezvousCleanup;
+    Pause_Handle      hPauseProcess;
+    Fifo_Handle       hOutFifo;
+    Fifo_Handle       hInFifo;
+    Char             *imgEncoder;
+    Char             *engineName;
+    Int32             inBufSize;        /* of a captured frame */
+    Int32             imageWidth;
+    Int32             imageHeight;
+    SnapshotStats     stats;            /* written by the snapshot thread */
+} SnapshotEnv;
+
+/* Thread function prototype */
+extern Void *snapshotThrFxn(Void *arg);
+
+#endif /* _SNAPSHOT_H */
@@ -23,6 +23,7 @@
 #include <ti/sdo/dmai/ce/Senc1.h>
 
 #include "speech.h"
+#include "frame.h"
 #include "../demo.h"
 
 /*
@@ -31,7 +32,7 @@
  * overhead of calling the codec and driver for each byte of data will be
  * excessive.
  */
-#define OUTBUFSIZE   160
+#define OUTBUFSIZE   SPEECH_BLOCK_SIZE
 #define INBUFSIZE    OUTBUFSIZE * 2
 
 /******************************************************************************
@@ -53,13 +54,16 @@ Void *speechThrFxn(Void *arg)
     FILE                   *outFile             = NULL;
     SPHENC1_Params         *params;
     SPHENC1_DynamicParams  *dynParams;
+    UInt64                  blockTime;
 
-    /* Open the output file for writing */
-    outFile = fopen(envp->speechFile, "w");
+    /* Open the output file for writing unless the speech is recorded */
+    if (envp->audioBuf == NULL) {
+        outFile = fopen(envp->speechFile, "w");
 
-    if (outFile == NULL) {
-        ERR("Failed to open %s for writing\n", envp->speechFile);
-        cleanup(THREAD_FAILURE);
+        if (outFile == NULL) {
+            ERR("Failed to open %s for writing\n", envp->speechFile);
+            cleanup(THREAD_FAILURE);
+        }
     }
 
     /* Use supplied params if any, otherwise use defaults */
@@ -129,6 +133,10 @@ Void *speechThrFxn(Void *arg)
             cleanup(THREAD_FAILURE);
         }
 
+        /* The block was captured over the time it took to fill */
+        blockTime = frameTime() -
+                    (UInt64) OUTBUFSIZE * 1000000 / SPEECH_SAMPLE_RATE;
+
         /* Encode the speech buffer */
         if (Senc1_process(hSe1, hInBuf, hOutBuf) < 0) {
             ERR("Failed to encode speech buffer\n");
@@ -141,8 +149,13 @@ Void *speechThrFxn(Void *arg)
          */
         Buffer_setNumBytesUsed(hOutBuf, OUTBUFSIZE);
 
+        /* Hand it to the writer, which doesn't wait for us or we for it */
+        if (envp->audioBuf) {
+            audioBufPut(envp->audioBuf, Buffer_getUserPtr(hOutBuf),
+                        blockTime);
+        }
         /* Write encoded buffer to the speech file */
-        if (Buffer_getNumBytesUsed(hOutBuf)) {
+        else if (Buffer_getNumBytesUsed(hOutBuf)) {
             if (fwrite(Buffer_getUserPtr(hOutBuf),
                        Buffer_getNumBytesUsed(hOutBuf), 1, outFile) != 1) {
                 ERR("Error writing the encoded data to speech file.\n");
@@ -18,6 +18,14 @@
 #include <ti/sdo/dmai/Sound.h>
 #include <ti/sdo/dmai/Rendezvous.h>
 
+#include "audiobuf.h"
+
+/* Bytes of G.711 encoded at a time, 20 ms of speech */
+#define SPEECH_BLOCK_SIZE       160
+
+/* Samples per second, one byte each once encoded */
+#define SPEECH_SAMPLE_RATE      8000
+
 /* Environment passed when creating the thread */
 typedef struct SpeechEnv {
     Rendezvous_Handle       hRendezvousInit;
@@ -29,6 +37,7 @@ typedef struct SpeechEnv {
     Char                   *speechEncoder;
     Void                   *params;
     Void                   *dynParams;
+    AudioBuf               *audioBuf;   /* to the recording, else the file */
 } SpeechEnv;
 
 /* Thread function prototype */
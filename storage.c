@@ -0,0 +1,685 @@
+/*
+ * storage.c
+ *
+ * Background recording of the encoded stream. The writer thread copies each
+ * frame into a staging ring and returns its buffer right away. The storage
+ * thread runs without real time priority and writes the ring out in chunks
+ * aligned for O_DIRECT, so the page cache doesn't fill up with video and a
+ * stalled SD card only ever fills the ring. When the ring is full frames
+ * are dropped up to the next key frame, capture never waits.
+ *
+ * While a file is being written the next one is already created under a
+ * spare name and preallocated, so switching files is a rename and the SD
+ * card gets contiguous extents instead of growing the file cluster by
+ * cluster.
+ *
+ * Written data is only safe once the file size is committed as well. With
+ * a sync policy the thread calls fdatasync() after its writes once enough
+ * time or data has gone by, and writes out what is queued of a chunk when
+ * only the time is up. The writer never waits for it, the ring does.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <linux/falloc.h>
+
+#include <xdc/std.h>
+
+#include <ti/sdo/dmai/Dmai.h>
+
+#include "storage.h"
+
+#define MODULE_NAME     "Storage"
+
+/* O_DIRECT needs buffers, sizes and file offsets aligned to this */
+#define STORAGE_ALIGN           4096
+
+#define STORAGE_NAME_LEN        64
+
+/* Longest the thread sleeps between runs of the idle function */
+#define STORAGE_IDLE_MS         1000
+
+#define alignUp(x, a)           (((x) + (a) - 1) / (a) * (a))
+#define alignDown(x, a)         ((x) / (a) * (a))
+
+/* A file switch queued by storageOpen() */
+typedef struct StorageFile {
+    UInt64  end;                /* where the previous file's data ends */
+    UInt64  start;              /* where this file's data starts */
+    UInt32  nextSize;           /* bytes to preallocate for the file after */
+    Char    name[STORAGE_NAME_LEN];
+} StorageFile;
+
+struct Storage {
+    pthread_t       thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t  cond;
+    Int8           *ring;
+    UInt32          size;
+    UInt32          chunk;
+    UInt64          wr;         /* bytes queued, only the producer moves it */
+    UInt64          rd;         /* bytes written, only the thread moves it */
+    StorageFile     files[STORAGE_MAX_FILES];
+    Int             fileFirst;
+    Int             numFiles;
+    Bool            skipping;
+    Bool            quit;
+    Bool            started;
+    Int             fd;
+    Bool            direct;
+    UInt64          fileBytes;  /* written to fd */
+    UInt32          fileAlloc;  /* preallocated for fd */
+    Int             spareFd;
+    Bool            spareDirect;
+    UInt32          spareAlloc;
+    Char            spareName[STORAGE_NAME_LEN];
+    StorageIdleFxn  idleFxn;
+    Void           *idleArg;
+    UInt32          syncMs;
+    UInt32          syncBytes;
+    UInt32          syncTime;   /* of the last fdatasync() */
+    UInt64          unsynced;   /* bytes written to fd since */
+    StorageStats    stats;
+};
+
+/******************************************************************************
+ * timeMs
+ ******************************************************************************/
+static UInt32 timeMs(Void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/******************************************************************************
+ * createFile
+ ******************************************************************************/
+static Int createFile(Char *fileName, Bool *direct)
+{
+    Int fd = -1;
+
+    if (*direct) {
+        fd = open(fileName, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0666);
+
+        /* Not every file system can do O_DIRECT */
+        if (fd == -1 && errno == EINVAL) {
+            *direct = FALSE;
+        }
+    }
+
+    if (!*direct) {
+        fd = open(fileName, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    }
+
+    if (fd == -1) {
+        Dmai_err2("Failed to open %s (%d)\n", fileName, errno);
+    }
+
+    return fd;
+}
+
+/******************************************************************************
+ * dropSpare
+ ******************************************************************************/
+static Void dropSpare(Storage *st)
+{
+    if (st->spareFd != -1) {
+        close(st->spareFd);
+        unlink(st->spareName);
+        st->spareFd = -1;
+    }
+}
+
+/******************************************************************************
+ * prepareSpare
+ ******************************************************************************/
+static Void prepareSpare(Storage *st, StorageFile *file)
+{
+    Char *dirEnd = strrchr(file->name, '/');
+    Int dirLen = dirEnd ? dirEnd - file->name + 1 : 0;
+    Char *ext = strrchr(file->name + dirLen, '.');
+    Int extLen = ext ? strlen(ext) : 0;
+
+    dropSpare(st);
+
+    if (dirLen + sizeof(STORAGE_SPARE_NAME) + extLen > STORAGE_NAME_LEN) {
+        return;
+    }
+
+    /* Another kind of file written next to these gets its own spare */
+    memcpy(st->spareName, file->name, dirLen);
+    strcpy(st->spareName + dirLen, STORAGE_SPARE_NAME);
+    if (ext) {
+        strcat(st->spareName, ext);
+    }
+
+    st->spareDirect = TRUE;
+    st->spareFd = createFile(st->spareName, &st->spareDirect);
+    st->spareAlloc = 0;
+
+    /* File systems without fallocate just grow the file as it is written */
+    if (st->spareFd != -1 && file->nextSize &&
+        fallocate(st->spareFd, FALLOC_FL_KEEP_SIZE, 0, file->nextSize) == 0) {
+        st->spareAlloc = file->nextSize;
+    }
+}
+
+/******************************************************************************
+ * openFile
+ ******************************************************************************/
+static Void openFile(Storage *st, StorageFile *file)
+{
+    /* Take the file prepared while the last one was written */
+    if (st->spareFd != -1 && rename(st->spareName, file->name) == 0) {
+        st->fd = st->spareFd;
+        st->direct = st->spareDirect;
+        st->fileAlloc = st->spareAlloc;
+        st->spareFd = -1;
+    }
+    else {
+        st->direct = TRUE;
+        st->fd = createFile(file->name, &st->direct);
+        st->fileAlloc = 0;
+    }
+
+    st->fileBytes = 0;
+    st->syncTime = timeMs();
+    st->unsynced = 0;
+
+    /* O_DIRECT only works if the file starts on an aligned ring offset */
+    if (st->fd != -1 && st->direct && file->start % STORAGE_ALIGN) {
+        fcntl(st->fd, F_SETFL, fcntl(st->fd, F_GETFL) & ~O_DIRECT);
+        st->direct = FALSE;
+    }
+
+    if (st->fd != -1) {
+        pthread_mutex_lock(&st->mutex);
+        st->stats.files++;
+        pthread_mutex_unlock(&st->mutex);
+    }
+
+    prepareSpare(st, file);
+}
+
+/******************************************************************************
+ * syncFile
+ ******************************************************************************/
+static Void syncFile(Storage *st)
+{
+    UInt32 start, ms;
+
+    if (st->fd == -1) {
+        return;
+    }
+
+    /* Also commits the file size, so the data written can be found again */
+    start = timeMs();
+    if (fdatasync(st->fd) == -1) {
+        Dmai_err1("Failed to sync recording (%d)\n", errno);
+    }
+    ms = timeMs() - start;
+
+    st->syncTime = timeMs();
+    st->unsynced = 0;
+
+    pthread_mutex_lock(&st->mutex);
+    st->stats.syncs++;
+    if (ms > st->stats.maxSyncMs) {
+        st->stats.maxSyncMs = ms;
+    }
+    pthread_mutex_unlock(&st->mutex);
+}
+
+/******************************************************************************
+ * syncDue
+ ******************************************************************************/
+static Bool syncDue(Storage *st)
+{
+    return st->fd != -1 && st->unsynced > 0 &&
+           ((st->syncBytes && st->unsynced >= st->syncBytes) ||
+            (st->syncMs && timeMs() - st->syncTime >= st->syncMs));
+}
+
+/******************************************************************************
+ * closeFile
+ ******************************************************************************/
+static Void closeFile(Storage *st)
+{
+    if (st->fd != -1) {
+        /* Give back what was preallocated but not used */
+        if (st->fileAlloc > st->fileBytes &&
+            ftruncate(st->fd, st->fileBytes) == -1) {
+            Dmai_err1("Failed to trim recording (%d)\n", errno);
+        }
+
+        /* A finished file is complete on the card whatever happens next */
+        if ((st->syncMs || st->syncBytes) && st->unsynced > 0) {
+            syncFile(st);
+        }
+
+        close(st->fd);
+        st->fd = -1;
+    }
+}
+
+/******************************************************************************
+ * writeData
+ ******************************************************************************/
+static Void writeData(Storage *st, Int8 *buf, UInt32 n)
+{
+    UInt32 start, ms;
+    Int bucket;
+    ssize_t ret;
+
+    if (st->fd == -1) {
+        return;
+    }
+
+    /* The unaligned end of a file can't go through O_DIRECT */
+    if (st->direct && n % STORAGE_ALIGN) {
+        fcntl(st->fd, F_SETFL, fcntl(st->fd, F_GETFL) & ~O_DIRECT);
+        st->direct = FALSE;
+    }
+
+    while (n > 0) {
+        start = timeMs();
+        ret = write(st->fd, buf, n);
+        ms = timeMs() - start;
+
+        for (bucket = 0; bucket < STORAGE_HIST_BUCKETS - 1; bucket++) {
+            if (ms < (1U << bucket)) {
+                break;
+            }
+        }
+
+        pthread_mutex_lock(&st->mutex);
+        st->stats.writes++;
+        st->stats.hist[bucket]++;
+        if (ms > st->stats.maxWriteMs) {
+            st->stats.maxWriteMs = ms;
+        }
+        if (ret > 0) {
+            st->stats.bytes += ret;
+        }
+        pthread_mutex_unlock(&st->mutex);
+
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            /* Keep draining the ring, there is nobody to wait for us */
+            Dmai_err1("Failed to write recording (%d)\n", errno);
+            closeFile(st);
+            return;
+        }
+
+        buf += ret;
+        n -= ret;
+        st->fileBytes += ret;
+        st->unsynced += ret;
+    }
+}
+
+/******************************************************************************
+ * storageThrFxn
+ ******************************************************************************/
+static Void *storageThrFxn(Void *arg)
+{
+    Storage        *st = (Storage *) arg;
+    StorageFile    *file;
+    UInt64          limit;
+    UInt32          off, n;
+    StorageIdleFxn  idleFxn;
+    Void           *idleArg;
+    Bool            idleDone = FALSE;
+    UInt32          waitMs, left;
+    struct timespec ts;
+
+    pthread_mutex_lock(&st->mutex);
+
+    while (TRUE) {
+        file = st->numFiles ? &st->files[st->fileFirst] : NULL;
+
+        /* Everything before a queued file switch belongs to the old file */
+        if (file && st->rd == file->end) {
+            st->rd = file->start;
+            pthread_mutex_unlock(&st->mutex);
+
+            closeFile(st);
+            if (file->name[0] != '\0') {
+                openFile(st, file);
+            }
+
+            pthread_mutex_lock(&st->mutex);
+            st->fileFirst = (st->fileFirst + 1) % STORAGE_MAX_FILES;
+            st->numFiles--;
+            continue;
+        }
+
+        limit = file ? file->end : st->wr;
+        off = st->rd % st->size;
+
+        /* Whole chunks while recording, the rest once the file ends */
+        if (limit - st->rd >= st->chunk) {
+            n = st->chunk;
+        }
+        else if ((file || st->quit) && limit > st->rd) {
+            n = limit - st->rd;
+        }
+        else if (st->quit) {
+            break;
+        }
+        else if (syncDue(st) || (st->syncMs && st->fd != -1 &&
+                 timeMs() - st->syncTime >= st->syncMs &&
+                 limit - st->rd >= STORAGE_ALIGN)) {
+            /*
+             * Time to sync, along with the whole blocks of a chunk still
+             * filling up so a slow stream doesn't sit in RAM. The few
+             * bytes left keep the file aligned for O_DIRECT.
+             */
+            n = alignDown(limit - st->rd, STORAGE_ALIGN);
+
+            if (n == 0) {
+                pthread_mutex_unlock(&st->mutex);
+                syncFile(st);
+                pthread_mutex_lock(&st->mutex);
+                continue;
+            }
+        }
+        else if (st->idleFxn && !idleDone) {
+            idleFxn = st->idleFxn;
+            idleArg = st->idleArg;
+            pthread_mutex_unlock(&st->mutex);
+
+            /*
+             * Between chunks the card is ours, other work on it goes here
+             * a step at a time so a chunk never waits for more than one.
+             */
+            idleDone = !idleFxn(idleArg);
+
+            pthread_mutex_lock(&st->mutex);
+            continue;
+        }
+        else if (st->idleFxn || st->syncMs) {
+            /* Wake up for the idle function or when the next sync is due */
+            waitMs = st->idleFxn ? STORAGE_IDLE_MS : st->syncMs;
+            if (st->syncMs && st->fd != -1) {
+                left = timeMs() - st->syncTime;
+                left = left < st->syncMs ? st->syncMs - left : st->syncMs;
+                waitMs = left < waitMs ? left : waitMs;
+            }
+
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_sec += waitMs / 1000;
+            ts.tv_nsec += (waitMs % 1000) * 1000000;
+            if (ts.tv_nsec >= 1000000000) {
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000000000;
+            }
+
+            pthread_cond_timedwait(&st->cond, &st->mutex, &ts);
+            idleDone = FALSE;
+            continue;
+        }
+        else {
+            pthread_cond_wait(&st->cond, &st->mutex);
+            continue;
+        }
+
+        if (n > st->size - off) {
+            n = st->size - off;
+        }
+
+        pthread_mutex_unlock(&st->mutex);
+
+        writeData(st, st->ring + off, n);
+
+        /* The card may stall here, the ring keeps taking frames */
+        if (syncDue(st)) {
+            syncFile(st);
+        }
+
+        pthread_mutex_lock(&st->mutex);
+        st->rd += n;
+    }
+
+    pthread_mutex_unlock(&st->mutex);
+
+    closeFile(st);
+    dropSpare(st);
+
+    return NULL;
+}
+
+/******************************************************************************
+ * storageCreate
+ ******************************************************************************/
+Storage *storageCreate(Int32 bufSize, Int32 chunkSize)
+{
+    pthread_attr_t      attr;
+    struct sched_param  schedParam;
+    Storage            *st;
+
+    st = calloc(1, sizeof(Storage));
+
+    if (st == NULL) {
+        Dmai_err0("Failed to allocate storage object\n");
+        return NULL;
+    }
+
+    st->fd = -1;
+    st->spareFd = -1;
+    st->chunk = alignUp(chunkSize, STORAGE_ALIGN);
+    st->size = alignUp(bufSize, st->chunk);
+    pthread_mutex_init(&st->mutex, NULL);
+    pthread_cond_init(&st->cond, NULL);
+
+    if (posix_memalign((Void **) &st->ring, STORAGE_ALIGN, st->size)) {
+        Dmai_err1("Failed to allocate %u byte storage ring\n", st->size);
+        storageDelete(st, NULL);
+        return NULL;
+    }
+
+    /* Disk writes must never compete with the real time threads */
+    pthread_attr_init(&attr);
+    pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+    pthread_attr_setschedpolicy(&attr, SCHED_OTHER);
+    schedParam.sched_priority = 0;
+    pthread_attr_setschedparam(&attr, &schedParam);
+
+    if (pthread_create(&st->thread, &attr, storageThrFxn, st)) {
+        Dmai_err0("Failed to create storage thread\n");
+        pthread_attr_destroy(&attr);
+        storageDelete(st, NULL);
+        return NULL;
+    }
+
+    pthread_attr_destroy(&attr);
+    st->started = TRUE;
+
+    return st;
+}
+
+/******************************************************************************
+ * queueFile
+ ******************************************************************************/
+static Int queueFile(Storage *st, Char *fileName, Int32 nextSize)
+{
+    StorageFile *file;
+    UInt64 start;
+
+    pthread_mutex_lock(&st->mutex);
+
+    if (st->numFiles == STORAGE_MAX_FILES) {
+        pthread_mutex_unlock(&st->mutex);
+        Dmai_err1("Too many files queued, not switching to %s\n", fileName);
+        return Dmai_EFAIL;
+    }
+
+    /* Start the new file on a chunk boundary if the ring has room for it */
+    start = alignUp(st->wr, st->chunk);
+    if (start - st->rd > st->size) {
+        start = st->wr;
+    }
+
+    file = &st->files[(st->fileFirst + st->numFiles) % STORAGE_MAX_FILES];
+    file->end = st->wr;
+    file->start = start;
+    file->nextSize = nextSize;
+    strncpy(file->name, fileName, STORAGE_NAME_LEN - 1);
+    file->name[STORAGE_NAME_LEN - 1] = '\0';
+    st->numFiles++;
+    st->wr = start;
+
+    pthread_cond_signal(&st->cond);
+    pthread_mutex_unlock(&st->mutex);
+
+    return Dmai_EOK;
+}
+
+/******************************************************************************
+ * storageOpen
+ ******************************************************************************/
+Int storageOpen(Storage *st, Char *fileName, Int32 nextSize)
+{
+    return queueFile(st, fileName, nextSize);
+}
+
+/******************************************************************************
+ * storageClose
+ ******************************************************************************/
+Int storageClose(Storage *st)
+{
+    /* A switch to no file at all */
+    return queueFile(st, "", 0);
+}
+
+/******************************************************************************
+ * storageSetSync
+ ******************************************************************************/
+Void storageSetSync(Storage *st, UInt32 syncMs, UInt32 syncBytes)
+{
+    pthread_mutex_lock(&st->mutex);
+    st->syncMs = syncMs;
+    st->syncBytes = syncBytes;
+    pthread_cond_signal(&st->cond);
+    pthread_mutex_unlock(&st->mutex);
+}
+
+/******************************************************************************
+ * storageSetIdleFxn
+ ******************************************************************************/
+Void storageSetIdleFxn(Storage *st, StorageIdleFxn fxn, Void *arg)
+{
+    pthread_mutex_lock(&st->mutex);
+    st->idleFxn = fxn;
+    st->idleArg = arg;
+    pthread_cond_signal(&st->cond);
+    pthread_mutex_unlock(&st->mutex);
+}
+
+/******************************************************************************
+ * storageRoom
+ ******************************************************************************/
+Int32 storageRoom(Storage *st)
+{
+    Int32 room;
+
+    pthread_mutex_lock(&st->mutex);
+    room = st->size - (st->wr - st->rd);
+    pthread_mutex_unlock(&st->mutex);
+
+    return room;
+}
+
+/******************************************************************************
+ * storagePut
+ ******************************************************************************/
+Int storagePut(Storage *st, Int8 *buf, Int32 size, Bool key)
+{
+    UInt32 off, n;
+
+    pthread_mutex_lock(&st->mutex);
+
+    /* After a drop the stream can only resume at a key frame */
+    if (st->skipping && !key) {
+        st->stats.dropped++;
+        pthread_mutex_unlock(&st->mutex);
+        return Dmai_EFAIL;
+    }
+
+    if (st->wr + size - st->rd > st->size) {
+        st->stats.dropped++;
+        st->skipping = TRUE;
+        pthread_mutex_unlock(&st->mutex);
+        return Dmai_EFAIL;
+    }
+
+    st->skipping = FALSE;
+    pthread_mutex_unlock(&st->mutex);
+
+    /* The storage thread never reads past wr, copy without the lock */
+    off = st->wr % st->size;
+    n = size < st->size - off ? size : st->size - off;
+    memcpy(st->ring + off, buf, n);
+    memcpy(st->ring, buf + n, size - n);
+
+    pthread_mutex_lock(&st->mutex);
+    st->wr += size;
+    st->stats.frames++;
+    if (st->wr - st->rd >= st->chunk) {
+        pthread_cond_signal(&st->cond);
+    }
+    pthread_mutex_unlock(&st->mutex);
+
+    return Dmai_EOK;
+}
+
+/******************************************************************************
+ * storageGetStats
+ ******************************************************************************/
+Void storageGetStats(Storage *st, StorageStats *stats)
+{
+    pthread_mutex_lock(&st->mutex);
+    *stats = st->stats;
+    pthread_mutex_unlock(&st->mutex);
+}
+
+/******************************************************************************
+ * storageDelete
+ ******************************************************************************/
+Void storageDelete(Storage *st, StorageStats *stats)
+{
+    if (st == NULL) {
+        return;
+    }
+
+    if (st->started) {
+        pthread_mutex_lock(&st->mutex);
+        st->quit = TRUE;
+        pthread_cond_signal(&st->cond);
+        pthread_mutex_unlock(&st->mutex);
+
+        pthread_join(st->thread, NULL);
+    }
+
+    if (stats) {
+        *stats = st->stats;
+    }
+
+    pthread_cond_destroy(&st->cond);
+    pthread_mutex_destroy(&st->mutex);
+    free(st->ring);
+    free(st);
+}
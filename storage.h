@@ -0,0 +1,92 @@
+/*
+ * storage.h
+ *
+ * Background recording of the encoded stream. Frames are copied into a
+ * staging ring and a storage thread writes them out in large aligned
+ * chunks, so a slow SD card never holds up the encode pipeline. Files can
+ * be switched at any frame, the next one is created ahead of time.
+ */
+
+#ifndef _STORAGE_H
+#define _STORAGE_H
+
+#include <xdc/std.h>
+
+/*
+ * Write latency histogram buckets. Bucket n counts writes that took less
+ * than 2^n ms, the last one all slower writes.
+ */
+#define STORAGE_HIST_BUCKETS    12
+
+/* Most file switches queued at the same time */
+#define STORAGE_MAX_FILES       4
+
+/* Name the next file is prepared under, in the directory of the current */
+#define STORAGE_SPARE_NAME      ".storage_next"
+
+typedef struct Storage Storage;
+
+/*
+ * Work the storage thread does a piece at a time while it has nothing to
+ * write, returns TRUE while there is more to do.
+ */
+typedef Bool (*StorageIdleFxn)(Void *arg);
+
+/* What the storage stage did so far */
+typedef struct StorageStats {
+    UInt32  files;              /* files opened */
+    UInt32  frames;             /* frames queued */
+    UInt32  dropped;            /* frames dropped because the ring was full */
+    UInt64  bytes;              /* bytes written to files */
+    UInt32  writes;             /* write() calls */
+    UInt32  maxWriteMs;         /* slowest write() */
+    UInt32  syncs;              /* fdatasync() calls */
+    UInt32  maxSyncMs;          /* slowest fdatasync() */
+    UInt32  hist[STORAGE_HIST_BUCKETS];
+} StorageStats;
+
+/* Start a storage thread with a ring of bufSize bytes written in chunks */
+extern Storage *storageCreate(Int32 bufSize, Int32 chunkSize);
+
+/*
+ * Frames queued from now on go to fileName, never blocks. nextSize is the
+ * expected size of the file after this one, preallocated when it is
+ * created, or 0 if not known.
+ */
+extern Int storageOpen(Storage *st, Char *fileName, Int32 nextSize);
+
+/*
+ * Frames queued so far finish the current file, which is closed once they
+ * are written. Frames queued after this are discarded until storageOpen().
+ */
+extern Int storageClose(Storage *st);
+
+/*
+ * Bound what a power cut can lose: written data is forced to the card
+ * once syncMs have passed or syncBytes were written since the last time,
+ * and files are synced before they are closed. 0 turns a limit off.
+ */
+extern Void storageSetSync(Storage *st, UInt32 syncMs, UInt32 syncBytes);
+
+/* Run fxn in the storage thread whenever it is idle, at least every second */
+extern Void storageSetIdleFxn(Storage *st, StorageIdleFxn fxn, Void *arg);
+
+/* Bytes that can be queued right now without dropping */
+extern Int32 storageRoom(Storage *st);
+
+/*
+ * Queue a frame, never blocks. If the ring is full the frame is dropped
+ * and so is everything up to the next key frame.
+ */
+extern Int storagePut(Storage *st, Int8 *buf, Int32 size, Bool key);
+
+/* Copy of the statistics */
+extern Void storageGetStats(Storage *st, StorageStats *stats);
+
+/*
+ * Write out what is queued, stop the thread and close the file. The final
+ * statistics go to stats unless it is NULL.
+ */
+extern Void storageDelete(Storage *st, StorageStats *stats);
+
+#endif /* _STORAGE_H */
@@ -10,6 +10,7 @@
  */
 #include <string.h>
 #include <errno.h>
+#include <pthread.h>
 
 #include <xdc/std.h>
 
@@ -20,14 +21,18 @@
 #include <ti/sdo/dmai/BufTab.h>
 #include <ti/sdo/dmai/VideoStd.h>
 #include <ti/sdo/dmai/BufferGfx.h>
+#include <ti/sdo/dmai/Resize.h>
 #include <ti/sdo/dmai/Rendezvous.h>
 #include <ti/sdo/dmai/ce/Venc1.h>
-#include <ti/sdo/dmai/ce/Ienc1.h>
-#include <ti/sdo/dmai/Time.h>
 #include <ti/sdo/dmai/Dmai.h>
 
 #include "video.h"
+#include "capture.h"
+#include "writer.h"
+#include "frame.h"
+#include "latency.h"
 #include "msqlib.h"
+#include "videoctl.h"
 #include "../demo.h"
 
 #define MODULE_NAME   "Video Thread"
@@ -36,11 +41,819 @@
 #define YUV_420SP 256
 #endif 
 
-/* Number of buffers in the pipe to the capture thread */
-/* Note: It needs to match capture.c pipe size */
-#define VIDEO_PIPE_SIZE           3
-
 #define PERM S_IRUSR|S_IWUSR
+
+/* Milliseconds between looks at who reads the shm streams */
+#define VIDEO_READER_POLL_MS      250
+
+/* Most buffers the capture thread sends, in 720P its own */
+#define VIDEO_MAX_FRAMES          16
+
+/* A captured frame the encoders share, given back once all are done */
+typedef struct VideoFrame {
+    Buffer_Handle           hCapBuf;
+    Buffer_Handle           hRzbBuf;    /* copy of what resizer b made */
+    Int                     refs;       /* encoders not done with it */
+    Bool                    shoot;      /* a snapshot is taken of it */
+} VideoFrame;
+
+/* What the encoders of all streams share */
+typedef struct VideoPipe {
+    VideoEnv               *envp;
+    pthread_mutex_t         mutex;
+    pthread_mutex_t         shootMutex; /* two frames shot at once */
+    VideoFrame              frames[VIDEO_MAX_FRAMES];
+    Int                     numFrames;
+    UInt32                  framesDone; /* by every stream */
+    UInt64                  startTime;  /* of the first frame */
+    LatencyHist            *doneHist;   /* frame copied to all encoded */
+} VideoPipe;
+
+/* What the video thread keeps for each stream */
+typedef struct VideoEncoder {
+    Int                     index;      /* of the stream */
+    VideoPipe              *pipe;
+    Engine_Handle           hEngine;    /* its own, see createEncoder */
+    Venc1_Handle            hVe;
+    VIDENC1_DynamicParams   dynParams;  /* as last given to the encoder */
+    Resize_Handle           hRsz;       /* scales the capture, or NULL */
+    Buffer_Handle           hRszBuf;    /* what it scales to */
+    Bool                    rszConfigured;
+    Int                     skipAcc;    /* frame rate scheduler */
+    Bool                    idle;       /* nobody reads its shm */
+    Int                     frameCnt;   /* frames it was given */
+    VideoCtlMsg             ctl;        /* waiting to be applied */
+    Bool                    ctlPending;
+    LatencyHist            *waitHist;   /* frame copied to encode start */
+    LatencyHist            *encodeHist; /* scaling and encoding */
+    Buffer_Handle           hOwnBuf;    /* encoded into without a sink */
+    Fifo_Handle             hFrameFifo; /* frames to its encode thread */
+    pthread_t               thread;
+    Bool                    started;
+    Bool                    stopped;    /* only gives the frames back */
+    Void                   *status;
+} VideoEncoder;
+
+/******************************************************************************
+ * getSinkBuf
+ ******************************************************************************/
+static Int getSinkBuf(Fifo_Handle hFifo, Buffer_Handle *hBufPtr,
+                      VideoStalls *stalls)
+{
+    UInt64  start;
+    UInt32  us;
+    Int     ret;
+
+    /* Only time the gets that will block, the rest costs nothing */
+    if (Fifo_getNumEntries(hFifo) > 0) {
+        return Fifo_get(hFifo, hBufPtr);
+    }
+
+    start = frameTime();
+    ret = Fifo_get(hFifo, hBufPtr);
+    us = frameTime() - start;
+
+    stalls->stalls++;
+    stalls->totalUs += us;
+    if (us > stalls->maxUs) {
+        stalls->maxUs = us;
+    }
+
+    return ret;
+}
+
+/******************************************************************************
+ * printStalls
+ ******************************************************************************/
+static Void printStalls(Int stream, VideoStalls *stalls)
+{
+    printf("Video: waited %u times for stream %d buffers, %llu ms in total, "
+           "longest %u ms\n", (unsigned) stalls->stalls, stream,
+           (unsigned long long) (stalls->totalUs / 1000),
+           (unsigned) (stalls->maxUs / 1000));
+}
+
+/******************************************************************************
+ * copyFrameInfo
+ ******************************************************************************/
+static FrameInfo *copyFrameInfo(Buffer_Handle hDstBuf,
+                                Buffer_Handle hSrcBuf)
+{
+    FrameInfo *dst = getFrameInfo(hDstBuf);
+    FrameInfo *src = getFrameInfo(hSrcBuf);
+
+    if (dst && src) {
+        *dst = *src;
+        return dst;
+    }
+
+    return NULL;
+}
+
+/******************************************************************************
+ * shootFrame
+ ******************************************************************************/
+static Void shootFrame(VideoEnv *envp, Buffer_Handle hCapBuf)
+{
+    BufferGfx_Dimensions    dim;
+    Buffer_Handle           hSnapBuf;
+    Int32                   size;
+
+    /* Never wait for the snapshot thread, a busy one misses this frame */
+    if (Fifo_getNumEntries(envp->hSnapshotOutFifo) == 0 ||
+        Fifo_get(envp->hSnapshotOutFifo, &hSnapBuf) < 0) {
+        envp->snapshotsMissed++;
+        return;
+    }
+
+    /* The capture buffer goes back right away, the JPEG gets a copy */
+    size = Buffer_getSize(hCapBuf) < Buffer_getSize(hSnapBuf) ?
+           Buffer_getSize(hCapBuf) : Buffer_getSize(hSnapBuf);
+    memcpy(Buffer_getUserPtr(hSnapBuf), Buffer_getUserPtr(hCapBuf), size);
+    Buffer_setNumBytesUsed(hSnapBuf, size);
+
+    BufferGfx_getDimensions(hCapBuf, &dim);
+    BufferGfx_setDimensions(hSnapBuf, &dim);
+    copyFrameInfo(hSnapBuf, hCapBuf);
+
+    if (Fifo_put(envp->hSnapshotInFifo, hSnapBuf) < 0) {
+        ERR("Failed to send buffer to snapshot thread\n");
+    }
+}
+
+/******************************************************************************
+ * controlEncoder
+ ******************************************************************************/
+static Int controlEncoder(Venc1_Handle hVe, VIDENC1_DynamicParams *dynParams)
+{
+    VIDENC1_Status  status;
+
+    status.size = sizeof(VIDENC1_Status);
+
+    if (VIDENC1_control(Venc1_getVisaHandle(hVe), XDM_SETPARAMS, dynParams,
+                        &status) != VIDENC1_EOK) {
+        return Dmai_EFAIL;
+    }
+
+    return Dmai_EOK;
+}
+
+/******************************************************************************
+ * applyControl
+ ******************************************************************************/
+static Void applyControl(Venc1_Handle hVe, VIDENC1_DynamicParams *dynParams,
+                         VideoCtlMsg *ctl)
+{
+    VIDENC1_DynamicParams   next = *dynParams;
+
+    if (ctl->bitRate > 0) {
+        next.targetBitRate = ctl->bitRate;
+    }
+
+    if (ctl->frameRate > 0) {
+        next.refFrameRate    = ctl->frameRate;
+        next.targetFrameRate = ctl->frameRate;
+    }
+
+    if (ctl->intraInterval > 0) {
+        next.intraFrameInterval = ctl->intraInterval;
+    }
+
+    if (ctl->forceIdr) {
+        next.forceFrame = IVIDEO_IDR_FRAME;
+    }
+
+    /* The encoder keeps what it had if it doesn't take the new values */
+    if (controlEncoder(hVe, &next) < 0) {
+        ERR("Stream %d rejected %d bps, %d fps/1000, IDR every %d frames\n",
+            (Int) ctl->stream, (Int) next.targetBitRate,
+            (Int) next.targetFrameRate, (Int) next.intraFrameInterval);
+        return;
+    }
+
+    *dynParams = next;
+    printf("Video: stream %d now at %d bps, %d fps/1000, IDR every %d "
+           "frames%s\n", (Int) ctl->stream, (Int) next.targetBitRate,
+           (Int) next.targetFrameRate, (Int) next.intraFrameInterval,
+           ctl->forceIdr ? ", IDR forced" : "");
+}
+
+/******************************************************************************
+ * endForcedIdr
+ ******************************************************************************/
+static Void endForcedIdr(Venc1_Handle hVe, VIDENC1_DynamicParams *dynParams)
+{
+    /* A forced IDR is for one frame, the ones after it are coded as usual */
+    if (dynParams->forceFrame != IVIDEO_NA_FRAME) {
+        dynParams->forceFrame = IVIDEO_NA_FRAME;
+
+        if (controlEncoder(hVe, dynParams) < 0) {
+            ERR("Failed to stop forcing IDR frames\n");
+        }
+    }
+}
+
+/******************************************************************************
+ * takeFrame
+ ******************************************************************************/
+static Bool takeFrame(VideoEncoder *enc, Int captureRate)
+{
+    Int rate = enc->dynParams.targetFrameRate;
+
+    if (rate <= 0 || rate >= captureRate) {
+        return TRUE;
+    }
+
+    /*
+     * Spread the frames encoded evenly over those captured, the error left
+     * from one frame is carried over to the next. Each encoded frame keeps
+     * its own capture time, so the gaps show in the timestamps.
+     */
+    enc->skipAcc += rate;
+
+    if (enc->skipAcc < captureRate) {
+        return FALSE;
+    }
+
+    enc->skipAcc -= captureRate;
+
+    return TRUE;
+}
+
+/******************************************************************************
+ * checkReaders
+ ******************************************************************************/
+static Void checkReaders(Int i, VideoStream *stream, VideoEncoder *enc,
+                         Int captureRate)
+{
+    Bool idle;
+
+    /* Without its shm there is nothing to go by, keep encoding */
+    if (stream->shm == NULL) {
+        return;
+    }
+
+    idle = countShmReaders(stream->shm) == 0;
+
+    if (idle == enc->idle) {
+        return;
+    }
+
+    enc->idle = idle;
+
+    if (idle) {
+        printf("Video: nobody reads stream %d, stopped encoding it\n", i);
+        return;
+    }
+
+    /* Start over with an IDR the new reader can decode from right away */
+    enc->dynParams.forceFrame = IVIDEO_IDR_FRAME;
+
+    if (controlEncoder(enc->hVe, &enc->dynParams) < 0) {
+        ERR("Failed to force an IDR frame on stream %d\n", i);
+    }
+
+    /* And with the first frame captured from now on */
+    if (enc->dynParams.targetFrameRate < captureRate) {
+        enc->skipAcc = captureRate - enc->dynParams.targetFrameRate;
+    }
+
+    printf("Video: stream %d has readers, encoding it again\n", i);
+}
+
+/******************************************************************************
+ * printEncodeStats
+ ******************************************************************************/
+static Void printEncodeStats(Int stream, VideoEncodeStats *stats)
+{
+    UInt32 avgUs = stats->frames ? stats->totalUs / stats->frames : 0;
+
+    printf("Video: stream %d encoded %u frames, skipped %u, %u unread, "
+           "%u.%02u ms a frame on average, %u.%02u ms at most\n", stream,
+           (unsigned) stats->frames, (unsigned) stats->skipped,
+           (unsigned) stats->idle,
+           (unsigned) (avgUs / 1000), (unsigned) (avgUs % 1000 / 10),
+           (unsigned) (stats->maxUs / 1000),
+           (unsigned) (stats->maxUs % 1000 / 10));
+}
+
+/******************************************************************************
+ * printThroughput
+ ******************************************************************************/
+static Void printThroughput(VideoPipe *pipe, VideoEnv *envp)
+{
+    UInt64 us = pipe->startTime ? frameTime() - pipe->startTime : 0;
+    UInt32 fps;
+
+    if (us == 0) {
+        return;
+    }
+
+    /* Capture bound while the encoders keep up, lower once they don't */
+    fps = (UInt64) pipe->framesDone * 100000000 / us;
+
+    printf("Video: %u frames through all %d streams in %u s, %u.%02u fps, "
+           "%s\n", (unsigned) pipe->framesDone, envp->numStreams,
+           (unsigned) (us / 1000000), (unsigned) (fps / 100),
+           (unsigned) (fps % 100),
+           envp->serial ? "encoded one after the other" :
+                          "encoded in a thread each");
+}
+
+/******************************************************************************
+ * createEncoder
+ ******************************************************************************/
+static Int createEncoder(VideoEnv *envp, VideoStream *stream,
+                         VideoEncoder *enc)
+{
+    VIDENC1_Params          params          = Venc1_Params_DEFAULT;
+    VIDENC1_DynamicParams  *dynParams       = &enc->dynParams;
+    Buffer_Attrs            bAttrs          = Buffer_Attrs_DEFAULT;
+
+    /* Use supplied params if any, otherwise use defaults */
+    if (envp->params) {
+        params = *(VIDENC1_Params *) envp->params;
+    }
+
+    *dynParams = envp->dynParams ? *(VIDENC1_DynamicParams *) envp->dynParams
+                                 : Venc1_DynamicParams_DEFAULT;
+
+    /* Set up codec parameters */
+    params.maxWidth          = stream->width;
+    params.maxHeight         = stream->height;
+    params.encodingPreset    = XDM_HIGH_SPEED;
+    params.inputChromaFormat = XDM_YUV_420SP;
+    params.reconChromaFormat = XDM_YUV_420SP;
+    params.maxFrameRate      = envp->videoFrameRate;
+
+    /* Set up codec parameters depending on bit rate */
+    if (stream->bitRate < 0) {
+        /* Variable bit rate */
+        params.rateControlPreset = IVIDEO_NONE;
+
+        /*
+         * If variable bit rate use a bogus bit rate value (> 0)
+         * since it will be ignored.
+         */
+        params.maxBitRate        = 0;
+    }
+    else {
+        /* Constant bit rate */
+        params.rateControlPreset = IVIDEO_STORAGE;
+        params.maxBitRate        = stream->bitRate;
+    }
+
+    dynParams->targetBitRate      = params.maxBitRate;
+    dynParams->inputWidth         = params.maxWidth;
+    dynParams->inputHeight        = params.maxHeight;
+    dynParams->refFrameRate       = params.maxFrameRate;
+    dynParams->targetFrameRate    = params.maxFrameRate;
+
+    /* A stream at a lower rate gets its bit budget over fewer frames */
+    if (stream->frameRate > 0 && stream->frameRate < params.maxFrameRate) {
+        dynParams->refFrameRate    = stream->frameRate;
+        dynParams->targetFrameRate = stream->frameRate;
+    }
+
+    /* The first frame captured is always encoded */
+    enc->skipAcc = params.maxFrameRate - dynParams->targetFrameRate;
+    dynParams->interFrameInterval = 0;
+    dynParams->forceFrame         = IVIDEO_NA_FRAME;
+
+    /*
+     * An engine handle may only be used by one thread at a time, every
+     * encoder gets its own for the thread encoding its stream.
+     */
+    enc->hEngine = Engine_open(envp->engineName, NULL, NULL);
+
+    if (enc->hEngine == NULL) {
+        ERR("Failed to open codec engine %s\n", envp->engineName);
+        return Dmai_EFAIL;
+    }
+
+    /* Create the video encoder */
+    enc->hVe = Venc1_create(enc->hEngine, envp->videoEncoder, &params,
+                            dynParams);
+
+    if (enc->hVe == NULL) {
+        ERR("Failed to create video encoder: %s\n", envp->videoEncoder);
+        return Dmai_EFAIL;
+    }
+
+    /* Store the output buffer size in the environment */
+    stream->outBufSize = Venc1_getOutBufSize(enc->hVe);
+
+    /* Without a sink the frames are encoded into a buffer of our own */
+    if (stream->sink == VideoSink_NONE) {
+        enc->hOwnBuf = Buffer_create(stream->outBufSize, &bAttrs);
+
+        if (enc->hOwnBuf == NULL) {
+            ERR("Failed to allocate output buffer\n");
+            return Dmai_EFAIL;
+        }
+    }
+
+    return Dmai_EOK;
+}
+
+/******************************************************************************
+ * createScaler
+ ******************************************************************************/
+static Int createScaler(VideoEnv *envp, VideoStream *stream,
+                        VideoEncoder *enc, Bool resizer)
+{
+    BufferGfx_Attrs gfxAttrs    = BufferGfx_Attrs_DEFAULT;
+    Resize_Attrs    rszAttrs    = Resize_Attrs_DEFAULT;
+
+    /* Streams the capture already has a frame for need no scaling */
+    if ((stream->width == envp->imageWidth &&
+         stream->height == envp->imageHeight) ||
+        (resizer && stream->width == envp->resizeWidth &&
+         stream->height == envp->resizeHeight)) {
+        return Dmai_EOK;
+    }
+
+    gfxAttrs.colorSpace     = ColorSpace_YUV420PSEMI;
+    gfxAttrs.dim.width      = stream->width;
+    gfxAttrs.dim.height     = stream->height;
+    gfxAttrs.dim.lineLength = BufferGfx_calcLineLength(gfxAttrs.dim.width,
+                                                       gfxAttrs.colorSpace);
+
+    enc->hRszBuf = Buffer_create(Venc1_getInBufSize(enc->hVe),
+                                 BufferGfx_getBufferAttrs(&gfxAttrs));
+
+    if (enc->hRszBuf == NULL) {
+        ERR("Failed to allocate %ldx%ld scaled buffer\n", stream->width,
+            stream->height);
+        return Dmai_EFAIL;
+    }
+
+    enc->hRsz = Resize_create(&rszAttrs);
+
+    if (enc->hRsz == NULL) {
+        ERR("Failed to create resize job\n");
+        return Dmai_EFAIL;
+    }
+
+    return Dmai_EOK;
+}
+
+/******************************************************************************
+ * getInput
+ ******************************************************************************/
+static Buffer_Handle getInput(VideoEncoder *enc, Buffer_Handle hCapBuf,
+                              Buffer_Handle hRzbBuf, VideoStream *stream,
+                              VideoEnv *envp)
+{
+    if (enc->hRsz == NULL) {
+        return stream->width == envp->imageWidth &&
+               stream->height == envp->imageHeight ? hCapBuf : hRzbBuf;
+    }
+
+    /* Every captured frame is laid out the same, configure once */
+    if (!enc->rszConfigured) {
+        if (Resize_config(enc->hRsz, hCapBuf, enc->hRszBuf) < 0) {
+            ERR("Failed to configure resize job\n");
+            return NULL;
+        }
+
+        enc->rszConfigured = TRUE;
+    }
+
+    if (Resize_execute(enc->hRsz, hCapBuf, enc->hRszBuf) < 0) {
+        ERR("Failed to execute resize job\n");
+        return NULL;
+    }
+
+    return enc->hRszBuf;
+}
+
+/******************************************************************************
+ * getFrame
+ ******************************************************************************/
+static VideoFrame *getFrame(VideoPipe *pipe, Buffer_Handle hCapBuf)
+{
+    VideoFrame *frame = NULL;
+    Int         i;
+
+    pthread_mutex_lock(&pipe->mutex);
+
+    for (i = 0; i < pipe->numFrames; i++) {
+        if (pipe->frames[i].hCapBuf == hCapBuf) {
+            frame = &pipe->frames[i];
+            break;
+        }
+    }
+
+    if (frame == NULL && pipe->numFrames < VIDEO_MAX_FRAMES) {
+        frame = &pipe->frames[pipe->numFrames++];
+        frame->hCapBuf = hCapBuf;
+    }
+
+    pthread_mutex_unlock(&pipe->mutex);
+
+    if (frame == NULL) {
+        ERR("No frame slot left for buffer %p\n", hCapBuf);
+    }
+
+    return frame;
+}
+
+/******************************************************************************
+ * releaseFrame
+ ******************************************************************************/
+static Int releaseFrame(VideoPipe *pipe, VideoFrame *frame)
+{
+    VideoEnv   *envp    = pipe->envp;
+    FrameInfo  *info;
+    Int         refs;
+    Int         ret     = Dmai_EOK;
+
+    /*
+     * The histogram takes one writer at a time, whichever encode thread
+     * drops the last reference adds the frame under the lock.
+     */
+    pthread_mutex_lock(&pipe->mutex);
+    refs = --frame->refs;
+    if (refs == 0) {
+        pipe->framesDone++;
+
+        if ((info = getFrameInfo(frame->hCapBuf))) {
+            latencyAdd(pipe->doneHist, info->copyTime, frameTime());
+        }
+    }
+    pthread_mutex_unlock(&pipe->mutex);
+
+    /* The last encoder done with the frame gives it back */
+    if (refs > 0) {
+        return Dmai_EOK;
+    }
+
+    /*
+     * The snapshot thread encodes the JPEG of this frame from its own
+     * copy, handed over once no video encoder needs the frame. Copied
+     * outside the pipe lock, the other encoders never wait for it.
+     */
+    if (frame->shoot) {
+        pthread_mutex_lock(&pipe->shootMutex);
+        shootFrame(envp, frame->hCapBuf);
+        pthread_mutex_unlock(&pipe->shootMutex);
+    }
+
+    if (Fifo_put(envp->hCaptureInFifo, frame->hCapBuf) < 0) {
+        ERR("Failed to send buffer to capture thread\n");
+        ret = Dmai_EFAIL;
+    }
+
+    if (frame->hRzbBuf &&
+        Fifo_put(envp->hResizeInFifo, frame->hRzbBuf) < 0) {
+        ERR("Failed to send resize buffer to capture thread\n");
+        ret = Dmai_EFAIL;
+    }
+
+    return ret;
+}
+
+/******************************************************************************
+ * postControl
+ ******************************************************************************/
+static Void postControl(VideoEncoder *enc, VideoCtlMsg *ctl)
+{
+    pthread_mutex_lock(&enc->pipe->mutex);
+
+    /* Changes that came in before the encoder got to them add up */
+    if (!enc->ctlPending) {
+        enc->ctl = *ctl;
+    }
+    else {
+        if (ctl->bitRate > 0) {
+            enc->ctl.bitRate = ctl->bitRate;
+        }
+
+        if (ctl->frameRate > 0) {
+            enc->ctl.frameRate = ctl->frameRate;
+        }
+
+        if (ctl->intraInterval > 0) {
+            enc->ctl.intraInterval = ctl->intraInterval;
+        }
+
+        enc->ctl.forceIdr |= ctl->forceIdr;
+    }
+
+    enc->ctlPending = TRUE;
+
+    pthread_mutex_unlock(&enc->pipe->mutex);
+}
+
+/******************************************************************************
+ * takeControl
+ ******************************************************************************/
+static Bool takeControl(VideoEncoder *enc, VideoCtlMsg *ctl)
+{
+    Bool pending;
+
+    pthread_mutex_lock(&enc->pipe->mutex);
+
+    pending = enc->ctlPending;
+    *ctl = enc->ctl;
+    enc->ctlPending = FALSE;
+
+    pthread_mutex_unlock(&enc->pipe->mutex);
+
+    return pending;
+}
+
+/******************************************************************************
+ * encodeFrame
+ ******************************************************************************/
+static Int encodeFrame(VideoEncoder *enc, VideoFrame *frame)
+{
+    VideoEnv       *envp    = enc->pipe->envp;
+    VideoStream    *stream  = &envp->streams[enc->index];
+    Buffer_Handle   hInBuf, hDstBuf;
+    VideoCtlMsg     ctl;
+    FrameInfo      *info, *dst;
+    UInt64          start, end;
+    UInt32          us;
+    Int             fifoRet;
+    Int             poll;
+
+    /* Apply the encoder changes that came in since the last frame */
+    if (takeControl(enc, &ctl)) {
+        applyControl(enc->hVe, &enc->dynParams, &ctl);
+    }
+
+    /* Only encode the shm streams somebody reads, look now and then */
+    poll = envp->videoFrameRate * VIDEO_READER_POLL_MS / 1000000;
+
+    if (stream->sink == VideoSink_SHM &&
+        (poll <= 1 || enc->frameCnt % poll == 0)) {
+        checkReaders(enc->index, stream, enc, envp->videoFrameRate);
+    }
+
+    enc->frameCnt++;
+
+    if (enc->idle) {
+        stream->encode.idle++;
+        return Dmai_EOK;
+    }
+
+    if (!takeFrame(enc, envp->videoFrameRate)) {
+        stream->encode.skipped++;
+        return Dmai_EOK;
+    }
+
+    /* Get a buffer to encode into */
+    if (stream->sink == VideoSink_NONE) {
+        hDstBuf = enc->hOwnBuf;
+    }
+    else {
+        fifoRet = getSinkBuf(stream->hOutFifo, &hDstBuf, &stream->stalls);
+
+        if (fifoRet < 0) {
+            ERR("Failed to get buffer for stream %d\n", enc->index);
+            return Dmai_EFAIL;
+        }
+
+        /* Did the sink thread flush the fifo? */
+        if (fifoRet == Dmai_EFLUSH) {
+            return Dmai_EFLUSH;
+        }
+    }
+
+    start = frameTime();
+    hInBuf = getInput(enc, frame->hCapBuf, frame->hRzbBuf, stream, envp);
+
+    if (hInBuf == NULL) {
+        return Dmai_EFAIL;
+    }
+
+    if (Venc1_process(enc->hVe, hInBuf, hDstBuf) < 0) {
+        ERR("Failed to encode video buffer for stream %d\n", enc->index);
+        return Dmai_EFAIL;
+    }
+
+    end = frameTime();
+    us = end - start;
+    stream->encode.frames++;
+    stream->encode.totalUs += us;
+    if (us > stream->encode.maxUs) {
+        stream->encode.maxUs = us;
+    }
+
+    endForcedIdr(enc->hVe, &enc->dynParams);
+
+    /* Waiting for the frame and for the encoder to be free */
+    info = getFrameInfo(frame->hCapBuf);
+    latencyAdd(enc->waitHist, info ? info->copyTime : start, start);
+    latencyAdd(enc->encodeHist, start, end);
+
+    /* Increment statistics for the user interface */
+    gblIncVideoBytesProcessed(Buffer_getNumBytesUsed(hDstBuf));
+
+    if (stream->sink == VideoSink_NONE) {
+        return Dmai_EOK;
+    }
+
+    /* Carry the capture information over to the encoded buffer */
+    if ((dst = copyFrameInfo(hDstBuf, frame->hCapBuf)) != NULL) {
+        dst->encodeStart = start;
+        dst->encodeTime  = end;
+    }
+
+    /* Send the encoded buffer on to the writer or publish thread */
+    if (Fifo_put(stream->hInFifo, hDstBuf) < 0) {
+        ERR("Failed to send buffer of stream %d\n", enc->index);
+        return Dmai_EFAIL;
+    }
+
+    return Dmai_EOK;
+}
+
+/******************************************************************************
+ * encodeThrFxn
+ ******************************************************************************/
+static Void *encodeThrFxn(Void *arg)
+{
+    VideoEncoder   *enc = (VideoEncoder *) arg;
+    Buffer_Handle   hCapBuf;
+    VideoFrame     *frame;
+    Int             fifoRet;
+    Int             ret;
+
+    while (TRUE) {
+        /* Get the next frame from the video thread */
+        fifoRet = Fifo_get(enc->hFrameFifo, &hCapBuf);
+
+        if (fifoRet < 0) {
+            ERR("Failed to get frame for stream %d\n", enc->index);
+            enc->status = THREAD_FAILURE;
+            gblSetQuit();
+            break;
+        }
+
+        /* Did the video thread flush the fifo? */
+        if (fifoRet == Dmai_EFLUSH) {
+            break;
+        }
+
+        frame = getFrame(enc->pipe, hCapBuf);
+        ret = enc->stopped ? Dmai_EOK : encodeFrame(enc, frame);
+
+        if (releaseFrame(enc->pipe, frame) < 0) {
+            ret = Dmai_EFAIL;
+        }
+
+        /*
+         * A flushed sink means the demo is stopping, a failure stops it.
+         * The other streams go on until the video thread sees it, frames
+         * still come in and only go back to the capture thread from here.
+         */
+        if (ret < 0) {
+            enc->status = THREAD_FAILURE;
+            gblSetQuit();
+        }
+
+        if (ret != Dmai_EOK) {
+            enc->stopped = TRUE;
+        }
+    }
+
+    return NULL;
+}
+
+/******************************************************************************
+ * startEncoder
+ ******************************************************************************/
+static Int startEncoder(VideoEncoder *enc)
+{
+    Fifo_Attrs      fAttrs  = Fifo_Attrs_DEFAULT;
+    pthread_attr_t  attr;
+
+    enc->hFrameFifo = Fifo_create(&fAttrs);
+
+    if (enc->hFrameFifo == NULL) {
+        ERR("Failed to open frame fifo of stream %d\n", enc->index);
+        return Dmai_EFAIL;
+    }
+
+    /* Real time like the video thread, which mostly waits for capture */
+    pthread_attr_init(&attr);
+    pthread_attr_setinheritsched(&attr, PTHREAD_INHERIT_SCHED);
+
+    if (pthread_create(&enc->thread, &attr, encodeThrFxn, enc)) {
+        ERR("Failed to create encode thread of stream %d\n", enc->index);
+        pthread_attr_destroy(&attr);
+        return Dmai_EFAIL;
+    }
+
+    pthread_attr_destroy(&attr);
+    enc->started = TRUE;
+
+    return Dmai_EOK;
+}
+
 /******************************************************************************
  * videoThrFxn
  ******************************************************************************/
@@ -48,31 +861,35 @@ Void *videoThrFxn(Void *arg)
 {
     VideoEnv               *envp                = (VideoEnv *) arg;
     Void                   *status              = THREAD_SUCCESS;
-    VIDENC1_Params          defaultParams       = Venc1_Params_DEFAULT;
-    VIDENC1_DynamicParams   defaultDynParams    = Venc1_DynamicParams_DEFAULT;
     BufferGfx_Attrs         gfxAttrs            = BufferGfx_Attrs_DEFAULT;
-    Venc1_Handle            hVe1                = NULL;
-    Venc1_Handle            hVe2                = NULL;
-    Ienc1_Handle            hIe                 = NULL;
-    Engine_Handle           hEngine             = NULL;
+    VideoEncoder            encoders[VIDEO_MAX_STREAMS];
+    VideoEncoder           *enc;
+    VideoPipe               pipe;
+    VideoFrame             *frame;
     BufTab_Handle           hBufTab             = NULL;
-    Int                     frameCnt            = 0;
-    Buffer_Handle           hCapBuf, hDstBuf, hRzbBuf, hsDstBuf;
-    VIDENC1_Params         *params;
-    VIDENC1_DynamicParams  *dynParams;
-    IMGENC1_Params          params_img          = Ienc1_Params_DEFAULT;                                                                                
-    IMGENC1_DynamicParams   dynParams_img       = Ienc1_DynamicParams_DEFAULT;
+    BufTab_Handle           hRszBufTab          = NULL;
+    Buffer_Handle           hCapBuf, hRzbBuf    = NULL;
+    VideoCtlMsg             ctl;
+    Int                     ctlId;
     Int                     fifoRet;
     Int                     bufIdx;
+    Int                     ret;
+    Int                     i;
+    Char                    name[LATENCY_NAME_LEN];
     ColorSpace_Type         colorSpace = ColorSpace_YUV420PSEMI;
     Bool                    localBufferAlloc = TRUE;
-    Char                    pathname[40]     = {"\0"};
-    Char                    filename[25]     = {"\0"};
-    FILE                   *outFile          =  NULL;
+    Bool                    shoot;
     struct msg_notify       msg;
     key_t                   key;
     int                     msgid;
 
+    memset(encoders, 0, sizeof(encoders));
+    memset(&pipe, 0, sizeof(pipe));
+    pthread_mutex_init(&pipe.mutex, NULL);
+    pthread_mutex_init(&pipe.shootMutex, NULL);
+    pipe.envp = envp;
+    pipe.doneHist = latencyCreate("all encoded");
+
     /* Generate a key for creating a message queue */
     key = ftok(PATH,1);
 
@@ -90,11 +907,13 @@ Void *videoThrFxn(Void *arg)
     }
     Dmai_dbg1("msqid = %d\n", msgid);
 
-    /* Open the codec engine */
-    hEngine = Engine_open(envp->engineName, NULL, NULL);
+    /* Encoder changes come in on a queue of their own */
+    key = ftok(VIDEOCTL_PATH, VIDEOCTL_PROJ_ID);
+    ctlId = key == -1 ? -1 : msgget(key, PERM|IPC_CREAT);
 
-    if (hEngine == NULL) {
-        ERR("Failed to open codec engine %s\n", envp->engineName);
+    if (ctlId == -1) {
+        ERR("Failed to create the video control queue: %s\n",
+            strerror(errno));
         cleanup(THREAD_FAILURE);
     }
 
@@ -104,126 +923,35 @@ Void *videoThrFxn(Void *arg)
         (envp->imageHeight == VideoStd_720P_HEIGHT)) {
         localBufferAlloc = FALSE;
     } 
-    
-    /* Use supplied params if any, otherwise use defaults */
-    params = envp->params ? envp->params : &defaultParams;
-    dynParams = envp->dynParams ? envp->dynParams : &defaultDynParams;
-
-    /* Set up codec parameters */
-    params->maxWidth          = envp->imageWidth;
-    params->maxHeight         = envp->imageHeight;
-    params->encodingPreset    = XDM_HIGH_SPEED;
-    if (colorSpace ==  ColorSpace_YUV420PSEMI) { 
-        params->inputChromaFormat = XDM_YUV_420SP;
-    } else {
-        params->inputChromaFormat = XDM_YUV_422ILE;
-    }
-    params->reconChromaFormat = XDM_YUV_420SP;
-    params->maxFrameRate      = envp->videoFrameRate;
-
-    /* Set up codec parameters depending on bit rate */
-    if (envp->videoBitRate < 0) {
-        /* Variable bit rate */
-        params->rateControlPreset = IVIDEO_NONE;
-
-        /*
-         * If variable bit rate use a bogus bit rate value (> 0)
-         * since it will be ignored.
-         */
-        params->maxBitRate        = 0;
-    }
-    else {
-        /* Constant bit rate */
-        params->rateControlPreset = IVIDEO_STORAGE;
-        params->maxBitRate        = envp->videoBitRate;
-    }
-
-    dynParams->targetBitRate   = params->maxBitRate;
-    dynParams->inputWidth      = params->maxWidth;
-    dynParams->inputHeight     = params->maxHeight;    
-    dynParams->refFrameRate    = params->maxFrameRate;
-    dynParams->targetFrameRate = params->maxFrameRate;
-    dynParams->interFrameInterval = 0;
-    
-    /* Create the video encoder */
-    hVe1 = Venc1_create(hEngine, envp->videoEncoder, params, dynParams);
-
-    params->maxWidth              = envp->resizeWidth;
-    params->maxHeight             = envp->resizeHeight;
-    params->encodingPreset        = XDM_HIGH_SPEED;
-    if (colorSpace ==  ColorSpace_YUV420PSEMI) { 
-        params->inputChromaFormat = XDM_YUV_420SP;
-    } else {
-        params->inputChromaFormat = XDM_YUV_422ILE;
-    }
-    params->reconChromaFormat     = XDM_YUV_420SP;
-    params->maxFrameRate          = envp->videoFrameRate;
-    Dmai_dbg1("maxFrameRate = %d\n", envp->videoFrameRate);
-    /* We can control the bitrate of cif streaming via 
-       the envp->videoBitRate field */
-    envp->videoBitRate            = 128*1024;
-    Dmai_dbg1("videoBitRate = %d\n", envp->videoBitRate);
-    /* Set up codec parameters depending on bit rate */
-    if (envp->videoBitRate < 0) {
-        /* Variable bit rate */
-        params->rateControlPreset = IVIDEO_NONE;
-
-        /*
-         * If variable bit rate use a bogus bit rate value (> 0)
-         * since it will be ignored.
-         */
-        params->maxBitRate        = 0;
-    }
-    else {
-        /* Constant bit rate */
-        params->rateControlPreset = IVIDEO_STORAGE;
-        params->maxBitRate        = envp->videoBitRate;
-    }
-    dynParams->targetBitRate      = params->maxBitRate;
-    dynParams->inputWidth         = envp->resizeWidth;
-    dynParams->inputHeight        = envp->resizeHeight;    
-    dynParams->refFrameRate       = params->maxFrameRate;
-    dynParams->targetFrameRate    = params->maxFrameRate;
-    dynParams->interFrameInterval = 0;
 
-    /* Create the rezise video encoder */
-    hVe2 = Venc1_create(hEngine, envp->videoEncoder, params, dynParams);
+    /*
+     * An encoder for every stream in the table. Resizer b runs alongside
+     * the frame copy, which needs our own buffers, in 720P there is only
+     * the captured frame to encode from.
+     */
+    for (i = 0; i < envp->numStreams; i++) {
+        Dmai_dbg4("Stream %d: %ldx%ld at %d bps\n", i,
+                  envp->streams[i].width, envp->streams[i].height,
+                  envp->streams[i].bitRate);
+
+        encoders[i].index  = i;
+        encoders[i].pipe   = &pipe;
+        encoders[i].status = THREAD_SUCCESS;
+
+        if (createEncoder(envp, &envp->streams[i], &encoders[i]) < 0 ||
+            createScaler(envp, &envp->streams[i], &encoders[i],
+                         localBufferAlloc) < 0) {
+            cleanup(THREAD_FAILURE);
+        }
 
-    if (hVe1 == NULL || hVe2 == NULL) {
-        ERR("Failed to create video encoder: %s\n", envp->videoEncoder);
-        cleanup(THREAD_FAILURE);
+        snprintf(name, sizeof(name), "s%d wait", i);
+        encoders[i].waitHist = latencyCreate(name);
+        snprintf(name, sizeof(name), "s%d encode", i);
+        encoders[i].encodeHist = latencyCreate(name);
     }
 
-    /* Store the output buffer size in the environment */
-    envp->outBufSize = Venc1_getOutBufSize(hVe1);
-
-    /* TODO: validate the size of resized buffer */
-    /* Store the size of resized buffer in the enviroment */
-    envp->outsBufSize = Venc1_getOutBufSize(hVe2);
-
-    /* Set up params and dynparams for jpeg*/
-	params_img.maxWidth = envp->imageWidth;
-    params_img.maxHeight = envp->imageHeight;
-    params_img.forceChromaFormat = XDM_YUV_420P;    
-    dynParams_img.inputWidth = params_img.maxWidth;
-    dynParams_img.inputHeight = params_img.maxHeight;
-    dynParams_img.captureWidth = params_img.maxWidth;
-    /* TODO: validate qvalue */
-    //dynParams_img->qValue = envp->qValue;
-    dynParams_img.qValue = 75;
-    if (colorSpace ==  ColorSpace_YUV420PSEMI) { 
-        dynParams_img.inputChromaFormat = XDM_YUV_420SP;
-    } else {
-        /* TODO */
-        dynParams_img.inputChromaFormat = XDM_YUV_422ILE;
-    }
-
-	hIe = Ienc1_create(hEngine, envp->imgEncoder, &params_img, &dynParams_img);
-
-    if (hIe == NULL) {
-        ERR("Failed to create image encoder: %s\n", envp->imgEncoder);
-        cleanup(THREAD_FAILURE);
-    }
+    /* The first stream is at the capture resolution */
+    envp->inBufSize = Venc1_getInBufSize(encoders[0].hVe);
 
     /* Signal that the codec is created and output buffer size available */
     Rendezvous_meet(envp->hRendezvousWriter);
@@ -237,7 +965,7 @@ Void *videoThrFxn(Void *arg)
          * Ask the codec how much input data it needs and create a table of
          * buffers with this size.
          */
-        hBufTab = BufTab_create(VIDEO_PIPE_SIZE, Venc1_getInBufSize(hVe1),
+        hBufTab = BufTab_create(VIDEO_PIPE_SIZE, envp->inBufSize,
                                 BufferGfx_getBufferAttrs(&gfxAttrs));
 
         if (hBufTab == NULL) {
@@ -253,6 +981,34 @@ Void *videoThrFxn(Void *arg)
                 cleanup(THREAD_FAILURE);
             }
         }
+
+        /*
+         * The frames of resizer b are copied out of the capture buffer
+         * too, each stays with its captured frame until every stream is
+         * done with it.
+         */
+        gfxAttrs.dim.width  = envp->resizeWidth;
+        gfxAttrs.dim.height = envp->resizeHeight;
+        gfxAttrs.dim.lineLength = BufferGfx_calcLineLength(gfxAttrs.dim.width,
+                                                           gfxAttrs.colorSpace);
+
+        hRszBufTab = BufTab_create(VIDEO_PIPE_SIZE,
+                                   gfxAttrs.dim.lineLength *
+                                   gfxAttrs.dim.height * 3 / 2,
+                                   BufferGfx_getBufferAttrs(&gfxAttrs));
+
+        if (hRszBufTab == NULL) {
+            ERR("Failed to allocate contiguous resize buffers\n");
+            cleanup(THREAD_FAILURE);
+        }
+
+        for (bufIdx = 0; bufIdx < VIDEO_PIPE_SIZE; bufIdx++) {
+            if (Fifo_put(envp->hResizeInFifo,
+                         BufTab_getBuf(hRszBufTab, bufIdx)) < 0) {
+                ERR("Failed to send resize buffer to capture thread\n");
+                cleanup(THREAD_FAILURE);
+            }
+        }
     } else {
         /* Send buffers to the capture thread to be ready for main loop */
         for (bufIdx = 0; bufIdx < VIDEO_PIPE_SIZE; bufIdx++) {
@@ -276,8 +1032,24 @@ Void *videoThrFxn(Void *arg)
             }
         }
     }
+
+    /*
+     * Each stream is encoded in a thread of its own, so the work around
+     * one encoder's process call overlaps with the others', unless they
+     * are asked to go one after the other in this thread.
+     */
+    if (!envp->serial) {
+        for (i = 0; i < envp->numStreams; i++) {
+            if (startEncoder(&encoders[i]) < 0) {
+                cleanup(THREAD_FAILURE);
+            }
+        }
+    }
+
     /* Signal that initialization is done and wait for other threads */
     Rendezvous_meet(envp->hRendezvousInit);
+
+    pipe.startTime = frameTime();
     
     while (!gblGetQuit()) {
         /* Pause processing? */
@@ -298,125 +1070,83 @@ Void *videoThrFxn(Void *arg)
             cleanup(THREAD_SUCCESS);
         }
 
-        /* Get a resized buffer to encode from the capture thread */
-        fifoRet = Fifo_get(envp->hCaptureOutFifo, &hRzbBuf);
-
-        if (fifoRet < 0) {
-            ERR("Failed to get resizer buffer from capture thread\n");
-            cleanup(THREAD_FAILURE);
-        }
+        /* And the frame resizer b made of it */
+        if (localBufferAlloc == TRUE) {
+            fifoRet = Fifo_get(envp->hResizeOutFifo, &hRzbBuf);
 
-        /* Did the capture thread flush the fifo? */
-        if (fifoRet == Dmai_EFLUSH) {
-            cleanup(THREAD_SUCCESS);
-        }
+            if (fifoRet < 0) {
+                ERR("Failed to get resizer buffer from capture thread\n");
+                cleanup(THREAD_FAILURE);
+            }
 
-        /* Get a buffer from the writer thread */
-        fifoRet = Fifo_get(envp->hWriterOutFifo, &hDstBuf);
+            /* Did the capture thread flush the fifo? */
+            if (fifoRet == Dmai_EFLUSH) {
+                cleanup(THREAD_SUCCESS);
+            }
 
-        if (fifoRet < 0) {
-            ERR("Failed to get buffer from writer thread\n");
-            cleanup(THREAD_FAILURE);
+            /* Make sure the whole buffer is used for input */
+            BufferGfx_resetDimensions(hRzbBuf);
         }
 
-        /* Did the writer thread flush the fifo? */
-        if (fifoRet == Dmai_EFLUSH) {
-            cleanup(THREAD_SUCCESS);
-        }
+        /* Make sure the whole buffer is used for input */
+        BufferGfx_resetDimensions(hCapBuf);
 
-        /* Get a buffer from the writer thread */
-        fifoRet = Fifo_get(envp->hWriterOutFifo, &hsDstBuf);
+        frame = getFrame(&pipe, hCapBuf);
 
-        if (fifoRet < 0) {
-            ERR("Failed to get buffer from writer thread\n");
+        if (frame == NULL) {
             cleanup(THREAD_FAILURE);
         }
 
-        /* Did the writer thread flush the fifo? */
-        if (fifoRet == Dmai_EFLUSH) {
-            cleanup(THREAD_SUCCESS);
-        }
-        
-        /* Make sure the whole buffer is used for input */
-        BufferGfx_resetDimensions(hCapBuf);
-
-        /* Make sure the whole buffer is used for input */
-        BufferGfx_resetDimensions(hRzbBuf);
+        frame->hRzbBuf = hRzbBuf;
 
         /* Unblocking recieve a message from the message queue */
-        msgrcv(msgid, &msg, sizeof(struct msg_notify), MSG2SHOOT, IPC_NOWAIT);
-
-        if (msg.m_type == M_SHOOT) {
-            /* Encode one frame to a image */
-		    if (Ienc1_process(hIe, hCapBuf, hDstBuf) < 0) {
-       	    	ERR("Failed to encode image buffer\n");
-                cleanup(THREAD_FAILURE);
- 		    }
+        shoot = msgrcv(msgid, &msg, sizeof(struct msg_notify), MSG2SHOOT,
+                       IPC_NOWAIT) >= 0 && msg.m_type == M_SHOOT;
 
-            /* Get a image file name associated with the time value */
-            strcpy(pathname,"/mnt/mmc/image/\0");
-            Time_getStr(filename);
-            strcat(pathname,filename);
-            strcat(pathname,".jpg");
+        if (shoot) {
+            /* Keep the video around the snapshot if recording on events */
+            writerTrigger();
+        }
 
-            /* Open a file for storing the image */
-            outFile = fopen(pathname, "w");
-            Dmai_dbg1("pathname is %s\n",pathname);
+        frame->shoot = shoot;
 
-            if (outFile == NULL) {
-                ERR("Failed to open %s for writing\n", pathname);
-                cleanup(THREAD_FAILURE);
+        /* Pass the encoder changes on, applied before the next frame */
+        while (msgrcv(ctlId, &ctl, VIDEOCTL_MSG_SIZE, VIDEOCTL_MSG_TYPE,
+                      IPC_NOWAIT) >= 0) {
+            if (ctl.stream >= 0 && ctl.stream < envp->numStreams) {
+                postControl(&encoders[ctl.stream], &ctl);
             }
-
-		    if (Buffer_getNumBytesUsed(hDstBuf)) {
-            	if (fwrite(Buffer_getUserPtr(hDstBuf),Buffer_getNumBytesUsed(hDstBuf), 1, outFile) != 1) {
-		            ERR("Error writing to image file\n");
-		            cleanup(THREAD_FAILURE);
-                }
-       	    }
-
-            if (outFile) {
-                fclose(outFile);
-                outFile = NULL;
+            else {
+                ERR("No video stream %d to control\n", (Int) ctl.stream);
             }
-            msg.m_type = 0;
         }
 
-        /* Decode the capture buffer */
-        if (Venc1_process(hVe1, hCapBuf, hDstBuf) < 0) {
-            ERR("Failed to encode video buffer\n");
-            cleanup(THREAD_FAILURE);
-        }
+        /*
+         * Every stream gets the frame, also those leaving it out, and the
+         * capture thread gets it back once the last of them is done.
+         */
+        frame->refs = envp->numStreams;
 
-        /* Decode the resized buffer */
-        if (Venc1_process(hVe2, hRzbBuf, hsDstBuf) < 0) {
-            ERR("Failed to encode video buffer\n");
-            cleanup(THREAD_FAILURE);
-        }
+        for (i = 0; i < envp->numStreams; i++) {
+            if (!envp->serial) {
+                if (Fifo_put(encoders[i].hFrameFifo, hCapBuf) < 0) {
+                    ERR("Failed to send frame to stream %d\n", i);
+                    cleanup(THREAD_FAILURE);
+                }
+                continue;
+            }
 
-        /* Send encoded buffer to writer thread for filesystem output */
-        if (Fifo_put(envp->hWriterInFifo, hDstBuf) < 0) {
-            ERR("Failed to send buffer to writer thread\n");
-            cleanup(THREAD_FAILURE);
-        }
+            ret = encodeFrame(&encoders[i], frame);
 
-        /* Send encoded buffer to writer thread for uploading */
-        if (Fifo_put(envp->hWriterInFifo, hsDstBuf) < 0) {
-            ERR("Failed to send buffer to writer thread\n");
-            cleanup(THREAD_FAILURE);
-        }
+            if (releaseFrame(&pipe, frame) < 0 || ret < 0) {
+                cleanup(THREAD_FAILURE);
+            }
 
-        /* Return buffer to capture thread,signal 
-           capture thread that we are done with encoding one frame */
-        if (Fifo_put(envp->hCaptureInFifo, hCapBuf) < 0) {
-            ERR("Failed to send buffer to capture thread\n");
-            cleanup(THREAD_FAILURE);
+            /* Did a sink thread flush its fifo? */
+            if (ret == Dmai_EFLUSH) {
+                cleanup(THREAD_SUCCESS);
+            }
         }
-
-        /* Increment statistics for the user interface */
-        gblIncVideoBytesProcessed(Buffer_getNumBytesUsed(hsDstBuf));
-
-        frameCnt++;
     }
 
 cleanup:
@@ -424,37 +1154,91 @@ cleanup:
     Rendezvous_force(envp->hRendezvousInit);
     Rendezvous_force(envp->hRendezvousWriter);
     Pause_off(envp->hPauseProcess);
-    Fifo_flush(envp->hWriterInFifo);
+    for (i = 0; i < envp->numStreams; i++) {
+        if (envp->streams[i].sink != VideoSink_NONE) {
+            Fifo_flush(envp->streams[i].hInFifo);
+        }
+    }
+
+    /* The encode threads finish the frame at hand, then stop */
+    for (i = 0; i < envp->numStreams; i++) {
+        if (encoders[i].hFrameFifo) {
+            Fifo_flush(encoders[i].hFrameFifo);
+        }
+    }
+
+    for (i = 0; i < envp->numStreams; i++) {
+        if (encoders[i].started) {
+            pthread_join(encoders[i].thread, NULL);
+
+            if (encoders[i].status == THREAD_FAILURE) {
+                status = THREAD_FAILURE;
+            }
+        }
+    }
+
     Fifo_flush(envp->hCaptureInFifo);
+    Fifo_flush(envp->hResizeInFifo);
+    Fifo_flush(envp->hSnapshotInFifo);
 
     /* Make sure the other threads aren't waiting for init to complete */
     Rendezvous_meet(envp->hRendezvousCleanup);
 
     /* Clean up the thread before exiting */
-    if (outFile) {
-        fclose(outFile);
+    for (i = 0; i < envp->numStreams; i++) {
+        printEncodeStats(i, &envp->streams[i].encode);
+
+        if (envp->streams[i].sink != VideoSink_NONE) {
+            printStalls(i, &envp->streams[i].stalls);
+        }
+    }
+
+    printThroughput(&pipe, envp);
+
+    if (envp->snapshotsMissed) {
+        printf("Video: %u snapshots missed while one was being encoded\n",
+               (unsigned) envp->snapshotsMissed);
     }
 
     if (hBufTab) {
         BufTab_delete(hBufTab);
     }
 
-    if (hVe1) {
-        Venc1_delete(hVe1);
+    if (hRszBufTab) {
+        BufTab_delete(hRszBufTab);
     }
 
-    if (hVe2) {
-        Venc1_delete(hVe2);
-    }
+    for (i = 0; i < envp->numStreams; i++) {
+        enc = &encoders[i];
+
+        if (enc->hFrameFifo) {
+            Fifo_delete(enc->hFrameFifo);
+        }
+
+        if (enc->hRsz) {
+            Resize_delete(enc->hRsz);
+        }
 
-	if (hIe) {
-	    Ienc1_delete(hIe);
-	}
+        if (enc->hRszBuf) {
+            Buffer_delete(enc->hRszBuf);
+        }
+
+        if (enc->hOwnBuf) {
+            Buffer_delete(enc->hOwnBuf);
+        }
 
-    if (hEngine) {
-        Engine_close(hEngine);
+        if (enc->hVe) {
+            Venc1_delete(enc->hVe);
+        }
+
+        if (enc->hEngine) {
+            Engine_close(enc->hEngine);
+        }
     }
 
+    pthread_mutex_destroy(&pipe.mutex);
+    pthread_mutex_destroy(&pipe.shootMutex);
+
     return status;
 }
 
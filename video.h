@@ -18,28 +18,81 @@
 #include <ti/sdo/dmai/Pause.h>
 #include <ti/sdo/dmai/Rendezvous.h>
 
+#include "shm.h"
+
+/* Most streams encoded from the same capture */
+#define VIDEO_MAX_STREAMS   4
+
+/* Times a stream had to wait for a buffer to come back */
+typedef struct VideoStalls {
+    UInt32            stalls;
+    UInt32            maxUs;            /* longest wait */
+    UInt64            totalUs;
+} VideoStalls;
+
+/* Frames a stream encoded and the time it took */
+typedef struct VideoEncodeStats {
+    UInt32            frames;
+    UInt32            skipped;          /* left out for its frame rate */
+    UInt32            idle;             /* left out for lack of readers */
+    UInt32            maxUs;
+    UInt64            totalUs;          /* scaling and encoding */
+} VideoEncodeStats;
+
+/* Where the encoded frames of a stream go */
+typedef enum VideoSink {
+    VideoSink_NONE = 0,                 /* nowhere, only encoded */
+    VideoSink_FILE,                     /* the writer thread */
+    VideoSink_SHM                       /* a publish thread of its own */
+} VideoSink;
+
+/*
+ * One encoded output of the capture. A stream at the capture resolution
+ * encodes the captured frame, one at the resizer's resolution the frame
+ * the capture driver resized along with it, any other a copy it scales
+ * down itself. Each stream is encoded in a thread of its own the video
+ * thread starts, the captured frame goes back once all are done with it.
+ */
+typedef struct VideoStream {
+    Int32             width;
+    Int32             height;
+    Int               bitRate;          /* negative for variable */
+    Int               frameRate;        /* fps * 1000, 0 for every frame */
+    VideoSink         sink;
+    Fifo_Handle       hInFifo;          /* encoded frames to the sink */
+    Fifo_Handle       hOutFifo;         /* and the buffers coming back */
+    Int32             outBufSize;       /* set by the video thread */
+    SHM_ST           *shm;              /* set by the publish thread */
+    VideoStalls       stalls;           /* written by its encode thread */
+    VideoEncodeStats  encode;
+} VideoStream;
+
 /* Environment passed when creating the thread */
 typedef struct VideoEnv {
     Rendezvous_Handle hRendezvousInit;
     Rendezvous_Handle hRendezvousCleanup;
     Rendezvous_Handle hRendezvousWriter;
     Pause_Handle      hPauseProcess;
-    Fifo_Handle       hWriterInFifo;
-    Fifo_Handle       hWriterOutFifo;
     Fifo_Handle       hCaptureInFifo;
     Fifo_Handle       hCaptureOutFifo;
+    Fifo_Handle       hResizeInFifo;    /* buffers for the resized frames */
+    Fifo_Handle       hResizeOutFifo;   /* and the frames, if any */
+    Fifo_Handle       hSnapshotInFifo;
+    Fifo_Handle       hSnapshotOutFifo;
     Char             *videoEncoder;
     Char             *engineName;
     Void             *params;
     Void             *dynParams;
-    Int32             outBufSize;
-    Int32             outsBufSize;
-    Int               videoBitRate;
+    Int32             inBufSize;
     Int               videoFrameRate;
     Int32             imageWidth;
     Int32             imageHeight;
-    Int32             resizeWidth;
+    Int32             resizeWidth;      /* of the resized frames */
     Int32             resizeHeight;
+    Int               numStreams;
+    VideoStream       streams[VIDEO_MAX_STREAMS];
+    Bool              serial;           /* all encoded in the video thread */
+    UInt32            snapshotsMissed;  /* the last one still encoding */
 } VideoEnv;
 
 /* Thread function prototype */
@@ -0,0 +1,43 @@
+/*
+ * videoctl.h
+ *
+ * Runtime control of the video encoders. Another process sends a
+ * VideoCtlMsg on the System V message queue with the key
+ * ftok(VIDEOCTL_PATH, VIDEOCTL_PROJ_ID); the encoder of the stream
+ * applies it before its next frame, without being restarted.
+ */
+
+#ifndef _VIDEOCTL_H
+#define _VIDEOCTL_H
+
+#include <xdc/std.h>
+
+/* Key of the control queue, apart from the snapshot queue */
+#define VIDEOCTL_PATH           "/tmp"
+#define VIDEOCTL_PROJ_ID        'v'
+
+/* mtype of every control message */
+#define VIDEOCTL_MSG_TYPE       1
+
+/* Streams that are always there, any given with -T follow from 2 on */
+#define VIDEOCTL_STREAM_MAIN    0       /* recorded, full resolution */
+#define VIDEOCTL_STREAM_SUB     1       /* published, resized */
+
+/*
+ * A change to one encoder. Fields left at 0 keep their value. The bit
+ * rate can't go above what the encoder was created with, the frame rate
+ * above the capture's, frames are left out to keep to it.
+ */
+typedef struct VideoCtlMsg {
+    long    mtype;              /* VIDEOCTL_MSG_TYPE */
+    Int32   stream;
+    Int32   bitRate;            /* bits per second */
+    Int32   frameRate;          /* frames per 1000 seconds */
+    Int32   intraInterval;      /* frames from one IDR to the next */
+    Int32   forceIdr;           /* make the next frame an IDR */
+} VideoCtlMsg;
+
+/* Bytes of a message after the mtype, as msgsnd() and msgrcv() take it */
+#define VIDEOCTL_MSG_SIZE       (sizeof(VideoCtlMsg) - sizeof(long))
+
+#endif /* _VIDEOCTL_H */
@@ -12,7 +12,6 @@
 #include <stdio.h>
 #include <string.h>
 #include <signal.h>
-#include <sys/time.h>
 
 #include <xdc/std.h>
 
@@ -23,24 +22,304 @@
 #include <ti/sdo/dmai/Time.h>
 
 #include "writer.h"
-#include "shm.h"
+#include "nal.h"
+#include "frame.h"
+#include "storage.h"
+#include "mp4mux.h"
+#include "eventbuf.h"
+#include "quota.h"
+#include "recovery.h"
+#include "latency.h"
 #include "../demo.h"
 
 #define MODULE_NAME     "Writer Thread"
 
-/* Number of buffers in writer pipe */
-#define NUM_WRITER_BUFS         1
+/* Bytes of recording buffered in RAM while the SD card is busy */
+#define STORAGE_BUF_SIZE        (4 * 1024 * 1024)
 
-#define SHM_DIR2 "/shm/video/v2"
+/* Bytes handed to the file system per write */
+#define STORAGE_CHUNK_SIZE      (256 * 1024)
 
-/* Global timer alarm flag */
-sig_atomic_t    storage_timer_alarm;
+/* Bytes of a GOP buffered while its MP4 fragment is built */
+#define MP4_FRAGMENT_SIZE       (1024 * 1024)
 
-/* Timer handler */
-static void
-storage_timer_signal_handler(int signo)
+/* Keyframe index records queued for the storage thread at a time */
+#define INDEX_BATCH             16
+
+/* Bytes of keyframe index buffered and written per chunk */
+#define INDEX_BUF_SIZE          (64 * 1024)
+#define INDEX_CHUNK_SIZE        4096
+
+/* Bytes of recent video kept in RAM for when an event comes */
+#define EVENT_BUF_SIZE          (8 * 1024 * 1024)
+
+/* Bytes of speech buffered while its MP4 fragment is built */
+#define MP4_AUDIO_SIZE          (64 * 1024)
+
+/*
+ * Record of the .idx file written next to each .264 file, one for every
+ * IDR in little endian, so a player can binary search it for a time.
+ */
+typedef struct IndexRecord {
+    UInt64      offset;         /* of the IDR in the .264 file */
+    UInt64      time;           /* capture time in microseconds */
+} IndexRecord;
+
+/* The recording file being written */
+typedef struct Segment {
+    Char       *extension;
+    Bool        open;
+    UInt64      start;          /* capture time of its first frame */
+    UInt32      bytes;
+    Storage    *index;          /* keyframe index or NULL */
+    Int         numRecords;
+    IndexRecord records[INDEX_BATCH];
+} Segment;
+
+/* Set when an event asks for a recording */
+static volatile sig_atomic_t eventPending = 0;
+
+/******************************************************************************
+ * openSegment
+ ******************************************************************************/
+static Int openSegment(Storage *storage, Int32 nextSize, Segment *seg)
+{
+    Char    pathname[64]    = {"\0"};
+    Char    filename[25]    = {"\0"};
+    Int     len;
+
+    /* Name the segment after the time it starts */
+    strcpy(pathname, RECORD_DIR);
+    Time_getStr(filename);
+    strcat(pathname,filename);
+    len = strlen(pathname);
+    strcat(pathname,seg->extension);
+    Dmai_dbg1("pathname is %s\n",pathname);
+
+    /* The storage thread opens it, this never waits for the SD card */
+    if (storageOpen(storage, pathname, nextSize) < 0) {
+        ERR("Failed to open %s for writing\n", pathname);
+        return Dmai_EFAIL;
+    }
+
+    /* The keyframe index goes next to it under the same name */
+    if (seg->index) {
+        strcpy(pathname + len, ".idx");
+
+        if (storageOpen(seg->index, pathname, 0) < 0) {
+            ERR("Failed to open %s for writing\n", pathname);
+        }
+    }
+
+    return Dmai_EOK;
+}
+
+/******************************************************************************
+ * flushIndex
+ ******************************************************************************/
+static Void flushIndex(Segment *seg)
+{
+    /*
+     * Records go out in batches to keep the storage thread's work small,
+     * a batch that doesn't fit only costs some seek points.
+     */
+    if (seg->index && seg->numRecords > 0) {
+        storagePut(seg->index, (Int8 *) seg->records,
+                   seg->numRecords * sizeof(IndexRecord), TRUE);
+        seg->numRecords = 0;
+    }
+}
+
+/******************************************************************************
+ * indexFrame
+ ******************************************************************************/
+static Void indexFrame(Segment *seg, UInt64 offset, UInt64 time)
+{
+    if (seg->index) {
+        seg->records[seg->numRecords].offset = offset;
+        seg->records[seg->numRecords].time = time;
+
+        if (++seg->numRecords == INDEX_BATCH) {
+            flushIndex(seg);
+        }
+    }
+}
+
+/******************************************************************************
+ * closeSegment
+ ******************************************************************************/
+static Void closeSegment(Storage *storage, Mp4Mux *mux, Segment *seg)
+{
+    if (seg->open) {
+        if (mux) {
+            mp4MuxFinish(mux);
+        }
+
+        flushIndex(seg);
+        if (seg->index) {
+            storageClose(seg->index);
+        }
+
+        storageClose(storage);
+        seg->open = FALSE;
+    }
+}
+
+/******************************************************************************
+ * recordAudio
+ ******************************************************************************/
+static Void recordAudio(WriterEnv *envp, Mp4Mux *mux, UInt64 until)
+{
+    Int32   size = audioBufGetBlockSize(envp->audioBuf);
+    Int8   *buf;
+    UInt64  time;
+
+    /* The muxer drops what doesn't belong to the file being written */
+    while ((buf = audioBufPeek(envp->audioBuf, &time)) != NULL &&
+           time < until) {
+        if (mux) {
+            mp4MuxPutAudio(mux, (UInt8 *) buf, size, time);
+        }
+
+        audioBufRelease(envp->audioBuf);
+    }
+}
+
+/******************************************************************************
+ * recordFrame
+ ******************************************************************************/
+static Void recordFrame(WriterEnv *envp, Storage *storage, Mp4Mux *mux,
+                        Segment *seg, Int8 *buf, Int32 size, UInt64 time,
+                        Bool key)
+{
+    Int ret;
+
+    /* The speech captured up to the frame, into the fragment it ends */
+    if (envp->audioBuf) {
+        recordAudio(envp, mux, time);
+    }
+
+    /*
+     * Start a new segment at the first IDR past the time or size limit, so
+     * every file can be played on its own.
+     */
+    if (seg->open && key && seg->bytes > 0 &&
+        ((envp->segmentTime > 0 &&
+          time - seg->start >= (UInt64) envp->segmentTime * 1000000) ||
+         (envp->segmentSize > 0 && seg->bytes >= envp->segmentSize))) {
+
+        /* The last fragment and the index go to the old file */
+        if (mux) {
+            mp4MuxFinish(mux);
+        }
+
+        flushIndex(seg);
+        seg->open = FALSE;
+    }
+
+    if (!seg->open) {
+        if (!key) {
+            return;
+        }
+
+        /* The size of the segment just finished is the best guess */
+        if (openSegment(storage, envp->segmentSize > 0 ? envp->segmentSize :
+                        seg->bytes, seg) < 0) {
+            return;
+        }
+
+        seg->open = TRUE;
+        seg->start = time;
+        seg->bytes = 0;
+    }
+
+    /*
+     * Queue the encoded frame for disk. If the storage ring is full the
+     * frame is dropped from the recording, the live stream goes on.
+     */
+    if (mux) {
+        ret = mp4MuxPut(mux, (UInt8 *) buf, size, time, key);
+    }
+    else {
+        ret = storagePut(storage, buf, size, key);
+
+        if (ret == Dmai_EOK && key) {
+            indexFrame(seg, seg->bytes, time);
+        }
+    }
+
+    if (ret == Dmai_EOK) {
+        seg->bytes += size;
+    }
+}
+
+/******************************************************************************
+ * quotaIdle
+ ******************************************************************************/
+static Bool quotaIdle(Void *arg)
 {
-    storage_timer_alarm = 1;
+    return quotaStep((Quota *) arg);
+}
+
+/******************************************************************************
+ * printStorageStats
+ ******************************************************************************/
+static Void printStorageStats(StorageStats *stats)
+{
+    Int             i;
+
+    printf("Storage: %u files, %u frames (%u dropped), %llu bytes in %u "
+           "writes, slowest %u ms\n", (unsigned) stats->files,
+           (unsigned) stats->frames,
+           (unsigned) stats->dropped, (unsigned long long) stats->bytes,
+           (unsigned) stats->writes, (unsigned) stats->maxWriteMs);
+
+    if (stats->syncs) {
+        printf("Storage: %u syncs, slowest %u ms\n", (unsigned) stats->syncs,
+               (unsigned) stats->maxSyncMs);
+    }
+
+    printf("Storage: write ms");
+    for (i = 0; i < STORAGE_HIST_BUCKETS; i++) {
+        printf(" %s%d:%u", i < STORAGE_HIST_BUCKETS - 1 ? "<" : ">=",
+               1 << (i < STORAGE_HIST_BUCKETS - 1 ? i : i - 1),
+               (unsigned) stats->hist[i]);
+    }
+    printf("\n");
+}
+
+/******************************************************************************
+ * printMp4Stats
+ ******************************************************************************/
+static Void printMp4Stats(Mp4MuxStats *stats)
+{
+    printf("Mp4: %u files, %u frames (%u skipped), %u fragments (%u dropped), "
+           "%llu bytes of boxes for %llu of video\n", (unsigned) stats->files,
+           (unsigned) stats->frames, (unsigned) stats->skipped,
+           (unsigned) stats->fragments, (unsigned) stats->dropped,
+           (unsigned long long) stats->boxBytes,
+           (unsigned long long) stats->dataBytes);
+
+    if (stats->audioBytes || stats->audioDropped) {
+        printf("Mp4: %llu bytes of audio, %u of silence filled in, "
+               "%u dropped\n",
+               (unsigned long long) stats->audioBytes,
+               (unsigned) stats->audioPadded, (unsigned) stats->audioDropped);
+    }
+
+    if (stats->frames) {
+        printf("Mp4: %llu us per frame muxing, slowest %u us\n",
+               (unsigned long long) (stats->muxUs / stats->frames),
+               (unsigned) stats->maxMuxUs);
+    }
+}
+
+/******************************************************************************
+ * writerTrigger
+ ******************************************************************************/
+Void writerTrigger(Void)
+{
+    eventPending = 1;
 }
 
 /******************************************************************************
@@ -50,117 +329,157 @@ Void *writerThrFxn(Void *arg)
 {
     WriterEnv          *envp            = (WriterEnv *) arg;
     Void               *status          = THREAD_SUCCESS;
-    FILE               *outFile         = NULL;
+    Storage            *storage         = NULL;
+    StorageStats        storageStats;
+    Mp4Mux             *mux             = NULL;
+    Mp4MuxStats         mp4Stats;
+    Bool                recovering      = FALSE;
+    Quota              *quota           = NULL;
+    QuotaStats          quotaStats;
+    EventBuf           *eventBuf        = NULL;
+    EventBufStats       eventStats;
+    AudioBufStats       audioStats;
+    Segment             seg;
+    FrameInfo          *info;
+    Int8               *buf;
+    Int32               size;
+    UInt64              time;
+    Bool                key;
+    Int8               *evBuf;
+    Int32               evSize;
+    UInt64              evTime;
+    Bool                evKey;
+    Bool                eventActive     = FALSE;
+    UInt64              eventEnd        = 0;
+    UInt32              events          = 0;
+    Int32               eventMargin     = STORAGE_CHUNK_SIZE;
     Buffer_Attrs        bAttrs          = Buffer_Attrs_DEFAULT;
     BufTab_Handle       hBufTab         = NULL;
-    BufTab_Handle       hsBufTab        = NULL;
-    Buffer_Handle       hOutBuf, hsOutBuf;
+    Buffer_Handle       hOutBuf;
     Int                 fifoRet;
     Int                 bufIdx;
     Int                 frameCnt        = 0;
-    struct sigaction    sa;
-    struct itimerval    itv;
-    Int                 storage_timer_resolution;
-    SHM_ST	           *shm_pns         = NULL;
-    Char                pathname[40]    = {"\0"};
-    Char                filename[25]    = {"\0"};
+    LatencyHist        *writeHist       = latencyCreate("s0 write");
+    LatencyHist        *fileHist        = latencyCreate("s0 to file");
+    UInt64              written;
 
+    /* No recording file yet, raw H.264 unless muxing */
+    memset(&seg, 0, sizeof(seg));
+    seg.extension = ".264";
 
-    /* Create a share memory for tansporting data to upper layer */
-	shm_pns = createShm(SHM_DIR2, envp->outsBufSize);
-    Dmai_dbg1("bufsize is %d\n",envp->outsBufSize);
+    /*
+     * Create a table of buffers for communicating buffers to
+     * and from the video thread.
+     */
+    hBufTab = BufTab_create(envp->numBufs, envp->outBufSize, &bAttrs);
 
-    if (shm_pns == NULL) {
-        ERR("Failed to create share memory\n");
+    if (hBufTab == NULL) {
+        ERR("Failed to allocate contiguous buffers\n");
         cleanup(THREAD_FAILURE);
     }
 
-    /* Set the timer for storing data to file periodically */
-    memset(&sa, 0, sizeof(struct sigaction));
-    sa.sa_handler = storage_timer_signal_handler;
-    sigemptyset(&sa.sa_mask);
-
-    if (sigaction(SIGALRM, &sa, NULL) == -1) {
-        ERR("Failed to set signal handler\n");
-        cleanup(THREAD_FAILURE);
+    /* Send all buffers to the video thread to be filled with encoded data */
+    for (bufIdx = 0; bufIdx < envp->numBufs; bufIdx++) {
+        if (Fifo_put(envp->hOutFifo, BufTab_getBuf(hBufTab, bufIdx)) < 0) {
+            ERR("Failed to send buffer to video thread\n");
+            cleanup(THREAD_FAILURE);
+        }
     }
 
-    storage_timer_resolution = 60*60;
-    /*TODO : envp->timer_resolution */
-    itv.it_interval.tv_sec = storage_timer_resolution ;
-    itv.it_interval.tv_usec = 0;
-    itv.it_value.tv_sec = storage_timer_resolution ;
-    itv.it_value.tv_usec = 0;
+    /* Repair the last recording if power was cut while it was written */
+    if (recoveryStart(RECORD_DIR) == Dmai_EOK) {
+        recovering = TRUE;
+    }
 
-    /*
-     * Create a table of buffers for communicating buffers to
-     * and from the video thread.
-     */
-    hBufTab = BufTab_create(NUM_WRITER_BUFS, envp->outBufSize, &bAttrs);
+    /* Record through the storage thread so disk stalls don't stop us */
+    storage = storageCreate(STORAGE_BUF_SIZE, STORAGE_CHUNK_SIZE);
 
-    if (hBufTab == NULL) {
-        ERR("Failed to allocate contiguous buffers\n");
+    if (storage == NULL) {
+        ERR("Failed to create storage thread\n");
         cleanup(THREAD_FAILURE);
     }
 
+    /* Bound what a power cut can take, the storage thread does the syncs */
+    storageSetSync(storage, envp->syncMs,
+                   (UInt32) envp->syncSize * 1024 * 1024);
+
     /*
-     * Create a table of buffers for communicating resized buffers to
-     * and from the video thread.
+     * Make room on a full card by deleting the oldest recordings and
+     * snapshots. The storage thread does it between writes.
      */
-    hsBufTab = BufTab_create(NUM_WRITER_BUFS, envp->outsBufSize, &bAttrs);
+    if (envp->freeSpace > 0) {
+        quota = quotaCreate((UInt64) envp->freeSpace * 1024 * 1024);
 
-    if (hsBufTab == NULL) {
-        ERR("Failed to allocate contiguous buffers\n");
-        cleanup(THREAD_FAILURE);
+        if (quota == NULL) {
+            ERR("Failed to create storage quota\n");
+            cleanup(THREAD_FAILURE);
+        }
+
+        /* A missing directory just isn't looked after */
+        quotaAddDir(quota, RECORD_DIR);
+        quotaAddDir(quota, IMAGE_DIR);
+        storageSetIdleFxn(storage, quotaIdle, quota);
     }
 
-    /* Send all buffers to the video thread to be filled with encoded data */
-    for (bufIdx = 0; bufIdx < NUM_WRITER_BUFS; bufIdx++) {
-        if (Fifo_put(envp->hOutFifo, BufTab_getBuf(hBufTab, bufIdx)) < 0) {
-            ERR("Failed to send buffer to video thread\n");
+    /* Wrap the recording in MP4 fragments, one per GOP */
+    if (envp->mp4) {
+        mux = mp4MuxCreate(storage, envp->imageWidth, envp->imageHeight,
+                           MP4_FRAGMENT_SIZE);
+
+        if (mux == NULL) {
+            ERR("Failed to create MP4 muxer\n");
             cleanup(THREAD_FAILURE);
         }
 
-        if (Fifo_put(envp->hOutFifo, BufTab_getBuf(hsBufTab, bufIdx)) < 0) {
-            ERR("Failed to send buffer to display thread\n");
+        seg.extension = ".mp4";
+
+        /* Speech goes into the same fragments as the video */
+        if (envp->audioBuf &&
+            mp4MuxSetAudio(mux, envp->ulaw ? TRUE : FALSE,
+                           MP4_AUDIO_SIZE) < 0) {
+            ERR("Failed to add an audio track to the MP4 muxer\n");
             cleanup(THREAD_FAILURE);
         }
+
+        /* Whole fragments go to storage at once */
+        eventMargin += MP4_FRAGMENT_SIZE;
     }
 
-    /* Signal that initialization is done and wait for other threads */
-    Rendezvous_meet(envp->hRendezvousInit);
+    /*
+     * Raw H.264 has no index of its own, the IDRs are listed in a file
+     * next to it written by a storage thread of its own.
+     */
+    if (mux == NULL) {
+        seg.index = storageCreate(INDEX_BUF_SIZE, INDEX_CHUNK_SIZE);
 
-    /* Open the output video file */
-    strcpy(pathname,"/mnt/mmc/video/\0");
-    Time_getStr(filename);
-    strcat(pathname,filename);
-    strcat(pathname,".264");
-    outFile = fopen(pathname, "w");
-    Dmai_dbg1("pathname is %s\n",pathname);
+        if (seg.index == NULL) {
+            ERR("Failed to create index storage thread\n");
+            cleanup(THREAD_FAILURE);
+        }
 
-    if (outFile == NULL) {
-        ERR("Failed to open %s for writing\n", pathname);
-        cleanup(THREAD_FAILURE);
+        /* A few records, in step with the recording */
+        storageSetSync(seg.index, envp->syncMs, 0);
     }
-    while (TRUE) {
-        /* Get an encoded buffer from the video thread */
-        fifoRet = Fifo_get(envp->hInFifo, &hOutBuf);
 
-        if (fifoRet < 0) {
-            ERR("Failed to get buffer from video thread\n");
+    /* Only record around events, keeping the last seconds until one comes */
+    if (envp->preEvent > 0) {
+        eventBuf = eventBufCreate(EVENT_BUF_SIZE, envp->preEvent * 1000);
+
+        if (eventBuf == NULL) {
+            ERR("Failed to create event buffer\n");
             cleanup(THREAD_FAILURE);
         }
+    }
 
-        /* Did the video thread flush the fifo? */
-        if (fifoRet == Dmai_EFLUSH) {
-            cleanup(THREAD_SUCCESS);
-        }
+    /* Signal that initialization is done and wait for other threads */
+    Rendezvous_meet(envp->hRendezvousInit);
 
-        /* Get an encoded resized buffer from the video thread */
-        fifoRet = Fifo_get(envp->hInFifo, &hsOutBuf);
+    while (TRUE) {
+        /* Get an encoded buffer from the video thread */
+        fifoRet = Fifo_get(envp->hInFifo, &hOutBuf);
 
         if (fifoRet < 0) {
-            ERR("Failed to get resized buffer from video thread\n");
+            ERR("Failed to get buffer from video thread\n");
             cleanup(THREAD_FAILURE);
         }
 
@@ -169,15 +488,71 @@ Void *writerThrFxn(Void *arg)
             cleanup(THREAD_SUCCESS);
         }
 
-        /* Store the encoded resize frame to shm */
-        writeShm(shm_pns, (char *) Buffer_getUserPtr(hsOutBuf),
-                 (unsigned int) Buffer_getNumBytesUsed(hsOutBuf));
-        /* Store the encoded frame to disk */
         if (Buffer_getNumBytesUsed(hOutBuf)) {
-            if (fwrite(Buffer_getUserPtr(hOutBuf),
-                       Buffer_getNumBytesUsed(hOutBuf), 1, outFile) != 1) {
-                ERR("Error writing the encoded data to video file\n");
-                cleanup(THREAD_FAILURE);
+            info = getFrameInfo(hOutBuf);
+            buf  = Buffer_getUserPtr(hOutBuf);
+            size = Buffer_getNumBytesUsed(hOutBuf);
+            time = info ? info->captureTime : frameTime();
+            key  = nalScanFrame((UInt8 *) buf, size) & NAL_IS_IDR ?
+                   TRUE : FALSE;
+
+            if (eventBuf == NULL) {
+                recordFrame(envp, storage, mux, &seg, buf, size, time, key);
+
+                /* In the storage ring, on its way to the card */
+                if (info) {
+                    written = frameTime();
+                    latencyAdd(writeHist, info->encodeTime, written);
+                    latencyAdd(fileHist, info->captureTime, written);
+                }
+            }
+            else {
+                eventBufPut(eventBuf, buf, size, time, key);
+
+                /* Record until postEvent seconds past the last event */
+                if (eventPending) {
+                    eventPending = 0;
+                    eventEnd = time + (UInt64) envp->postEvent * 1000000;
+
+                    if (!eventActive) {
+                        eventActive = TRUE;
+                        events++;
+                    }
+                }
+
+                /*
+                 * Hand the history to storage as fast as its ring takes it,
+                 * the storage thread writes it out in large chunks. Frames
+                 * that don't fit yet wait here.
+                 */
+                while (eventActive &&
+                       (evBuf = eventBufPeek(eventBuf, &evSize, &evTime,
+                                             &evKey)) != NULL) {
+                    if (evTime > eventEnd) {
+                        closeSegment(storage, mux, &seg);
+                        eventActive = FALSE;
+                        break;
+                    }
+
+                    if (storageRoom(storage) < evSize + eventMargin) {
+                        break;
+                    }
+
+                    recordFrame(envp, storage, mux, &seg, evBuf, evSize,
+                                evTime, evKey);
+                    eventBufRelease(eventBuf);
+                }
+
+                if (!eventActive) {
+                    eventBufAge(eventBuf, time);
+
+                    /* Only the speech of the video still held is kept */
+                    if (envp->audioBuf) {
+                        recordAudio(envp, NULL,
+                                    eventBufPeek(eventBuf, &evSize, &evTime,
+                                                 &evKey) ? evTime : time);
+                    }
+                }
             }
         } else {
             printf("Warning, writer received 0 byte encoded frame\n");
@@ -189,12 +564,6 @@ Void *writerThrFxn(Void *arg)
             cleanup(THREAD_FAILURE);
         }
 
-        /* Return resized buffer to video thread */
-        if (Fifo_put(envp->hOutFifo, hsOutBuf) < 0) {
-            ERR("Failed to send buffer to video thread\n");
-            cleanup(THREAD_FAILURE);
-        }
-
         frameCnt++;
     }
 
@@ -208,25 +577,61 @@ cleanup:
     Rendezvous_meet(envp->hRendezvousCleanup);
 
     /* Clean up the thread before exiting */
-    if (outFile) {
-        fclose(outFile);
+    if (mux) {
+        /* Complete the last file before storage closes it */
+        mp4MuxFinish(mux);
+        mp4MuxGetStats(mux, &mp4Stats);
+        mp4MuxDelete(mux);
+        printMp4Stats(&mp4Stats);
     }
 
-    if (hBufTab) {
-        BufTab_delete(hBufTab);
+    if (envp->audioBuf) {
+        audioBufGetStats(envp->audioBuf, &audioStats);
+        printf("Audio: %u blocks (%u dropped)\n", (unsigned) audioStats.blocks,
+               (unsigned) audioStats.dropped);
     }
-	
-    if (hsBufTab) {
-        BufTab_delete(hsBufTab);
+
+    if (eventBuf) {
+        eventBufGetStats(eventBuf, &eventStats);
+        eventBufDelete(eventBuf);
+        printf("Events: %u recorded, history of %u frames (%u skipped, "
+               "%u evicted early), at most %u bytes\n", (unsigned) events,
+               (unsigned) eventStats.frames, (unsigned) eventStats.skipped,
+               (unsigned) eventStats.evicted, (unsigned) eventStats.maxBytes);
+    }
+
+    if (seg.index) {
+        flushIndex(&seg);
+        storageDelete(seg.index, NULL);
     }
 
-	if (shm_pn) {
-		deleteShm(shm_pn);
-	}
+    if (storage) {
+        /* Waits for the queued frames to reach the file */
+        storageDelete(storage, &storageStats);
+        printStorageStats(&storageStats);
+    }
 
-	if (shm_pns) {
-		deleteShm(shm_pns);
-	}
+    /* Every file is closed, nothing to repair next time */
+    if (recovering) {
+        recoveryEnd(RECORD_DIR);
+    }
 
+    /* Only once the storage thread is done with it */
+    if (quota) {
+        quotaGetStats(quota, &quotaStats);
+        quotaDelete(quota);
+        printf("Quota: %u files of %llu bytes kept, %u deleted for %llu "
+               "bytes in %u steps, slowest %u ms\n",
+               (unsigned) quotaStats.files,
+               (unsigned long long) quotaStats.bytes,
+               (unsigned) quotaStats.deletedFiles,
+               (unsigned long long) quotaStats.deletedBytes,
+               (unsigned) quotaStats.steps, (unsigned) quotaStats.maxStepMs);
+    }
+
+    if (hBufTab) {
+        BufTab_delete(hBufTab);
+    }
+	
     return status;
 }
@@ -18,6 +18,18 @@
 #include <ti/sdo/dmai/Pause.h>
 #include <ti/sdo/dmai/Rendezvous.h>
 
+#include "audiobuf.h"
+
+/* Where recordings and snapshots go */
+#define RECORD_DIR          "/mnt/mmc/video/"
+#define IMAGE_DIR           "/mnt/mmc/image/"
+
+/* Most buffers in each pool between the video and writer or publish threads */
+#define WRITER_MAX_BUFS     4
+
+/* Largest segment size in megabytes, the byte count must fit an Int32 */
+#define WRITER_MAX_SEGMENT_MB   2047
+
 /* Environment passed when creating the thread */
 typedef struct WriterEnv {
     Rendezvous_Handle hRendezvousInit;
@@ -27,10 +39,25 @@ typedef struct WriterEnv {
     Fifo_Handle       hInFifo;
     Char             *videoFile;
     Int32             outBufSize;
-    Int32             outsBufSize;
+    Int               numBufs;          /* encoded frame buffers */
+    Int               segmentTime;      /* seconds per recorded file or 0 */
+    Int32             segmentSize;      /* bytes per recorded file or 0 */
+    Int               mp4;              /* record fragmented MP4 */
+    Int               preEvent;         /* seconds kept for events or 0 */
+    Int               postEvent;        /* seconds recorded after an event */
+    Int               freeSpace;        /* megabytes kept free or 0 */
+    Int               syncMs;           /* most ms of recording unsynced */
+    Int               syncSize;         /* most megabytes unsynced */
+    AudioBuf         *audioBuf;         /* speech to record or NULL */
+    Int               ulaw;             /* the speech is ulaw, not alaw */
+    Int32             imageWidth;
+    Int32             imageHeight;
 } WriterEnv;
 
 /* Thread function prototype */
 extern Void *writerThrFxn(Void *arg);
 
+/* Record around now if recording on events, safe from a signal handler */
+extern Void writerTrigger(Void);
+
 #endif /* _WRITER_H */